@@ -0,0 +1,101 @@
+#pragma once
+
+#include "interval.hpp"
+#include "math.hpp"
+#include "ray.hpp"
+
+/**
+ * @brief Axis-aligned bounding box, stored as one interval per axis.
+ */
+class AABB {
+    public:
+    Interval x, y, z;
+
+    AABB() {} // The default AABB is empty, since intervals are empty by default.
+
+    AABB(const Interval &x, const Interval &y, const Interval &z) : x(x), y(y), z(z) {
+        pad_to_minimums();
+    }
+
+    AABB(const Point3 &a, const Point3 &b) {
+        // Treat the two points a and b as extrema for the bounding box, so we don't require a
+        // particular minimum/maximum coordinate order.
+        x = (a[0] <= b[0]) ? Interval(a[0], b[0]) : Interval(b[0], a[0]);
+        y = (a[1] <= b[1]) ? Interval(a[1], b[1]) : Interval(b[1], a[1]);
+        z = (a[2] <= b[2]) ? Interval(a[2], b[2]) : Interval(b[2], a[2]);
+        pad_to_minimums();
+    }
+
+    AABB(const AABB &box0, const AABB &box1) {
+        x = Interval(box0.x, box1.x);
+        y = Interval(box0.y, box1.y);
+        z = Interval(box0.z, box1.z);
+    }
+
+    const Interval &axis_interval(int n) const {
+        if (n == 1) return y;
+        if (n == 2) return z;
+        return x;
+    }
+
+    bool is_empty() const { return x.min > x.max || y.min > y.max || z.min > z.max; }
+
+    /**
+     * @brief Slab test against a ray whose reciprocal direction has already been computed.
+     * The BVH traversal computes `inv_dir` once per ray instead of once per box.
+     */
+    bool hit(const Point3 &orig, const Vec3 &inv_dir, Interval ray_t) const {
+        for (int axis = 0; axis < 3; axis++) {
+            const Interval &ax = axis_interval(axis);
+
+            auto t0 = (ax.min - orig[axis]) * inv_dir[axis];
+            auto t1 = (ax.max - orig[axis]) * inv_dir[axis];
+
+            if (t0 > t1) std::swap(t0, t1);
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    bool hit(const Ray &r, Interval ray_t) const {
+        const Vec3 &d = r.direction();
+        return hit(r.origin(), Vec3(1 / d.x(), 1 / d.y(), 1 / d.z()), ray_t);
+    }
+
+    // Returns the index of the longest axis of the bounding box.
+    int longest_axis() const {
+        if (x.size() > y.size())
+            return x.size() > z.size() ? 0 : 2;
+        else
+            return y.size() > z.size() ? 1 : 2;
+    }
+
+    Point3 centroid() const {
+        return Point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+    }
+
+    // Used by the SAH builder to estimate the probability of a ray hitting the box.
+    Real surface_area() const {
+        if (is_empty()) return 0;
+        auto dx = x.size(), dy = y.size(), dz = z.size();
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    static const AABB empty, universe;
+
+    private:
+    void pad_to_minimums() {
+        // Adjust the AABB so that no side is narrower than some delta, padding if necessary.
+        Real delta = 0.0001;
+        if (x.size() < delta) x = x.expand(delta);
+        if (y.size() < delta) y = y.expand(delta);
+        if (z.size() < delta) z = z.expand(delta);
+    }
+};
+
+const AABB AABB::empty = AABB(Interval::empty, Interval::empty, Interval::empty);
+const AABB AABB::universe = AABB(Interval::universe, Interval::universe, Interval::universe);
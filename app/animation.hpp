@@ -0,0 +1,365 @@
+#pragma once
+
+#include "camera.hpp"
+#include "flat_scene.hpp"
+#include "image.hpp"
+#include "math.hpp"
+#include "transform.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Position of an animated object at a point in time, as an offset from where the scene
+ * declares it.
+ */
+struct Keyframe {
+    double time; // Seconds
+    Vec3 offset;
+};
+
+/**
+ * @brief Keyframed motion of the spheres and instances of a FlatScene. Between keyframes the
+ * offset is interpolated linearly, before the first and after the last it is held. Meshes are
+ * static, place a mesh through an instance to move it.
+ *
+ * apply() moves the objects and refits the scene BVH instead of rebuilding it (see
+ * FlatScene::refit), so a frame costs a pass over the primitives rather than a build. The tree
+ * keeps the structure of the rest pose, so large motion makes it slower to traverse.
+ */
+class SceneAnimation {
+    public:
+    // Motion of one object. `type` is PrimitiveType::Sphere or PrimitiveType::Instance.
+    struct Track {
+        PrimitiveType type;
+        int index;                  // Into FlatScene::spheres or FlatScene::instances
+        std::vector<Keyframe> keys; // Sorted by time
+    };
+
+    void add_sphere_keyframe(int sphere, double time, const Vec3 &offset) {
+        add_keyframe(PrimitiveType::Sphere, sphere, time, offset);
+    }
+
+    void add_instance_keyframe(int instance, double time, const Vec3 &offset) {
+        add_keyframe(PrimitiveType::Instance, instance, time, offset);
+    }
+
+    bool empty() const { return tracks.empty(); }
+
+    void clear() {
+        tracks.clear();
+        track_ids.clear();
+        rest_centers.clear();
+        rest_to_object.clear();
+        bound = false;
+    }
+
+    const std::vector<Track> &get_tracks() const { return tracks; }
+
+    // Time of the last keyframe.
+    double duration() const {
+        double end = 0;
+        for (const auto &track : tracks) {
+            end = std::max(end, track.keys.back().time);
+        }
+        return end;
+    }
+
+    /**
+     * @brief Moves the animated objects of `scene` to their positions at `time` and refits the
+     * BVH. The first call records the positions the scene declares, the offsets are relative to
+     * those, so the scene must not be rebuilt or edited between calls.
+     */
+    void apply(FlatScene &scene, double time) {
+        if (tracks.empty())
+            return;
+        if (!bound)
+            bind(scene);
+
+        for (size_t t = 0; t < tracks.size(); t++) {
+            const Track &track = tracks[t];
+            Vec3 offset = offset_at(track.keys, time);
+            if (track.type == PrimitiveType::Sphere) {
+                scene.spheres[track.index].center = rest_centers[t] + offset;
+            } else {
+                // Moving the instance by `offset` in world space moves rays by -offset before
+                // they enter the object. A translation leaves the error scale unchanged.
+                scene.instances[track.index].to_object =
+                    rest_to_object[t] * Transform::translate(-offset);
+            }
+        }
+        scene.refit();
+    }
+
+    private:
+    std::vector<Track> tracks;
+    // Rest pose of each track, recorded by the first apply().
+    std::vector<Point3> rest_centers;
+    std::vector<Transform> rest_to_object;
+    bool bound = false;
+    std::unordered_map<int64_t, int> track_ids; // Track of each object, by track_key
+
+    static int64_t track_key(PrimitiveType type, int index) {
+        return int64_t(index) * 2 + (type == PrimitiveType::Instance);
+    }
+
+    void add_keyframe(PrimitiveType type, int index, double time, const Vec3 &offset) {
+        auto [it, added] = track_ids.try_emplace(track_key(type, index), (int)tracks.size());
+        if (added)
+            tracks.push_back(Track{type, index, {}});
+        Track *track = &tracks[it->second];
+        auto pos = std::upper_bound(
+            track->keys.begin(), track->keys.end(), time,
+            [](double t, const Keyframe &key) { return t < key.time; });
+        track->keys.insert(pos, Keyframe{time, offset});
+        bound = false;
+    }
+
+    void bind(FlatScene &scene) {
+        rest_centers.assign(tracks.size(), Point3());
+        rest_to_object.assign(tracks.size(), Transform());
+        for (size_t t = 0; t < tracks.size(); t++) {
+            const Track &track = tracks[t];
+            if (track.type == PrimitiveType::Sphere) {
+                if (track.index < 0 || track.index >= (int)scene.spheres.size())
+                    throw std::runtime_error("SceneAnimation: sphere index out of range.");
+                rest_centers[t] = scene.spheres[track.index].center;
+            } else {
+                if (track.index < 0 || track.index >= (int)scene.instances.size())
+                    throw std::runtime_error("SceneAnimation: instance index out of range.");
+                rest_to_object[t] = scene.instances[track.index].to_object;
+            }
+        }
+        bound = true;
+    }
+
+    static Vec3 offset_at(const std::vector<Keyframe> &keys, double time) {
+        auto next =
+            std::upper_bound(keys.begin(), keys.end(), time,
+                             [](double t, const Keyframe &key) { return t < key.time; });
+        if (next == keys.begin())
+            return keys.front().offset;
+        if (next == keys.end())
+            return keys.back().offset;
+        const Keyframe &a = *(next - 1);
+        const Keyframe &b = *next;
+        Real s = Real((time - a.time) / (b.time - a.time));
+        return (1 - s) * a.offset + s * b.offset;
+    }
+};
+
+// Seconds elapsed on the steady clock since `start`.
+inline double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Writes images on a background thread, so the next frame renders while the last one is
+ * encoded. One frame can wait while another is being written; submitting a third blocks until
+ * the writer takes the waiting one.
+ *
+ * Images are handed over by swapping buffers, so a submit neither copies nor allocates once the
+ * buffers have their size.
+ */
+class FrameWriter {
+    public:
+    FrameWriter() : writer([this](std::stop_token stop) { write_loop(stop); }) {}
+
+    FrameWriter(const FrameWriter &) = delete;
+    FrameWriter &operator=(const FrameWriter &) = delete;
+
+    /**
+     * @brief Queues `image` to be written to `path`. `image` is swapped with a buffer the
+     * writer is done with, so its contents are unspecified afterwards. Rethrows an error of an
+     * earlier write.
+     */
+    void submit(std::vector<Color> &image, int width, int height, const std::string &path) {
+        auto start = std::chrono::steady_clock::now();
+        std::unique_lock lock(m);
+        changed.wait(lock, [&] { return !has_pending || error; });
+        wait_time += seconds_since(start);
+        if (error)
+            std::rethrow_exception(error);
+
+        pending.swap(image);
+        pending_path = path;
+        pending_width = width;
+        pending_height = height;
+        has_pending = true;
+        lock.unlock();
+        changed.notify_all();
+    }
+
+    /**
+     * @brief Waits until every submitted image is written. Rethrows an error of a write.
+     */
+    void finish() {
+        auto start = std::chrono::steady_clock::now();
+        std::unique_lock lock(m);
+        changed.wait(lock, [&] { return (!has_pending && !writing) || error; });
+        wait_time += seconds_since(start);
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // Time the writer thread spent writing images.
+    double write_seconds() const {
+        std::lock_guard lock(m);
+        return write_time;
+    }
+
+    // Time submit() and finish() spent waiting for the writer.
+    double wait_seconds() const {
+        std::lock_guard lock(m);
+        return wait_time;
+    }
+
+    private:
+    mutable std::mutex m;
+    std::condition_variable_any changed;
+    std::vector<Color> pending; // Submitted, not yet taken by the writer
+    std::string pending_path;
+    int pending_width = 0, pending_height = 0;
+    bool has_pending = false;
+    bool writing = false;
+    std::exception_ptr error;
+    double write_time = 0;
+    double wait_time = 0;
+    // Destroying a std::jthread requests a stop and joins it. Declared last, it is destroyed
+    // first.
+    std::jthread writer;
+
+    void write_loop(std::stop_token stop) {
+        std::vector<Color> image;
+        std::string path;
+        std::unique_lock lock(m);
+        while (changed.wait(lock, stop, [&] { return has_pending; })) {
+            image.swap(pending);
+            path.swap(pending_path);
+            int width = pending_width, height = pending_height;
+            has_pending = false;
+            writing = true;
+            lock.unlock();
+            changed.notify_all();
+
+            auto start = std::chrono::steady_clock::now();
+            std::exception_ptr failure;
+            try {
+                write_image(path, image, width, height);
+            } catch (...) {
+                failure = std::current_exception();
+            }
+            double seconds = seconds_since(start);
+
+            lock.lock();
+            write_time += seconds;
+            writing = false;
+            if (failure && !error)
+                error = failure;
+            changed.notify_all();
+        }
+    }
+};
+
+/**
+ * @brief Outcome of render_animation. The frame times add up to about `seconds`, except for the
+ * writes, which overlap the renders; only the part the renders waited for counts towards it.
+ */
+struct AnimationReport {
+    int frames = 0;
+    double seconds = 0;            // Wall clock of the whole sequence
+    double refit_seconds = 0;      // Moving the objects and refitting the BVH
+    double render_seconds = 0;     // Camera::render, denoising included
+    double write_seconds = 0;      // Spent by the writer thread, in parallel with the renders
+    double write_wait_seconds = 0; // Renders held up by the writer
+    int64_t rays = 0;
+    int64_t primary_rays = 0; // Summed over the frames, as in RenderStats
+    int64_t secondary_rays = 0;
+
+    double frames_per_second() const { return seconds > 0 ? frames / seconds : 0; }
+    double rays_per_second() const { return render_seconds > 0 ? rays / render_seconds : 0; }
+    double average_path_length() const {
+        return primary_rays > 0 ? double(primary_rays + secondary_rays) / primary_rays : 0;
+    }
+};
+
+/**
+ * @brief Output path of frame `frame`: the last run of '#' in `pattern` is replaced by the
+ * zero-padded frame number ("frame_####.png" gives "frame_0007.png"). Without a '#' the number
+ * is added before the extension ("out.ppm" gives "out_0007.ppm").
+ */
+inline std::string numbered_path(const std::string &pattern, int frame) {
+    auto last = pattern.find_last_of('#');
+    if (last == std::string::npos) {
+        std::filesystem::path path(pattern);
+        std::string stem = path.stem().string() + "_####" + path.extension().string();
+        return numbered_path((path.parent_path() / stem).string(), frame);
+    }
+    auto first = pattern.find_last_not_of('#', last);
+    first = first == std::string::npos ? 0 : first + 1;
+    int width = int(last - first + 1);
+
+    char digits[32];
+    std::snprintf(digits, sizeof(digits), "%0*d", width, frame);
+    return pattern.substr(0, first) + digits + pattern.substr(last + 1);
+}
+
+/**
+ * @brief Renders `frames` frames of `animation`, frame f at time f / fps, to the numbered files
+ * of `pattern` (see numbered_path).
+ *
+ * Each frame moves the animated objects and refits the BVH, then renders while the previous
+ * frame is written by a FrameWriter. The camera's image buffer is swapped with the writer's, so
+ * frames are neither copied nor reallocated. The camera's output_file is not written.
+ */
+inline AnimationReport render_animation(Camera &cam, FlatScene &scene,
+                                        SceneAnimation &animation, int frames, double fps,
+                                        const std::string &pattern) {
+    using clock = std::chrono::steady_clock;
+
+    AnimationReport report;
+    auto start = clock::now();
+    std::string output_file;
+    output_file.swap(cam.output_file);
+    std::vector<Color> buffer;
+    try {
+        FrameWriter writer;
+        for (int f = 0; f < frames; f++) {
+            auto refit_start = clock::now();
+            animation.apply(scene, f / fps);
+            report.refit_seconds += seconds_since(refit_start);
+
+            auto render_start = clock::now();
+            cam.render(scene);
+            report.render_seconds += seconds_since(render_start);
+            report.rays += cam.stats().total_rays();
+            report.primary_rays += cam.stats().primary_rays;
+            report.secondary_rays += cam.stats().secondary_rays;
+
+            cam.swap_image(buffer);
+            writer.submit(buffer, cam.image_width, cam.get_image_height(),
+                          numbered_path(pattern, f));
+            report.frames++;
+        }
+        writer.finish();
+        report.write_seconds = writer.write_seconds();
+        report.write_wait_seconds = writer.wait_seconds();
+    } catch (...) {
+        cam.output_file.swap(output_file);
+        throw;
+    }
+    cam.output_file.swap(output_file);
+    report.seconds = seconds_since(start);
+    return report;
+}
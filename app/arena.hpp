@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Bump allocator that hands out memory from large chunks and releases it all at once.
+ *
+ * Allocating is a pointer increment, and there is no per-object bookkeeping or free. reset()
+ * makes the memory reusable without returning it to the heap, so a buffer that is rebuilt every
+ * render stops allocating after the first one. Not thread safe.
+ */
+class Arena {
+    public:
+    explicit Arena(size_t chunk_size = 64 * 1024) : chunk_size(chunk_size) {}
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+        uintptr_t p = (cursor + align - 1) & ~uintptr_t(align - 1);
+        if (p + bytes > end) {
+            add_chunk(bytes + align);
+            p = (cursor + align - 1) & ~uintptr_t(align - 1);
+        }
+        cursor = p + bytes;
+        used += bytes;
+        return reinterpret_cast<void *>(p);
+    }
+
+    /**
+     * @brief Value-initialized array of `count` objects. Destructors are never run, so T must
+     * be trivially destructible.
+     */
+    template <typename T> std::span<T> make_array(size_t count) {
+        static_assert(std::is_trivially_destructible_v<T>, "Arena arrays are never destroyed.");
+        T *data = static_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+        for (size_t i = 0; i < count; i++) {
+            new (data + i) T();
+        }
+        return std::span<T>(data, count);
+    }
+
+    /**
+     * @brief Frees everything allocated so far for reuse. Memory stays reserved; if it was
+     * spread over several chunks they are merged into one, so the same allocations fit next
+     * time.
+     */
+    void reset() {
+        if (chunks.size() > 1) {
+            size_t total = 0;
+            for (const auto &chunk : chunks) {
+                total += chunk.size;
+            }
+            chunks.clear();
+            chunks.push_back(Chunk{std::make_unique_for_overwrite<std::byte[]>(total), total});
+        }
+        cursor = chunks.empty() ? 0 : reinterpret_cast<uintptr_t>(chunks[0].data.get());
+        end = chunks.empty() ? 0 : cursor + chunks[0].size;
+        used = 0;
+    }
+
+    // Returns all memory to the heap.
+    void release() {
+        chunks.clear();
+        cursor = end = 0;
+        used = 0;
+    }
+
+    size_t bytes_used() const { return used; }
+
+    size_t bytes_reserved() const {
+        size_t total = 0;
+        for (const auto &chunk : chunks) {
+            total += chunk.size;
+        }
+        return total;
+    }
+
+    private:
+    struct Chunk {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    size_t chunk_size;
+    std::vector<Chunk> chunks;
+    uintptr_t cursor = 0; // Next free byte of the current chunk
+    uintptr_t end = 0;    // End of the current chunk
+    size_t used = 0;
+
+    void add_chunk(size_t min_size) {
+        size_t size = std::max(chunk_size, min_size);
+        chunks.push_back(Chunk{std::make_unique_for_overwrite<std::byte[]>(size), size});
+        cursor = reinterpret_cast<uintptr_t>(chunks.back().data.get());
+        end = cursor + size;
+    }
+};
+
+/**
+ * @brief Standard allocator drawing from an Arena. It holds a reference to the arena, so
+ * objects made with std::allocate_shared keep their arena alive and may outlive whoever created
+ * it; the arena is freed in one go when the last of them is gone. deallocate does nothing.
+ */
+template <typename T> class ArenaAllocator {
+    public:
+    using value_type = T;
+
+    explicit ArenaAllocator(std::shared_ptr<Arena> arena) : arena(std::move(arena)) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.get_arena()) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(arena->allocate(sizeof(T) * n, alignof(T)));
+    }
+    void deallocate(T *, size_t) {}
+
+    const std::shared_ptr<Arena> &get_arena() const { return arena; }
+
+    template <typename U> bool operator==(const ArenaAllocator<U> &other) const {
+        return arena == other.get_arena();
+    }
+
+    private:
+    std::shared_ptr<Arena> arena;
+};
@@ -0,0 +1,694 @@
+// Benchmark suite: renders the canonical scenes and reports throughput as JSON and/or CSV, so
+// regressions can be caught between commits.
+//
+// Usage: bench [--scene name]... [--width N] [--spp N] [--threads N] [--wavefront | --packets]
+//              [--roulette] [--adaptive [threshold]] [--sampler name] [--denoise] [--no-nee]
+//              [--reference-spp N] [--check-allocations] [--check-snapshots]
+//              [--compare-dispatch] [--json file] [--csv file]
+//
+// --reference-spp renders every scene again at N samples per pixel with another seed and
+// reports the RMSE of the image against it, so the convergence of the samplers can be compared
+// at equal spp, and the PSNR after the display transform, which tracks how noisy the image
+// looks. With --denoise the image is denoised before it is compared (the reference is not).
+// --no-nee turns off next-event estimation, to compare the noise of scenes with lights (the
+// reference keeps it).
+//
+// --adaptive samples adaptively (Camera::adaptive_sampling) with --spp as the maximum, and
+// reports the average samples per pixel taken. With --reference-spp the scene is also rendered
+// with a fixed spp equal to that average, rounded up, so the RMSE of both at about the same
+// cost can be compared.
+//
+// --check-allocations renders every scene again once warmed up, at spp and at twice spp, and
+// fails if either render makes a heap allocation: neither the per-sample path nor the
+// per-render setup may allocate. The progress display is turned off for these renders, its
+// thread makes three allocations per render (thread state, stop state and condition variable).
+//
+// --check-snapshots renders every scene built from a HittableList again, through a
+// RenderSession following the list's commits (RenderSession::from_snapshots), one sample per
+// pass for spp passes. Meanwhile one thread removes and re-adds an object and commits after
+// each edit, and another takes snapshots in a loop. It reports the commits, the passes
+// restarted on a newer snapshot and the most replaced snapshots the list held at once. It fails
+// unless the list holds none once the other threads stop, and unless the last snapshot renders
+// the same image as the list under a BVHNode.
+//
+// --packets traces the primary rays in packets (Camera::packet_tracing). Every scene is then
+// rendered again once warmed up, with packets and one ray at a time, and the fastest of three
+// alternating renders of each is reported. It fails if the images differ.
+//
+// --compare-dispatch renders every scene again once warmed up: through the loops compiled for
+// FlatScene (Camera::static_dispatch), through the virtual Hittable and Material calls, and,
+// for scenes built from a HittableList without lights, as that list under a BVHNode with a
+// virtual call per primitive, the path of user-defined objects. It reports the fastest of three
+// alternating renders of each, and fails if the images differ.
+
+#include "bvh.hpp"
+#include "camera.hpp"
+#include "flat_scene.hpp"
+#include "hittable.hpp"
+#include "scenes.hpp"
+#include "session.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+// Peak resident set size of the process in KiB, 0 where unsupported. The peak only grows, so
+// the scenes are ordered from small to large.
+static long peak_rss_kb() {
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+// Heap allocations of the whole process, counted by the replacement operators new below. The
+// over-aligned forms are replaced too, so alignas types such as WorkerStats are counted.
+static std::atomic<int64_t> heap_allocations{0};
+
+void *operator new(size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    // aligned_alloc wants a size that is a multiple of the alignment.
+    size_t alignment = static_cast<size_t>(align);
+    size_t rounded = (std::max<size_t>(size, 1) + alignment - 1) / alignment * alignment;
+    if (void *p = std::aligned_alloc(alignment, rounded))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new[](size_t size, std::align_val_t align) { return operator new(size, align); }
+
+// GCC inlines these into callers and then flags free() on memory from operator new.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// Scalar type the tracer was built with (CMake option RT_FLOAT).
+static const char *precision_name() { return std::is_same_v<Real, float> ? "float" : "double"; }
+
+struct BenchResult {
+    std::string scene;
+    int objects = 0;
+    int64_t triangles = 0;
+    int bvh_nodes = 0;
+    double build_seconds = 0;
+    RenderStats render;
+    double mean_luminance = 0; // Of the rendered image, to check that roulette stays unbiased
+    long peak_rss_kb = 0;
+    double rmse = -1; // Against the reference image, with --reference-spp. -1 otherwise
+    double psnr = -1; // In dB, against the reference after the display transform. -1 otherwise
+    // Render with a fixed spp of about the average of the adaptive render, with --adaptive and
+    // --reference-spp. -1 otherwise.
+    int fixed_spp = -1;
+    double fixed_seconds = -1;
+    double fixed_rmse = -1;
+    double fixed_psnr = -1;
+    int64_t render_allocations = 0;
+    // Allocations of warm renders at spp and twice spp, without the progress display, with
+    // --check-allocations. -1 otherwise.
+    int64_t warm_allocations = -1;
+    int64_t warm_allocations_double = -1;
+    // Warm render times with and without static dispatch, and of the scene's HittableList under
+    // a BVHNode, with --compare-dispatch. -1 otherwise.
+    double static_dispatch_seconds = -1;
+    double virtual_dispatch_seconds = -1;
+    double object_bvh_seconds = -1;
+    bool dispatch_images_match = true;
+    // Warm render times with and without packet tracing, with --packets. -1 otherwise.
+    double packet_seconds = -1;
+    double scalar_seconds = -1;
+    bool packet_images_match = true;
+    // Edits committed while a session rendered, passes it restarted, the most retired snapshots
+    // held at once and those left after the edits, with --check-snapshots. -1 otherwise.
+    int64_t snapshot_commits = -1;
+    int snapshot_restarts = -1;
+    int64_t max_retired = -1;
+    int64_t retired_after = -1;
+    bool snapshot_images_match = true;
+};
+
+struct BenchOptions {
+    std::vector<std::string> scenes;
+    int width = 320;
+    int spp = 8;
+    int threads = 0;
+    bool wavefront = false;
+    bool packets = false;
+    bool roulette = false;
+    bool adaptive = false;
+    double adaptive_threshold = 0.01;
+    SamplerType sampler = SamplerType::Independent;
+    bool denoise = false;
+    bool next_event_estimation = true;
+    int reference_spp = 0;
+    bool check_allocations = false;
+    bool check_snapshots = false;
+    bool compare_dispatch = false;
+    std::string json_file;
+    std::string csv_file;
+};
+
+static const char *integrator_name(const BenchOptions &opts) {
+    return opts.wavefront ? "wavefront" : opts.packets ? "packet" : "depth_first";
+}
+
+static BenchOptions parse_args(int argc, char **argv) {
+    BenchOptions opts;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << arg << "\n";
+                std::exit(1);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "--scene")
+            opts.scenes.push_back(value());
+        else if (arg == "--width")
+            opts.width = std::stoi(value());
+        else if (arg == "--spp")
+            opts.spp = std::stoi(value());
+        else if (arg == "--threads")
+            opts.threads = std::stoi(value());
+        else if (arg == "--wavefront")
+            opts.wavefront = true;
+        else if (arg == "--packets")
+            opts.packets = true;
+        else if (arg == "--roulette")
+            opts.roulette = true;
+        else if (arg == "--adaptive") {
+            opts.adaptive = true;
+            // The threshold is optional, a following argument that is not a number is left
+            // alone.
+            if (i + 1 < argc) {
+                char *end;
+                double threshold = std::strtod(argv[i + 1], &end);
+                if (end != argv[i + 1] && *end == '\0') {
+                    opts.adaptive_threshold = threshold;
+                    i++;
+                }
+            }
+        }
+        else if (arg == "--sampler")
+            opts.sampler = parse_sampler(value());
+        else if (arg == "--denoise")
+            opts.denoise = true;
+        else if (arg == "--no-nee")
+            opts.next_event_estimation = false;
+        else if (arg == "--reference-spp")
+            opts.reference_spp = std::stoi(value());
+        else if (arg == "--check-allocations")
+            opts.check_allocations = true;
+        else if (arg == "--check-snapshots")
+            opts.check_snapshots = true;
+        else if (arg == "--compare-dispatch")
+            opts.compare_dispatch = true;
+        else if (arg == "--json")
+            opts.json_file = value();
+        else if (arg == "--csv")
+            opts.csv_file = value();
+        else {
+            std::cerr << "Unknown argument " << arg << "\n";
+            std::exit(1);
+        }
+    }
+    if (opts.wavefront && opts.packets) {
+        std::cerr << "--wavefront and --packets are exclusive, the wavefront integrator traces "
+                     "no packets\n";
+        std::exit(1);
+    }
+    if (opts.adaptive && (opts.wavefront || opts.packets)) {
+        std::cerr << "--adaptive cannot be combined with --wavefront or --packets, they take "
+                     "every sample\n";
+        std::exit(1);
+    }
+    return opts;
+}
+
+// A linear color channel as the image writers display it: gamma 2, clamped to [0, 1].
+static double display_value(Real c) {
+    return std::min(std::sqrt(std::max(double(c), 0.0)), 1.0);
+}
+
+// RMSE of `image` against `reference`, and PSNR in dB after the display transform, capped at
+// 100dB for identical images.
+static void compare_images(const std::vector<Color> &image, const std::vector<Color> &reference,
+                           double &rmse, double &psnr) {
+    double sum = 0;
+    double display_sum = 0;
+    for (size_t p = 0; p < image.size(); p++) {
+        Color d = image[p] - reference[p];
+        sum += dot(d, d) / 3;
+        for (int c = 0; c < 3; c++) {
+            double e = display_value(image[p][c]) - display_value(reference[p][c]);
+            display_sum += e * e / 3;
+        }
+    }
+    rmse = std::sqrt(sum / image.size());
+    double mse = display_sum / image.size();
+    psnr = mse > 0 ? std::min(100.0, -10 * std::log10(mse)) : 100.0;
+}
+
+// Renders the scene's HittableList through a session following its commits while other threads
+// edit and commit the list and take snapshots of it, for --check-snapshots.
+static void check_snapshots(const SceneEntry &entry, Camera &cam, const BenchOptions &opts,
+                            BenchResult &result) {
+    HittableList list;
+    Camera list_cam;
+    entry.build_list(list, list_cam);
+    list.commit();
+
+    bool show_progress = cam.show_progress;
+    cam.show_progress = false;
+    std::atomic<bool> stop{false};
+    int64_t commits = 0;
+    size_t max_retired = 0;
+    std::thread editor([&] {
+        shared_ptr<Hittable> object = list.get_objects().back();
+        while (!stop.load()) {
+            list.remove(object);
+            list.commit();
+            list.add(object);
+            list.commit();
+            commits += 2;
+            max_retired = std::max(max_retired, list.retired_count());
+        }
+    });
+    std::thread reader([&] {
+        while (!stop.load()) {
+            auto snapshot = list.snapshot();
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    });
+
+    RenderSession session = RenderSession::from_snapshots(cam, list);
+    result.snapshot_restarts = 0;
+    for (int pass = 0; pass < opts.spp; pass++) {
+        session.add_samples(1);
+        if (pass > 0 && session.sample_count() == 1)
+            result.snapshot_restarts++;
+    }
+    stop.store(true);
+    editor.join();
+    reader.join();
+    result.snapshot_commits = commits;
+    result.max_retired = (int64_t)max_retired;
+
+    // With no reader left the next commit frees every replaced snapshot.
+    list.commit();
+    result.retired_after = (int64_t)list.retired_count();
+
+    // The editor left the list as it was built, and a snapshot walks the same BVH as a BVHNode.
+    session.add_samples(opts.spp);
+    std::vector<Color> image = session.snapshot();
+    BVHNode object_bvh(list);
+    RenderSession reference(cam, object_bvh);
+    reference.add_samples(opts.spp);
+    result.snapshot_images_match =
+        session.sample_count() == opts.spp &&
+        std::memcmp(image.data(), reference.snapshot().data(),
+                    image.size() * sizeof(Color)) == 0;
+    cam.show_progress = show_progress;
+}
+
+static BenchResult run_scene(const SceneEntry &entry, const BenchOptions &opts) {
+    Camera cam;
+    FlatSceneBuilder builder;
+    entry.build(builder, cam);
+    cam.image_width = opts.width;
+    cam.samples_per_pixel = opts.spp;
+    cam.thread_count = opts.threads;
+    cam.wavefront = opts.wavefront;
+    cam.packet_tracing = opts.packets;
+    cam.russian_roulette = opts.roulette;
+    cam.adaptive_sampling = opts.adaptive;
+    cam.adaptive_threshold = opts.adaptive_threshold;
+    cam.sampler_type = opts.sampler;
+    cam.denoise = opts.denoise;
+    cam.next_event_estimation = opts.next_event_estimation;
+    cam.output_file = "";
+
+    BenchResult result;
+    result.scene = entry.name;
+
+    auto start = std::chrono::steady_clock::now();
+    FlatScene scene = builder.build();
+    result.build_seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.objects = (int)scene.primitives.size();
+    result.bvh_nodes = scene.bvh_node_count();
+    for (const auto &m : scene.meshes) {
+        // Meshes build their own BVH when they are created.
+        result.triangles += m.mesh->triangle_count();
+        result.bvh_nodes += m.mesh->node_count();
+        result.build_seconds += m.mesh->build_seconds();
+    }
+
+    int64_t allocations = heap_allocations;
+    cam.render(scene);
+    result.render_allocations = heap_allocations - allocations;
+    result.render = cam.stats();
+    for (const Color &c : cam.image()) {
+        result.mean_luminance += luminance(c);
+    }
+    result.mean_luminance /= cam.image().size();
+    result.peak_rss_kb = peak_rss_kb();
+
+    // The renders below reuse the camera's image buffer.
+    std::vector<Color> image;
+    if (opts.reference_spp > 0 || opts.compare_dispatch || opts.packets)
+        image = cam.image();
+
+    if (opts.packets) {
+        // Warm renders, alternating like the dispatch comparison below. One ray at a time must
+        // give the same image bit for bit.
+        auto time_render = [&](bool packets, double &best) {
+            cam.packet_tracing = packets;
+            cam.render(scene);
+            result.packet_images_match &=
+                std::memcmp(cam.image().data(), image.data(),
+                            image.size() * sizeof(Color)) == 0;
+            double seconds = cam.stats().seconds;
+            best = best < 0 ? seconds : std::min(best, seconds);
+        };
+        for (int round = 0; round < 3; round++) {
+            time_render(false, result.scalar_seconds);
+            time_render(true, result.packet_seconds);
+        }
+    }
+
+    if (opts.compare_dispatch) {
+        // All renders are warm, the first one above spawned the threads and sized the buffers.
+        // Alternating the two evens out drifts of the machine's speed.
+        auto time_render = [&](const Hittable &world, bool static_dispatch, double &best) {
+            cam.static_dispatch = static_dispatch;
+            cam.render(world);
+            result.dispatch_images_match &=
+                std::memcmp(cam.image().data(), image.data(),
+                            image.size() * sizeof(Color)) == 0;
+            double seconds = cam.stats().seconds;
+            best = best < 0 ? seconds : std::min(best, seconds);
+        };
+
+        // A HittableList has no light list, so it would render scenes with lights differently.
+        HittableList list;
+        std::unique_ptr<BVHNode> object_bvh;
+        if (entry.build_list && !scene.light_list()) {
+            Camera list_cam;
+            entry.build_list(list, list_cam);
+            object_bvh = std::make_unique<BVHNode>(list);
+        }
+
+        for (int round = 0; round < 3; round++) {
+            if (object_bvh)
+                time_render(*object_bvh, false, result.object_bvh_seconds);
+            time_render(scene, false, result.virtual_dispatch_seconds);
+            time_render(scene, true, result.static_dispatch_seconds);
+        }
+    }
+
+    if (opts.check_allocations) {
+        cam.show_progress = false;
+        auto count_render = [&](int spp) {
+            cam.samples_per_pixel = spp;
+            int64_t before = heap_allocations;
+            cam.render(scene);
+            return heap_allocations - before;
+        };
+        count_render(2 * opts.spp); // Grows the reused buffers to their final size
+        result.warm_allocations = count_render(opts.spp);
+        result.warm_allocations_double = count_render(2 * opts.spp);
+        cam.samples_per_pixel = opts.spp;
+        cam.show_progress = true;
+    }
+
+    if (opts.check_snapshots && entry.build_list)
+        check_snapshots(entry, cam, opts, result);
+
+    std::vector<Color> fixed_image;
+    if (opts.adaptive && opts.reference_spp > 0) {
+        cam.adaptive_sampling = false;
+        cam.samples_per_pixel = (int)std::ceil(result.render.average_samples);
+        cam.render(scene);
+        result.fixed_spp = cam.samples_per_pixel;
+        result.fixed_seconds = cam.stats().seconds;
+        fixed_image = cam.image();
+    }
+
+    if (opts.reference_spp > 0) {
+        cam.samples_per_pixel = opts.reference_spp;
+        cam.adaptive_sampling = false;
+        cam.sampler_type = SamplerType::Sobol;
+        cam.seed++; // Independent of the samples being measured
+        cam.denoise = false;
+        cam.next_event_estimation = true;
+        cam.render(scene);
+        compare_images(image, cam.image(), result.rmse, result.psnr);
+        if (!fixed_image.empty())
+            compare_images(fixed_image, cam.image(), result.fixed_rmse, result.fixed_psnr);
+    }
+    return result;
+}
+
+static void write_json(std::ostream &out, const std::vector<BenchResult> &results,
+                       const BenchOptions &opts) {
+    out << "{\n  \"precision\": \"" << precision_name() << "\",\n  \"integrator\": \""
+        << integrator_name(opts) << "\",\n  \"russian_roulette\": "
+        << (opts.roulette ? "true" : "false") << ",\n  \"adaptive\": "
+        << (opts.adaptive ? "true" : "false") << ",\n  \"sampler\": \""
+        << sampler_name(opts.sampler) << "\",\n  \"denoise\": "
+        << (opts.denoise ? "true" : "false") << ",\n  \"next_event_estimation\": "
+        << (opts.next_event_estimation ? "true" : "false") << ",\n  \"width\": " << opts.width
+        << ",\n  \"spp\": " << opts.spp << ",\n  \"scenes\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto &r = results[i];
+        out << "    {\"scene\": \"" << r.scene << "\", \"objects\": " << r.objects
+            << ", \"triangles\": " << r.triangles << ", \"bvh_nodes\": " << r.bvh_nodes
+            << ", \"build_seconds\": " << r.build_seconds
+            << ", \"render_seconds\": " << r.render.seconds
+            << ", \"primary_rays\": " << r.render.primary_rays
+            << ", \"secondary_rays\": " << r.render.secondary_rays
+            << ", \"shadow_rays\": " << r.render.shadow_rays
+            << ", \"rays_per_second\": " << r.render.rays_per_second()
+            << ", \"average_path_length\": " << r.render.average_path_length()
+            << ", \"roulette_terminations\": " << r.render.roulette_terminations
+            << ", \"average_spp\": " << r.render.average_samples
+            << ", \"mean_luminance\": " << r.mean_luminance
+            << ", \"peak_rss_kb\": " << r.peak_rss_kb;
+        if (r.rmse >= 0)
+            out << ", \"rmse\": " << r.rmse << ", \"psnr\": " << r.psnr;
+        if (r.fixed_spp >= 0) {
+            out << ", \"fixed_spp\": " << r.fixed_spp << ", \"fixed_render_seconds\": "
+                << r.fixed_seconds << ", \"fixed_rmse\": " << r.fixed_rmse
+                << ", \"fixed_psnr\": " << r.fixed_psnr;
+        }
+        if (opts.denoise)
+            out << ", \"denoise_seconds\": " << r.render.denoise_seconds;
+        out << ", \"render_allocations\": " << r.render_allocations;
+        if (r.warm_allocations >= 0) {
+            out << ", \"warm_allocations\": " << r.warm_allocations
+                << ", \"warm_allocations_double_spp\": " << r.warm_allocations_double;
+        }
+        if (r.static_dispatch_seconds >= 0) {
+            out << ", \"static_dispatch_seconds\": " << r.static_dispatch_seconds
+                << ", \"virtual_dispatch_seconds\": " << r.virtual_dispatch_seconds
+                << ", \"object_bvh_seconds\": " << r.object_bvh_seconds
+                << ", \"dispatch_images_match\": "
+                << (r.dispatch_images_match ? "true" : "false");
+        }
+        if (r.snapshot_commits >= 0) {
+            out << ", \"snapshot_commits\": " << r.snapshot_commits
+                << ", \"snapshot_restarts\": " << r.snapshot_restarts
+                << ", \"max_retired_snapshots\": " << r.max_retired
+                << ", \"retired_snapshots_after\": " << r.retired_after
+                << ", \"snapshot_images_match\": "
+                << (r.snapshot_images_match ? "true" : "false");
+        }
+        if (r.packet_seconds >= 0) {
+            out << ", \"packet_seconds\": " << r.packet_seconds
+                << ", \"scalar_seconds\": " << r.scalar_seconds
+                << ", \"packet_images_match\": " << (r.packet_images_match ? "true" : "false");
+        }
+        out << ", \"thread_utilization\": [";
+        for (size_t t = 0; t < r.render.thread_busy_seconds.size(); t++) {
+            out << (t ? ", " : "") << r.render.utilization((int)t);
+        }
+        out << "]}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+static void write_csv(std::ostream &out, const std::vector<BenchResult> &results,
+                      const BenchOptions &opts) {
+    out << "precision,integrator,sampler,scene,objects,triangles,bvh_nodes,build_seconds,"
+           "render_seconds,primary_rays,secondary_rays,shadow_rays,rays_per_second,"
+           "average_path_length,roulette_terminations,average_spp,mean_luminance,rmse,psnr,"
+           "fixed_spp,fixed_rmse,fixed_psnr,denoise_seconds,peak_rss_kb,render_allocations,"
+           "min_thread_utilization,max_thread_utilization\n";
+    for (const auto &r : results) {
+        double min_util = 1, max_util = 0;
+        for (size_t t = 0; t < r.render.thread_busy_seconds.size(); t++) {
+            min_util = std::min(min_util, r.render.utilization((int)t));
+            max_util = std::max(max_util, r.render.utilization((int)t));
+        }
+        out << precision_name() << ',' << integrator_name(opts) << ','
+            << sampler_name(opts.sampler) << ',' << r.scene << ','
+            << r.objects << ',' << r.triangles << ','
+            << r.bvh_nodes << ',' << r.build_seconds << ',' << r.render.seconds << ','
+            << r.render.primary_rays << ','
+            << r.render.secondary_rays << ',' << r.render.shadow_rays << ','
+            << r.render.rays_per_second() << ','
+            << r.render.average_path_length() << ',' << r.render.roulette_terminations << ','
+            << r.render.average_samples << ',' << r.mean_luminance << ',' << r.rmse << ','
+            << r.psnr << ',' << r.fixed_spp << ',' << r.fixed_rmse << ',' << r.fixed_psnr << ','
+            << r.render.denoise_seconds << ','
+            << r.peak_rss_kb << ',' << r.render_allocations << ',' << min_util << ','
+            << max_util << '\n';
+    }
+}
+
+int main(int argc, char **argv) {
+    BenchOptions opts = parse_args(argc, argv);
+    std::clog << "Tracing in " << precision_name() << " precision, "
+              << integrator_name(opts) << " integrator, " << sampler_name(opts.sampler)
+              << " sampler" << (opts.denoise ? ", denoised" : "")
+              << (opts.next_event_estimation ? "" : ", no next-event estimation") << "\n";
+
+    std::vector<BenchResult> results;
+    bool allocation_check_failed = false;
+    bool dispatch_check_failed = false;
+    bool packet_check_failed = false;
+    bool snapshot_check_failed = false;
+    for (const auto &entry : canonical_scenes()) {
+        if (!opts.scenes.empty() &&
+            std::find(opts.scenes.begin(), opts.scenes.end(), entry.name) == opts.scenes.end())
+            continue;
+
+        std::clog << "Scene " << entry.name << "\n";
+        results.push_back(run_scene(entry, opts));
+
+        const auto &r = results.back();
+        std::clog << "  " << r.objects << " objects, " << r.triangles << " triangles, build "
+                  << r.build_seconds * 1000 << "ms, render " << r.render.seconds << "s, "
+                  << r.render.rays_per_second() / 1e6 << " Mrays/s ("
+                  << r.render.primary_rays << " primary, " << r.render.secondary_rays
+                  << " secondary, " << r.render.shadow_rays << " shadow), "
+                  << r.render.average_path_length()
+                  << " rays per path, mean luminance " << r.mean_luminance << "\n";
+        if (opts.denoise) {
+            std::clog << "  Denoised in " << r.render.denoise_seconds * 1000 << "ms\n";
+        }
+        if (r.rmse >= 0) {
+            std::clog << "  RMSE " << r.rmse << ", PSNR " << r.psnr << "dB against "
+                      << opts.reference_spp << " spp\n";
+        }
+        if (opts.adaptive) {
+            std::clog << "  Adaptive: " << r.render.average_samples << " samples per pixel on "
+                      << "average, of at most " << opts.spp;
+            if (r.fixed_spp >= 0) {
+                std::clog << ". Fixed " << r.fixed_spp << " spp: RMSE " << r.fixed_rmse
+                          << ", PSNR " << r.fixed_psnr << "dB, render " << r.fixed_seconds
+                          << "s";
+            }
+            std::clog << "\n";
+        }
+        if (opts.check_allocations) {
+            bool allocates = r.warm_allocations > 0 || r.warm_allocations_double > 0;
+            allocation_check_failed |= allocates;
+            std::clog << "  " << r.warm_allocations << " allocations per warm render at "
+                      << opts.spp << " spp, " << r.warm_allocations_double << " at "
+                      << 2 * opts.spp << " spp"
+                      << (allocates ? ": FAILED, warm renders must not allocate" : "") << "\n";
+        }
+        if (r.snapshot_commits >= 0) {
+            bool failed = r.retired_after != 0 || !r.snapshot_images_match;
+            snapshot_check_failed |= failed;
+            std::clog << "  Snapshots: " << r.snapshot_commits << " commits during " << opts.spp
+                      << " passes, " << r.snapshot_restarts << " restarted, at most "
+                      << r.max_retired << " retired snapshots held, " << r.retired_after
+                      << " after the edits";
+            if (r.retired_after != 0)
+                std::clog << ": FAILED, retired snapshots were not freed";
+            else if (!r.snapshot_images_match)
+                std::clog << ": FAILED, the images differ";
+            std::clog << "\n";
+        }
+        if (opts.packets) {
+            packet_check_failed |= !r.packet_images_match;
+            std::clog << "  Packets " << r.packet_seconds << "s, one ray at a time "
+                      << r.scalar_seconds << "s (" << r.scalar_seconds / r.packet_seconds
+                      << "x)"
+                      << (r.packet_images_match ? "" : ": FAILED, the images differ") << "\n";
+        }
+        if (opts.compare_dispatch) {
+            dispatch_check_failed |= !r.dispatch_images_match;
+            std::clog << "  Static dispatch " << r.static_dispatch_seconds << "s, virtual "
+                      << r.virtual_dispatch_seconds << "s ("
+                      << r.virtual_dispatch_seconds / r.static_dispatch_seconds << "x)";
+            if (r.object_bvh_seconds >= 0) {
+                std::clog << ", BVHNode " << r.object_bvh_seconds << "s ("
+                          << r.object_bvh_seconds / r.static_dispatch_seconds << "x)";
+            }
+            std::clog << (r.dispatch_images_match ? "" : ": FAILED, the images differ") << "\n";
+        }
+    }
+
+    if (!opts.json_file.empty()) {
+        std::ofstream out(opts.json_file);
+        write_json(out, results, opts);
+    }
+    if (!opts.csv_file.empty()) {
+        std::ofstream out(opts.csv_file);
+        write_csv(out, results, opts);
+    }
+    if (opts.json_file.empty() && opts.csv_file.empty()) {
+        write_json(std::cout, results, opts);
+    }
+    return allocation_check_failed || dispatch_check_failed || packet_check_failed ||
+                   snapshot_check_failed
+               ? 1
+               : 0;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "bvh_tree.hpp"
+#include "hittable.hpp"
+#include "interval.hpp"
+#include "math.hpp"
+#include "ray.hpp"
+#include <chrono>
+#include <vector>
+
+/**
+ * @brief Hittable wrapping a set of objects in a BVH, replacing the linear scan of
+ * HittableList::hit with a logarithmic traversal.
+ */
+class BVHNode : public Hittable {
+    public:
+    BVHNode(const HittableList &list) : BVHNode(list.get_objects()) {}
+
+    BVHNode(const std::vector<shared_ptr<Hittable>> &src_objects) : objects(src_objects) {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        std::vector<AABB> bounds;
+        bounds.reserve(objects.size());
+        for (const auto &object : objects) {
+            bounds.push_back(object->bounding_box());
+        }
+        tree.build(bounds);
+
+        // Reorder the objects to match the leaf order, so leaves index the objects directly.
+        std::vector<shared_ptr<Hittable>> ordered;
+        ordered.reserve(objects.size());
+        for (int i : tree.indices) {
+            ordered.push_back(objects[i]);
+        }
+        objects = std::move(ordered);
+        for (int i = 0; i < (int)tree.indices.size(); i++) {
+            tree.indices[i] = i;
+        }
+
+        bbox = tree.nodes.empty() ? AABB() : tree.nodes[0].bbox;
+
+        auto end = std::chrono::high_resolution_clock::now();
+        build_time = std::chrono::duration<double>(end - start).count();
+    }
+
+    bool hit(const Ray &r, Interval ray_t, HitRecord &rec) const override {
+        return tree.traverse(r, ray_t, rec,
+                             [this](int prim, const Ray &r, Interval t, HitRecord &rec) {
+                                 return objects[prim].get()->hit(r, t, rec);
+                             });
+    }
+
+    bool hit_any(const Ray &r, Interval ray_t) const override {
+        return tree.traverse_any(r, ray_t, [this](int prim, const Ray &r, Interval t) {
+            return objects[prim].get()->hit_any(r, t);
+        });
+    }
+
+    AABB bounding_box() const override { return bbox; }
+
+    int node_count() const { return (int)tree.nodes.size(); }
+    int object_count() const { return (int)objects.size(); }
+    double build_seconds() const { return build_time; }
+
+    private:
+    std::vector<shared_ptr<Hittable>> objects;
+    BVHTree tree;
+    AABB bbox;
+    double build_time = 0;
+};
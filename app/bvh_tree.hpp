@@ -0,0 +1,321 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "hit_record.hpp"
+#include "interval.hpp"
+#include "math.hpp"
+#include "ray.hpp"
+#include "stats.hpp"
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <vector>
+
+/**
+ * @brief A node of a flattened BVH. Children of an internal node are stored next to each other,
+ * so only the index of the left child is needed.
+ */
+struct BVHFlatNode {
+    AABB bbox;
+    int first; // Leaf: offset of its first primitive in `indices`. Internal: left child.
+    int count; // Number of primitives in a leaf, 0 for internal nodes.
+    int axis;  // Split axis, used during traversal to visit the nearer child first.
+};
+
+/**
+ * @brief Bounding volume hierarchy over an arbitrary set of primitive bounds, built with binned
+ * SAH (surface area heuristic). It only knows about bounding boxes, the actual primitive
+ * intersection is supplied by the caller during traversal, so it can be reused by anything that
+ * owns a set of primitives.
+ */
+class BVHTree {
+    public:
+    static constexpr int bin_count = 16;
+    static constexpr int max_depth = 64; // Also the size of the traversal stack.
+
+    std::vector<BVHFlatNode> nodes;
+    // Primitive indices, ordered so that each leaf is a contiguous range.
+    std::vector<int> indices;
+    int max_leaf_size = 4;
+
+    void build(const std::vector<AABB> &bounds) {
+        nodes.clear();
+        indices.resize(bounds.size());
+        for (int i = 0; i < (int)bounds.size(); i++) {
+            indices[i] = i;
+        }
+        if (bounds.empty())
+            return;
+
+        std::vector<Point3> centroids;
+        centroids.reserve(bounds.size());
+        for (const auto &b : bounds) {
+            centroids.push_back(b.centroid());
+        }
+
+        nodes.reserve(2 * bounds.size() - 1);
+        nodes.push_back(BVHFlatNode{AABB(), 0, (int)bounds.size(), 0});
+        subdivide(0, bounds, centroids, 1);
+    }
+
+    /**
+     * @brief Recomputes the node bounds after primitives moved, keeping the tree as built.
+     * `bounds` is indexed like the bounds given to build(). Linear in the node count, far
+     * cheaper than build(), but the further primitives move from where build() saw them, the
+     * more the boxes overlap and the slower traversal gets.
+     */
+    void refit(const std::vector<AABB> &bounds) {
+        // Children are stored after their parent, so a backwards sweep sees them first.
+        for (int n = (int)nodes.size() - 1; n >= 0; n--) {
+            BVHFlatNode &node = nodes[n];
+            if (node.count > 0) {
+                AABB box;
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    box = AABB(box, bounds[indices[i]]);
+                }
+                node.bbox = box;
+            } else {
+                node.bbox = AABB(nodes[node.first].bbox, nodes[node.first + 1].bbox);
+            }
+        }
+    }
+
+    /**
+     * @brief Finds the closest hit along the ray.
+     *
+     * @param hit_prim Callable `bool(int prim, const Ray &, Interval, HitRecord &)` that
+     * intersects a single primitive and only writes to the record on a hit.
+     */
+    template <typename HitPrim>
+    bool traverse(const Ray &r, Interval ray_t, HitRecord &rec, HitPrim &&hit_prim) const {
+        if (nodes.empty())
+            return false;
+
+        const Point3 &orig = r.origin();
+        const Vec3 &dir = r.direction();
+        const Vec3 inv_dir(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+
+        std::array<int, max_depth> stack;
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        bool hit_anything = false;
+        auto closest_so_far = ray_t.max;
+
+        while (stack_size > 0) {
+            const BVHFlatNode &node = nodes[stack[--stack_size]];
+            RT_STAT(Stats::local().bvh_nodes_visited++);
+            if (!node.bbox.hit(orig, inv_dir, Interval(ray_t.min, closest_so_far)))
+                continue;
+
+            if (node.count > 0) {
+                RT_STAT(Stats::local().primitive_tests += node.count);
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    if (hit_prim(indices[i], r, Interval(ray_t.min, closest_so_far), rec)) {
+                        hit_anything = true;
+                        closest_so_far = rec.t;
+                    }
+                }
+                continue;
+            }
+
+            // Push the far child first so the near child is popped (and tightens the interval)
+            // first.
+            bool dir_negative = dir[node.axis] < 0;
+            stack[stack_size++] = node.first + (dir_negative ? 0 : 1);
+            stack[stack_size++] = node.first + (dir_negative ? 1 : 0);
+        }
+
+        return hit_anything;
+    }
+
+    /**
+     * @brief Whether any primitive is hit in `ray_t`, for shadow rays. Returns at the first
+     * hit, and as no interval has to shrink it skips ordering the children.
+     *
+     * @param hit_prim Callable `bool(int prim, const Ray &, Interval)`.
+     */
+    template <typename HitPrim>
+    bool traverse_any(const Ray &r, Interval ray_t, HitPrim &&hit_prim) const {
+        if (nodes.empty())
+            return false;
+
+        const Point3 &orig = r.origin();
+        const Vec3 &dir = r.direction();
+        const Vec3 inv_dir(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+
+        std::array<int, max_depth> stack;
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            const BVHFlatNode &node = nodes[stack[--stack_size]];
+            RT_STAT(Stats::local().bvh_nodes_visited++);
+            if (!node.bbox.hit(orig, inv_dir, ray_t))
+                continue;
+
+            if (node.count > 0) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    RT_STAT(Stats::local().primitive_tests++);
+                    if (hit_prim(indices[i], r, ray_t))
+                        return true;
+                }
+                continue;
+            }
+
+            stack[stack_size++] = node.first;
+            stack[stack_size++] = node.first + 1;
+        }
+
+        return false;
+    }
+
+    /**
+     * @brief Walks the tree once for a whole packet of rays. A node is entered if the ray of
+     * any active lane hits its box, and children are visited in the order of `lead_dir`, the
+     * direction of the first ray, which suits coherent packets.
+     *
+     * @param hit_box Callable `unsigned(const AABB &box)` returning a bit for each lane whose
+     * ray hits the box within its interval, which shrinks as hit_leaf finds closer hits.
+     * @param hit_leaf Callable `void(int first, int count, unsigned lanes)` that intersects the
+     * primitives indices[first, first + count) with the rays of the lanes whose bit is set.
+     */
+    template <typename HitBox, typename HitLeaf>
+    void traverse_packet(const Vec3 &lead_dir, HitBox &&hit_box, HitLeaf &&hit_leaf) const {
+        if (nodes.empty())
+            return;
+
+        std::array<int, max_depth> stack;
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size > 0) {
+            const BVHFlatNode &node = nodes[stack[--stack_size]];
+            RT_STAT(Stats::local().bvh_nodes_visited++);
+            unsigned lanes = hit_box(node.bbox);
+            if (lanes == 0)
+                continue;
+
+            if (node.count > 0) {
+                hit_leaf(node.first, node.count, lanes);
+                continue;
+            }
+
+            bool dir_negative = lead_dir[node.axis] < 0;
+            stack[stack_size++] = node.first + (dir_negative ? 0 : 1);
+            stack[stack_size++] = node.first + (dir_negative ? 1 : 0);
+        }
+    }
+
+    private:
+    struct Bin {
+        AABB bbox;
+        int count = 0;
+    };
+
+    void subdivide(int node_index, const std::vector<AABB> &bounds,
+                   const std::vector<Point3> &centroids, int depth) {
+        int first = nodes[node_index].first;
+        int count = nodes[node_index].count;
+
+        AABB node_bbox;
+        AABB centroid_bbox;
+        for (int i = first; i < first + count; i++) {
+            node_bbox = AABB(node_bbox, bounds[indices[i]]);
+            centroid_bbox =
+                AABB(centroid_bbox, AABB(centroids[indices[i]], centroids[indices[i]]));
+        }
+        nodes[node_index].bbox = node_bbox;
+
+        if (count <= 1 || depth >= max_depth - 1)
+            return;
+
+        // Find the cheapest binned split plane over all three axes.
+        int best_axis = -1;
+        int best_split = 0;
+        double best_cost = std::numeric_limits<double>::infinity();
+
+        for (int axis = 0; axis < 3; axis++) {
+            const Interval &extent = centroid_bbox.axis_interval(axis);
+            if (extent.size() <= 0)
+                continue;
+
+            std::array<Bin, bin_count> bins;
+            double scale = bin_count / extent.size();
+            for (int i = first; i < first + count; i++) {
+                int b = bin_of(centroids[indices[i]][axis], extent.min, scale);
+                bins[b].count++;
+                bins[b].bbox = AABB(bins[b].bbox, bounds[indices[i]]);
+            }
+
+            // Sweep from the right to collect the area/count of every right-hand partition.
+            std::array<double, bin_count - 1> right_area;
+            std::array<int, bin_count - 1> right_count;
+            AABB right_box;
+            int right_sum = 0;
+            for (int b = bin_count - 1; b > 0; b--) {
+                right_sum += bins[b].count;
+                right_box = AABB(right_box, bins[b].bbox);
+                right_count[b - 1] = right_sum;
+                right_area[b - 1] = right_box.surface_area();
+            }
+
+            AABB left_box;
+            int left_sum = 0;
+            for (int b = 0; b < bin_count - 1; b++) {
+                left_sum += bins[b].count;
+                left_box = AABB(left_box, bins[b].bbox);
+                if (left_sum == 0 || right_count[b] == 0)
+                    continue;
+
+                double cost =
+                    left_sum * left_box.surface_area() + right_count[b] * right_area[b];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b;
+                }
+            }
+        }
+
+        // SAH cost of splitting relative to intersecting everything in a single leaf, assuming
+        // a node traversal costs about as much as one primitive intersection.
+        double parent_area = node_bbox.surface_area();
+        double split_cost = 1.0 + (parent_area > 0 ? best_cost / parent_area
+                                                   : std::numeric_limits<double>::infinity());
+        if (count <= max_leaf_size && split_cost >= count)
+            return;
+
+        int mid;
+        if (best_axis < 0) {
+            // All centroids coincide, so no plane separates them. Split the range in half.
+            mid = first + count / 2;
+            best_axis = node_bbox.longest_axis();
+        } else {
+            const Interval &extent = centroid_bbox.axis_interval(best_axis);
+            double scale = bin_count / extent.size();
+            auto it = std::partition(indices.begin() + first, indices.begin() + first + count,
+                                     [&](int prim) {
+                                         return bin_of(centroids[prim][best_axis], extent.min,
+                                                       scale) <= best_split;
+                                     });
+            mid = (int)(it - indices.begin());
+        }
+
+        int left_index = (int)nodes.size();
+        nodes.push_back(BVHFlatNode{AABB(), first, mid - first, 0});
+        nodes.push_back(BVHFlatNode{AABB(), mid, first + count - mid, 0});
+
+        nodes[node_index].first = left_index;
+        nodes[node_index].count = 0;
+        nodes[node_index].axis = best_axis;
+
+        subdivide(left_index, bounds, centroids, depth + 1);
+        subdivide(left_index + 1, bounds, centroids, depth + 1);
+    }
+
+    static int bin_of(Real c, Real min, double scale) {
+        int b = int((c - min) * scale);
+        return std::clamp(b, 0, bin_count - 1);
+    }
+};
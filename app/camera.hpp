@@ -1,53 +1,96 @@
 #pragma once
 
+#include "arena.hpp"
+#include "denoise.hpp"
+#include "flat_scene.hpp"
 #include "hittable.hpp"
+#include "image.hpp"
+#include "light.hpp"
 #include "material.hpp"
 #include "math.hpp"
 #include "ray.hpp"
+#include "sampler.hpp"
+#include "scheduler.hpp"
+#include "stats.hpp"
+#include "wavefront.hpp"
 #include <algorithm>
-#include <execution>
-#include <fstream>
-#include <numeric>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
 
-inline double linear_to_gamma(double linear_component) {
-    if (linear_component > 0)
-        return std::sqrt(linear_component);
+/**
+ * @brief Running mean and variance of a stream of values (Welford's algorithm).
+ */
+struct RunningStats {
+    int count = 0;
+    double mean = 0;
+    double m2 = 0; // Sum of squared differences from the mean
 
-    return 0;
-}
-
-inline void write_color(std::ostream &out, const Color &pixel_color) {
-    auto r = pixel_color.x();
-    auto g = pixel_color.y();
-    auto b = pixel_color.z();
+    void add(double x) {
+        count++;
+        double delta = x - mean;
+        mean += delta / count;
+        m2 += delta * (x - mean);
+    }
 
-    // Apply a linear to gamma transform for gamma 2
-    r = linear_to_gamma(r);
-    g = linear_to_gamma(g);
-    b = linear_to_gamma(b);
+    double variance() const { return count > 1 ? m2 / (count - 1) : 0; }
 
-    // Translate the [0,1] component values to the byte range [0,255].
-    static const Interval intensity(0.000, 0.999);
-    int rbyte = int(256 * intensity.clamp(r));
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
+    // Estimated standard error of the mean.
+    double standard_error() const { return std::sqrt(variance() / count); }
+};
 
-    // Write out the pixel color components.
-    out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
+inline double luminance(const Color &c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
 }
 
+/**
+ * @brief Counters for one worker thread, padded to a cache line so workers never share one.
+ */
+struct alignas(64) WorkerStats {
+    int64_t primary_rays = 0;
+    int64_t secondary_rays = 0;
+    int64_t roulette_terminations = 0; // Paths ended by Russian roulette or min_throughput
+    int64_t shadow_rays = 0;           // Next-event estimation visibility tests
+    double busy_seconds = 0; // Time spent rendering tiles
+};
+
+/**
+ * @brief Measurements of the last Camera::render call.
+ */
+struct RenderStats {
+    double seconds = 0;
+    int64_t primary_rays = 0;
+    int64_t secondary_rays = 0;
+    int64_t roulette_terminations = 0;
+    int64_t shadow_rays = 0;
+    double denoise_seconds = 0; // Part of `seconds` spent in the denoise pass
+    // Samples per pixel taken by render(), lower with adaptive sampling
+    double average_samples = 0;
+    std::vector<double> thread_busy_seconds;
 
-struct CameraRay {
-    Color *output_pixel;
-    int x;
-    int y;
+    int64_t total_rays() const { return primary_rays + secondary_rays + shadow_rays; }
+    // Average number of path segments traced per camera sample, without shadow rays.
+    double average_path_length() const {
+        return primary_rays > 0 ? double(primary_rays + secondary_rays) / primary_rays : 0;
+    }
+    double rays_per_second() const { return seconds > 0 ? total_rays() / seconds : 0; }
+
+    // Fraction of the render time the given worker spent on tiles.
+    double utilization(int thread) const {
+        return seconds > 0 ? thread_busy_seconds[thread] / seconds : 0;
+    }
 };
 
 struct CameraRayScatter{
     Color color;
     bool reflected;
     Ray ray;
+    Color light;  // Emitted and direct light reaching the path at this hit, before `color`
+    Real pdf = 0; // Density of `ray` for multiple importance sampling, 0 if it is not needed
 };
 
 class Camera {
@@ -58,135 +101,786 @@ class Camera {
     int image_width = 100;                  // Rendered image width in pixel count
     int samples_per_pixel = 10;             // Count of random samples for each pixel
     int max_depth = 5;                      // Maximum ray recursion depth
+    uint64_t seed = 0;                      // Frame seed, the same seed renders the same image
+    // Pattern of the pixel jitter and bounce directions (see sampler.hpp). The low-discrepancy
+    // patterns reach the noise level of independent samples with fewer samples per pixel.
+    SamplerType sampler_type = SamplerType::Independent;
+    int tile_size = 32;                     // Width and height of a render tile in pixels
+    int thread_count = 0;                   // Worker threads, 0 uses every hardware thread
+    // Trace the primary rays of packet_size adjacent pixels together. A FlatScene tests them
+    // against its spheres with SIMD (see FlatScene::hit_packet); the image is the same.
+    bool packet_tracing = false;
+    bool show_progress = true;              // Print the pixels remaining while rendering
+
+    // Russian roulette: from roulette_min_depth bounces on, a path survives each bounce with a
+    // probability that follows its throughput, and survivors are weighted up to stay unbiased.
+    bool russian_roulette = false;
+    int roulette_min_depth = 3;
+    // Paths whose throughput falls below this in every channel end early. Their remaining
+    // contribution is dropped, which biases the image by at most this much per sample. 0
+    // disables.
+    Real min_throughput = 0;
+
+    // Wavefront integrator: instead of following one sample at a time, a tile's samples are
+    // traced a bounce at a time as a queue of paths, with hits grouped by material before
+    // scattering. Renders the same image as the default integrator. Ignores packet_tracing and
+    // adaptive sampling.
+    bool wavefront = false;
+    int wavefront_size = 1 << 14;           // Most paths in flight per worker
+
+    double vfov = 90;                       // Vertical view angle (field of view) in degrees
+    Point3 lookfrom = Point3(0, 0, 0);      // Point camera is looking from
+    Point3 lookat = Point3(0, 0, -1);       // Point camera is looking at
+    Vec3 vup = Vec3(0, 1, 0);               // Camera-relative "up" direction
+
+    // Adaptive sampling: samples_per_pixel becomes the maximum, and a pixel stops early once
+    // the standard error of its luminance falls below adaptive_threshold relative to its
+    // brightness. Packet tracing always takes samples_per_pixel samples.
+    bool adaptive_sampling = false;
+    double adaptive_threshold = 0.01;       // Relative standard error at which a pixel is done
+    int adaptive_min_samples = 16;          // Samples every pixel takes before it may stop
+    std::string sample_heatmap_file = "";   // If set, write an image of the samples per pixel
+
+    // Builds with RT_STATS print hot-path counters after each render. If set, an image of the
+    // BVH nodes and primitives tested per pixel is written here as well.
+    std::string cost_image_file = "";
+
+    // With render_aovs the first non-specular hit of every camera sample is recorded as albedo,
+    // normal and depth AOVs (see aovs()). With denoise they guide a filter pass over the image
+    // before it is written (see Denoiser). Only render() records AOVs, and only render()
+    // denoises.
+    bool render_aovs = false;
+    bool denoise = false;                   // Implies render_aovs
+    Denoiser denoiser;                      // Settings of the denoise pass
+    std::string aov_file_prefix = "";       // If set, write <prefix>albedo/normal/depth.pfm
+
+    // Rays that leave the scene see a sky gradient. Without it the scene is lit by its lights
+    // alone, and paths cut off at max_depth add nothing.
+    bool sky = true;
+    // Next-event estimation: at every diffuse hit a shadow ray is traced towards a point picked
+    // on the scene's DiffuseLight objects (see LightList), weighted against hitting the light
+    // by chance with multiple importance sampling. Small lights converge far faster this way.
+    // Scenes without lights render the same either way.
+    bool next_event_estimation = true;
+    // Render a FlatScene with loops compiled for it: its hit functions and the materials of its
+    // closed set are called directly and can be inlined (see dispatch_world). Off, every scene
+    // goes through the virtual Hittable and Material calls, for comparison. The image is the
+    // same.
+    bool static_dispatch = true;
     
-    std::string output_file = "output.ppm"; // Output file name
+    std::string output_file = "output.ppm"; // Output .ppm, .pfm or .png file, empty to skip
 
     void render(const Hittable &world) {
         initialize();
+        frame_arena.reset();
+        lights = next_event_estimation ? world.light_list() : nullptr;
 
-        // Calculate all the ray instances we need to cast.
+        bool adaptive = adaptive_sampling && !packet_tracing && !wavefront;
+        std::span<int> sample_counts =
+            frame_arena.make_array<int>(adaptive ? image_height * image_width : 0);
 
-        std::vector<Color> pixels(image_height * image_width, Color(0, 0, 0));
-        std::vector<CameraRay> rays;
-        rays.reserve(image_height * image_width);
+        // Samples are summed straight into the image, which is then scaled in place, so a
+        // render needs no second full size buffer.
+        pixels.assign(image_height * image_width, Color(0, 0, 0));
+        bool record_aovs = render_aovs || denoise;
+        aov_buffers.assign(record_aovs ? image_height * image_width : 0);
+        AOVBuffers *aovs = record_aovs ? &aov_buffers : nullptr;
 
-        for (int j = 0; j < image_height; j++) {
-            for (int i = 0; i < image_width; i++) {
-                auto out_pixel = &pixels[j * image_width + i];
-                rays.push_back(CameraRay(out_pixel, i, j));
+        dispatch_world(world, [&](const auto &scene) {
+            run_tiles([&](const Tile &tile, WorkerStats &ws, int worker) {
+                if (!adaptive) {
+                    render_tile_samples(tile, scene, 0, samples_per_pixel, pixels, ws, worker,
+                                        aovs);
+                    for (int j = tile.y0; j < tile.y1; j++) {
+                        for (int i = tile.x0; i < tile.x1; i++) {
+                            pixels[j * image_width + i] =
+                                pixels[j * image_width + i] * pixel_samples_scale;
+                            if (aovs)
+                                aovs->scale(j * image_width + i, pixel_samples_scale);
+                        }
+                    }
+                    return;
+                }
+
+                for (int j = tile.y0; j < tile.y1; j++) {
+                    for (int i = tile.x0; i < tile.x1; i++) {
+                        RT_STAT(int64_t cost_before = Stats::local().cost());
+                        pixels[j * image_width + i] = render_pixel_adaptive(
+                            i, j, scene, ws, sample_counts[j * image_width + i], aovs);
+                        RT_STAT(record_tile_cost(Tile{i, j, i + 1, j + 1},
+                                                 Stats::local().cost() - cost_before));
+                    }
+                }
+            });
+        });
+
+        if (adaptive) {
+            int64_t total = 0;
+            for (int count : sample_counts) {
+                total += count;
             }
+            last_stats.average_samples = double(total) / sample_counts.size();
+            report_adaptive(sample_counts);
+        } else {
+            last_stats.average_samples = samples_per_pixel;
         }
 
-        std::mutex m;
+        if (denoise) {
+            auto start = std::chrono::steady_clock::now();
+            denoiser.run(pixels, aov_buffers, image_width, image_height, get_pool());
+            last_stats.denoise_seconds =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            last_stats.seconds += last_stats.denoise_seconds;
+        }
 
-        int rays_remaining = rays.size();
-        // Simulate the rays
-        std::for_each(std::execution::par_unseq, rays.begin(), rays.end(), [&](CameraRay &r) {
-            Color pixel_color(0, 0, 0);
+        if (record_aovs && !aov_file_prefix.empty()) {
+            write_aovs();
+        }
 
-            for (int sample = 0; sample < samples_per_pixel; sample++) {
-                // -- SHOOT RAY --
-                Ray ray = get_ray(r.x, r.y, sample);
-                // Yeet and scatter the ray into the world
-                auto next = scatter_ray(ray, world);
-                auto r_color = next.color; // Track color for the current ray
-                for (int d = 1; d < max_depth; d++) {
-                    
-                    if (!next.reflected) {
-                        break;
-                    }
+        if (!output_file.empty()) {
+            write_image(output_file, pixels, image_width, image_height);
+        }
+    }
+
+    /**
+     * @brief Traces samples [first_sample, first_sample + count) of every pixel and adds them
+     * to `sums`, one color per pixel. Dividing the sums by the number of samples taken gives
+     * the image, so splitting samples over several calls renders the same image as one call.
+     * Used by RenderSession; does not touch image() or write output_file.
+     *
+     * `Sum` is Color, or any type with `+= Color` such as the fixed point FixedColor of partial
+     * renders. Only the tiles [first_tile, end_tile) of make_tiles are rendered, -1 for the
+     * end.
+     */
+    template <typename Sum>
+    void add_samples(const Hittable &world, int first_sample, int count, std::vector<Sum> &sums,
+                     int first_tile = 0, int end_tile = -1) {
+        initialize();
+        frame_arena.reset();
+        if (sums.size() != size_t(image_width) * image_height) {
+            throw std::runtime_error("Camera::add_samples: accumulation buffer does not match "
+                                     "the image size.");
+        }
+        lights = next_event_estimation ? world.light_list() : nullptr;
+
+        dispatch_world(world, [&](const auto &scene) {
+            run_tiles(
+                [&](const Tile &tile, WorkerStats &ws, int worker) {
+                    render_tile_samples(tile, scene, first_sample, count, sums, ws, worker,
+                                        nullptr);
+                },
+                first_tile, end_tile);
+        });
+    }
+
+    // Rendered image height, from image_width and aspect_ratio.
+    int get_image_height() const { return std::max(1, int(image_width / aspect_ratio)); }
+
+    // The image of the last render, row by row.
+    const std::vector<Color> &image() const { return pixels; }
+
+    // Exchanges the image of the last render with `other`. The next render reuses the memory it
+    // gets, so a caller that keeps the image, such as FrameWriter, can avoid copying it.
+    void swap_image(std::vector<Color> &other) { pixels.swap(other); }
+
+    const RenderStats &stats() const { return last_stats; }
+
+    // Per-pixel AOVs of the last render, empty unless render_aovs or denoise was set.
+    const AOVBuffers &aovs() const { return aov_buffers; }
+
+    private:
+    int image_height;           // Rendered image height
+    Real pixel_samples_scale;   // Color scale factor for a sum of pixel samples
+    Point3 center;              // Camera center
+    Point3 pixel00_loc;         // Location of pixel 0, 0
+    Vec3 pixel_delta_u;         // Offset to pixel to the right
+    Vec3 pixel_delta_v;         // Offset to pixel below
+    std::shared_ptr<ThreadPool> pool; // Kept alive across renders so threads are spawned once
+    std::vector<Color> pixels;        // Image of the last render
+    AOVBuffers aov_buffers;           // AOVs of the last render
+    Arena frame_arena;                // Temporaries of the current render, reset by the next
+    // One per worker, kept to reuse their memory
+    std::vector<WavefrontBuffers> wavefront_buffers;
+    const LightList *lights = nullptr; // Lights of the scene being rendered, null without NEE
+    RenderStats last_stats;
+#ifdef RT_ENABLE_STATS
+    // BVH nodes and primitives tested per pixel in the last pass
+    std::vector<double> pixel_cost;
+#endif
+
+    ThreadPool &get_pool() {
+        int wanted = thread_count > 0 ? thread_count
+                                      : std::max(1, (int)std::thread::hardware_concurrency());
+        if (!pool || pool->size() != wanted)
+            pool = std::make_shared<ThreadPool>(wanted);
+        return *pool;
+    }
+
+    /**
+     * @brief Runs `render_tile(tile, worker_stats, worker)` for every tile on the thread pool,
+     * and collects the stats of the pass into last_stats. Only tiles [first_tile, end_tile) are
+     * run, -1 for the end. Temporaries of the pass come from frame_arena.
+     */
+    template <typename TileFn>
+    void run_tiles(TileFn &&render_tile, int first_tile = 0, int end_tile = -1) {
+        auto start = std::chrono::steady_clock::now();
+        int total_tiles = tile_count(image_width, image_height, tile_size);
+        int end = end_tile < 0 ? total_tiles : end_tile;
+        if (first_tile < 0 || first_tile > end || end > total_tiles) {
+            throw std::runtime_error("Camera: tile range out of bounds.");
+        }
+        std::span<Tile> tiles = frame_arena.make_array<Tile>(end - first_tile);
+        for (int t = 0; t < (int)tiles.size(); t++) {
+            tiles[t] = tile_at(first_tile + t, image_width, image_height, tile_size);
+        }
+
+        ThreadPool &workers = get_pool();
+        std::span<WorkerStats> worker_stats =
+            frame_arena.make_array<WorkerStats>(workers.size());
+        if (wavefront) {
+            wavefront_buffers.resize(workers.size());
+        }
+
+#ifdef RT_ENABLE_STATS
+        Stats::reset();
+        std::span<double> tile_seconds = frame_arena.make_array<double>(tiles.size());
+        pixel_cost.assign(cost_image_file.empty() ? 0 : image_width * image_height, 0);
+#endif
+
+        std::optional<ProgressReporter> progress;
+        if (show_progress) {
+            int64_t pixel_count = 0;
+            for (const Tile &tile : tiles) {
+                pixel_count += tile.pixel_count();
+            }
+            progress.emplace(pixel_count);
+        }
+
+        // Simulate the rays, one tile per task. Tiles are small enough to keep their part of
+        // the image in cache, and idle workers steal the remaining tiles of busy ones.
+        workers.run((int)tiles.size(), [&](int tile_index, int worker) {
+            auto tile_start = std::chrono::steady_clock::now();
+            const Tile &tile = tiles[tile_index];
+            WorkerStats &ws = worker_stats[worker];
+
+            render_tile(tile, ws, worker);
+
+            if (progress) {
+                progress->add(tile.pixel_count());
+            }
+            double seconds =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - tile_start)
+                    .count();
+            ws.busy_seconds += seconds;
+            RT_STAT(tile_seconds[tile_index] = seconds);
+        });
+
+        if (progress) {
+            progress->finish();
+        }
 
-                    next = scatter_ray(next.ray, world);
-                    r_color = r_color * next.color; // Accumulate color
+        // Reuses the memory of the last pass's per-thread times.
+        std::vector<double> busy_seconds = std::move(last_stats.thread_busy_seconds);
+        busy_seconds.clear();
+        last_stats = RenderStats();
+        last_stats.thread_busy_seconds = std::move(busy_seconds);
+        for (const auto &ws : worker_stats) {
+            last_stats.primary_rays += ws.primary_rays;
+            last_stats.secondary_rays += ws.secondary_rays;
+            last_stats.roulette_terminations += ws.roulette_terminations;
+            last_stats.shadow_rays += ws.shadow_rays;
+            last_stats.thread_busy_seconds.push_back(ws.busy_seconds);
+        }
+        last_stats.seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+#ifdef RT_ENABLE_STATS
+        report_stats(tile_seconds);
+#endif
+    }
+
+    /**
+     * @brief Adds samples [first, first + count) of every pixel of the tile to `sums`, with the
+     * integrator picked by the camera parameters. If `aovs` is set, the first-hit AOVs of the
+     * samples are added to it as well.
+     */
+    template <typename Sum, typename World>
+    void render_tile_samples(const Tile &tile, const World &world, int first, int count,
+                             std::vector<Sum> &sums, WorkerStats &ws, int worker,
+                             AOVBuffers *aovs) {
+        if (wavefront) {
+            RT_STAT(int64_t cost_before = Stats::local().cost());
+            render_tile_wavefront(tile, world, first, count, sums, wavefront_buffers[worker],
+                                  ws, aovs);
+            RT_STAT(record_tile_cost(tile, Stats::local().cost() - cost_before));
+        } else if (packet_tracing) {
+            RT_STAT(int64_t cost_before = Stats::local().cost());
+            render_tile_packets(tile, world, first, count, sums, ws, aovs);
+            RT_STAT(record_tile_cost(tile, Stats::local().cost() - cost_before));
+        } else {
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    RT_STAT(int64_t cost_before = Stats::local().cost());
+                    add_pixel_samples(i, j, first, count, world, ws, sums[j * image_width + i],
+                                      aovs);
+                    RT_STAT(record_tile_cost(Tile{i, j, i + 1, j + 1},
+                                             Stats::local().cost() - cost_before));
                 }
-                // -- END SHOOT RAY --
-                
-                pixel_color += r_color; // Sum color of all samples
             }
+        }
+    }
 
-            *r.output_pixel = pixel_color * pixel_samples_scale;
+    // Adds samples [first, first + count) of pixel i, j to `sum`, and their AOVs to `aovs` if
+    // set.
+    template <typename Sum, typename World>
+    void add_pixel_samples(int i, int j, int first, int count, const World &world,
+                           WorkerStats &ws, Sum &sum, AOVBuffers *aovs) const {
+        for (int sample = first; sample < first + count; sample++) {
+            Sampler sampler = make_sampler(i, j, sample);
+            RT_STAT(Stats::local().count_ray(0));
+            AOVPath aov;
+            AOVPath *record = aovs ? &aov : nullptr;
 
+            // -- SHOOT RAY --
+            Ray ray = get_ray(i, j, sampler);
+            // Yeet and scatter the ray into the world
+            sum += trace_path(scatter_ray(ray, world, sampler, ws, 0, 0, record), world,
+                              sampler, ws, record);
+            // -- END SHOOT RAY --
+            if (aovs)
+                aovs->add(size_t(j) * image_width + i, aov.sample);
+        }
+        ws.primary_rays += count;
+    }
+
+    /**
+     * @brief Renders pixel i, j like add_pixel_samples, but stops once the pixel has converged.
+     * @param samples_taken Set to the number of samples actually taken.
+     * @param aovs If set, the mean AOVs of the samples taken are stored in it.
+     */
+    template <typename World>
+    Color render_pixel_adaptive(int i, int j, const World &world, WorkerStats &ws,
+                                int &samples_taken, AOVBuffers *aovs) const {
+        Color pixel_color(0, 0, 0);
+        RunningStats stats;
+        size_t p = size_t(j) * image_width + i;
+
+        int min_samples = std::min(adaptive_min_samples, samples_per_pixel);
+        while (stats.count < samples_per_pixel) {
+            Sampler sampler = make_sampler(i, j, stats.count);
+            RT_STAT(Stats::local().count_ray(0));
+
+            AOVPath aov;
+            AOVPath *record = aovs ? &aov : nullptr;
+
+            Ray ray = get_ray(i, j, sampler);
+            Color sample_color = trace_path(scatter_ray(ray, world, sampler, ws, 0, 0, record),
+                                            world, sampler, ws, record);
+            pixel_color += sample_color;
+            if (aovs)
+                aovs->add(p, aov.sample);
+            stats.add(luminance(sample_color));
 
-            rays_remaining--;
-            if (rays_remaining % 100 == 0) {
-                m.lock();
-                std::clog << "\rRemaining: " << rays_remaining << std::flush;
-                m.unlock();
+            if (stats.count >= min_samples &&
+                stats.standard_error() <= adaptive_threshold * std::max(stats.mean, 0.01)) {
+                break;
             }
+        }
 
-        });
+        samples_taken = stats.count;
+        ws.primary_rays += stats.count;
+        if (aovs)
+            aovs->scale(p, Real(1) / stats.count);
+        return pixel_color * (1.0 / stats.count);
+    }
+
+#ifdef RT_ENABLE_STATS
+    // Spreads the cost of a tile evenly over its pixels.
+    void record_tile_cost(const Tile &tile, int64_t cost) {
+        if (pixel_cost.empty())
+            return;
+        double per_pixel = double(cost) / tile.pixel_count();
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                pixel_cost[j * image_width + i] = per_pixel;
+            }
+        }
+    }
+
+    void report_stats(std::span<const double> tile_seconds) const {
+        Stats::collect().print(std::clog);
+
+        auto [min_tile, max_tile] =
+            std::minmax_element(tile_seconds.begin(), tile_seconds.end());
+        double total = 0;
+        for (double t : tile_seconds) {
+            total += t;
+        }
+        std::clog << "  Tile time: min " << *min_tile * 1000 << "ms, avg "
+                  << total / tile_seconds.size() * 1000 << "ms, max " << *max_tile * 1000
+                  << "ms over " << tile_seconds.size() << " tiles\n";
+
+        if (pixel_cost.empty())
+            return;
+
+        // Grayscale, brightest where the most nodes and primitives were tested. Squared because
+        // the image writer applies a gamma 2 transform.
+        double max_cost =
+            std::max(1.0, *std::max_element(pixel_cost.begin(), pixel_cost.end()));
+        std::vector<Color> image(pixel_cost.size());
+        for (size_t p = 0; p < pixel_cost.size(); p++) {
+            double t = pixel_cost[p] / max_cost;
+            image[p] = Color(t * t, t * t, t * t);
+        }
+        write_image(cost_image_file, image, image_width, image_height);
+    }
+#endif
+
+    void write_aovs() const {
+        write_image(aov_file_prefix + "albedo.pfm", aov_buffers.albedo, image_width,
+                    image_height);
+        write_image(aov_file_prefix + "normal.pfm", aov_buffers.normal, image_width,
+                    image_height);
+        std::vector<Color> depth(aov_buffers.depth.size());
+        for (size_t p = 0; p < depth.size(); p++) {
+            depth[p] = Color(aov_buffers.depth[p], aov_buffers.depth[p], aov_buffers.depth[p]);
+        }
+        write_image(aov_file_prefix + "depth.pfm", depth, image_width, image_height);
+    }
+
+    void report_adaptive(std::span<const int> sample_counts) const {
+        double average = last_stats.average_samples;
+        std::clog << "Adaptive sampling: " << average << " samples per pixel on average (max "
+                  << samples_per_pixel << "), "
+                  << 100.0 * (1.0 - average / samples_per_pixel) << "% of samples skipped\n";
 
-        // std::vector<int> rowIndices(image_height);
+        if (sample_heatmap_file.empty())
+            return;
 
-        // std::iota(rowIndices.begin(), rowIndices.end(), 0);
+        // Blue for pixels that stopped at the minimum, red for pixels that needed every sample.
+        // The channels are squared because the image writer applies a gamma 2 transform.
+        std::vector<Color> heatmap(sample_counts.size());
+        int min_samples = std::min(adaptive_min_samples, samples_per_pixel);
+        double range = std::max(1, samples_per_pixel - min_samples);
+        for (size_t p = 0; p < sample_counts.size(); p++) {
+            double t = std::clamp((sample_counts[p] - min_samples) / range, 0.0, 1.0);
+            heatmap[p] = Color(t * t, 0, (1 - t) * (1 - t));
+        }
+        write_image(sample_heatmap_file, heatmap, image_width, image_height);
+    }
 
-        // std::vector<std::vector<Color>> imageBuffer(image_height,
-        //                                             std::vector<Color>(image_width));
+    /**
+     * @brief Renders a tile with the primary rays of packet_size horizontally adjacent pixels
+     * traced together. Secondary bounces are incoherent and continue one ray at a time.
+     */
+    template <typename Sum, typename World>
+    void render_tile_packets(const Tile &tile, const World &world, int first, int count,
+                             std::vector<Sum> &sums, WorkerStats &ws, AOVBuffers *aovs) {
+        RayPacket packet;
+        PacketHits hits;
+        std::array<Sampler, packet_size> samplers;
 
-        // int rowsRemaining = image_height;
-        // std::for_each(
-        //     std::execution::seq, rowIndices.begin(), rowIndices.end(), [&](int &rowIndex) {
-        //         auto row = imageBuffer[rowIndex];
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i0 = tile.x0; i0 < tile.x1; i0 += packet_size) {
+                packet.count = std::min(packet_size, tile.x1 - i0);
+                std::array<Sum, packet_size> pixel_colors;
+                for (int lane = 0; lane < packet.count; lane++) {
+                    pixel_colors[lane] = sums[j * image_width + i0 + lane];
+                }
+
+                for (int sample = first; sample < first + count; sample++) {
+                    for (int lane = 0; lane < packet.count; lane++) {
+                        samplers[lane] = make_sampler(i0 + lane, j, sample);
+                        packet.rays[lane] = get_ray(i0 + lane, j, samplers[lane]);
+                    }
 
-        //         for (int i = 0; i < (int)row.size(); i++) {
-        //             Color pixel_color(0, 0, 0);
-        //             for (int sample = 0; sample < samples_per_pixel; sample++) {
-        //                 Ray r = get_ray(i, rowIndex, sample);
-        //                 pixel_color += ray_color(r, world);
-        //             }
-        //             imageBuffer[rowIndex][i] = pixel_samples_scale * pixel_color;
-        //         }
-        //         rowsRemaining--;
+                    world.hit_packet(packet, Interval(0.0001, infinity), hits);
+                    RT_STAT(count_packet(packet, hits));
+
+                    for (int lane = 0; lane < packet.count; lane++) {
+                        AOVPath aov;
+                        AOVPath *record = aovs ? &aov : nullptr;
+                        if (record)
+                            record_aov(aov, packet.rays[lane], hits.hit[lane], hits.recs[lane]);
+                        auto primary = shade(packet.rays[lane], hits.hit[lane], hits.recs[lane],
+                                             samplers[lane], world, ws, 0, 0);
+                        pixel_colors[lane] +=
+                            trace_path(primary, world, samplers[lane], ws, record);
+                        if (aovs)
+                            aovs->add(size_t(j) * image_width + i0 + lane, aov.sample);
+                    }
+                }
+                ws.primary_rays += int64_t(count) * packet.count;
+
+                for (int lane = 0; lane < packet.count; lane++) {
+                    sums[j * image_width + i0 + lane] = pixel_colors[lane];
+                }
+            }
+        }
+    }
 
-        //         m.lock();
-        //         std::clog << "\rScanlines remaining: " << rowsRemaining << ' ' << std::flush;
-        //         m.unlock();
-        //     });
-        // for (int j = 0; j < image_height; j++) {
-        //     std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' <<
-        //     std::flush;
+    /**
+     * @brief Adds samples [first, first + count) of the tile's pixels to `sums` with the
+     * wavefront integrator, in waves of up to wavefront_size paths.
+     *
+     * Every path keeps the sampler of its camera sample and its results are summed in sample
+     * order, so the image is bit-identical to the one of add_pixel_samples.
+     */
+    template <typename Sum, typename World>
+    void render_tile_wavefront(const Tile &tile, const World &world, int first, int count,
+                               std::vector<Sum> &sums, WavefrontBuffers &wb, WorkerStats &ws,
+                               AOVBuffers *aovs) {
+        int tile_width = tile.x1 - tile.x0;
+        int pixel_count = tile.pixel_count();
+        int wave_samples = std::clamp(wavefront_size / pixel_count, 1, std::max(count, 1));
 
-        // }
+        for (int wave = first; wave < first + count; wave += wave_samples) {
+            int samples = std::min(wave_samples, first + count - wave);
 
-        std::ofstream output_stream(output_file);
+            // Camera rays. A path's slot is pixel * samples + sample.
+            wb.current.clear();
+            wb.current.reserve(pixel_count * samples);
+            wb.results.assign(pixel_count * samples, Color(0, 0, 0));
+            if (aovs)
+                wb.aovs.assign(pixel_count * samples, AOVPath());
+            for (int p = 0; p < pixel_count; p++) {
+                int i = tile.x0 + p % tile_width;
+                int j = tile.y0 + p / tile_width;
+                for (int s = 0; s < samples; s++) {
+                    Sampler sampler = make_sampler(i, j, wave + s);
+                    Ray ray = get_ray(i, j, sampler);
+                    wb.current.push(ray, Color(1, 1, 1), 0, uint32_t(p * samples + s), sampler);
+                }
+            }
+            ws.primary_rays += int64_t(pixel_count) * samples;
 
-        output_stream << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+            trace_wave(world, wb, ws, aovs != nullptr);
 
-        // Write the pixel color values to the output file.
-        for (int j = 0; j < image_height; j++) {
-            for (int i = 0; i < image_width; ++i) {
-                write_color(output_stream, pixels[j * image_width + i]);
+            for (int p = 0; p < pixel_count; p++) {
+                size_t pixel = size_t(tile.y0 + p / tile_width) * image_width + tile.x0 +
+                               p % tile_width;
+                Sum &sum = sums[pixel];
+                for (int s = 0; s < samples; s++) {
+                    sum += wb.results[p * samples + s];
+                    if (aovs)
+                        aovs->add(pixel, wb.aovs[p * samples + s].sample);
+                }
             }
         }
+    }
+
+    /**
+     * @brief Extends every path of `wb.current` one bounce at a time until all have terminated,
+     * adding their colors to `wb.results`, and with `record_aovs` recording their AOVs in
+     * `wb.aovs`.
+     *
+     * Each bounce runs in stages over the whole queue: intersect every path, bin the hits by
+     * material with a counting sort, run one scatter kernel per bin, and compact the surviving
+     * paths into `wb.next`. Misses are shaded with the sky during intersection, lights in the
+     * scatter kernels.
+     */
+    template <typename World>
+    void trace_wave(const World &world, WavefrontBuffers &wb, WorkerStats &ws,
+                    bool record_aovs) const {
+        for (int depth = 0; wb.current.size() > 0; depth++) {
+            int n = wb.current.size();
+            if (depth > 0)
+                ws.secondary_rays += n;
 
-        output_stream.close();
-        std::clog << "\rDone.                 \n";
+            // Intersection stage.
+            wb.recs.resize(n);
+            wb.hit.resize(n);
+            wb.bin.resize(n);
+            int bin_start[material_bin_count + 1] = {};
+            for (int k = 0; k < n; k++) {
+                RT_STAT(Stats::local().count_ray(depth));
+                Ray r = wb.current.ray(k);
+                bool hit = world.hit(r, Interval(0.0001, infinity), wb.recs[k]);
+                RT_STAT(Stats::local().world_queries++);
+                RT_STAT(Stats::local().world_hits += hit);
+                wb.hit[k] = hit;
+                if (record_aovs && wb.aovs[wb.current.slot[k]].open) {
+                    record_aov(wb.aovs[wb.current.slot[k]], r, hit, wb.recs[k]);
+                }
+                if (hit) {
+                    wb.bin[k] = uint8_t(with_material(world, wb.recs[k], [](const auto &m) {
+                        return material_bin(m);
+                    }));
+                    bin_start[wb.bin[k] + 1]++;
+                } else {
+                    wb.results[wb.current.slot[k]] += wb.current.throughput(k) * miss_color(r);
+                }
+            }
+
+            // Group the hits by material bin.
+            for (int b = 0; b < material_bin_count; b++) {
+                bin_start[b + 1] += bin_start[b];
+            }
+            wb.order.resize(bin_start[material_bin_count]);
+            int fill[material_bin_count];
+            std::copy(bin_start, bin_start + material_bin_count, fill);
+            for (int k = 0; k < n; k++) {
+                if (wb.hit[k])
+                    wb.order[fill[wb.bin[k]]++] = k;
+            }
+
+            // Scatter stage, one kernel per material bin.
+            wb.next.clear();
+            wb.next.reserve(n);
+            const int *order = wb.order.data();
+            scatter_bin<Lambertian>(order + bin_start[int(MaterialBin::Lambertian)],
+                                    order + bin_start[int(MaterialBin::Lambertian) + 1], depth,
+                                    world, wb, ws);
+            scatter_bin<Metal>(order + bin_start[int(MaterialBin::Metal)],
+                               order + bin_start[int(MaterialBin::Metal) + 1], depth, world, wb,
+                               ws);
+            scatter_bin<Material>(order + bin_start[int(MaterialBin::Other)],
+                                  order + bin_start[int(MaterialBin::Other) + 1], depth, world,
+                                  wb, ws);
+            std::swap(wb.current, wb.next);
+        }
     }
 
-    private:
-    int image_height;           // Rendered image height
-    double pixel_samples_scale; // Color scale factor for a sum of pixel samples
-    Point3 center;              // Camera center
-    Point3 pixel00_loc;         // Location of pixel 0, 0
-    Vec3 pixel_delta_u;         // Offset to pixel to the right
-    Vec3 pixel_delta_v;         // Offset to pixel below
+    /**
+     * @brief Scatter kernel of one material bin. For a concrete material type `M` the calls to
+     * the material are not virtual, so the kernel is a tight loop over paths with the same
+     * code. The generic bin is dispatched per path (see with_material).
+     */
+    template <typename M, typename World>
+    void scatter_bin(const int *begin, const int *end, int depth, const World &world,
+                     WavefrontBuffers &wb, WorkerStats &ws) const {
+        for (const int *it = begin; it != end; it++) {
+            const HitRecord &rec = wb.recs[*it];
+            if constexpr (std::is_same_v<M, Material>) {
+                with_material(world, rec, [&](const auto &m) {
+                    scatter_path(m, *it, depth, world, wb, ws);
+                });
+            } else {
+                scatter_path(material_as<M>(world, rec), *it, depth, world, wb, ws);
+            }
+        }
+    }
+
+    // Scatters path k of the wavefront at its hit on `mat`, see scatter_bin.
+    template <typename M, typename World>
+    void scatter_path(const M &mat, int k, int depth, const World &world, WavefrontBuffers &wb,
+                      WorkerStats &ws) const {
+        const HitRecord &rec = wb.recs[k];
+        Ray r = wb.current.ray(k);
+        Color light = lights ? surface_light(mat, r, rec, depth, wb.current.pdf[k],
+                                             wb.current.sampler[k], world, ws)
+                             : mat.emitted(rec);
+        wb.results[wb.current.slot[k]] += wb.current.throughput(k) * light;
+        Ray scattered;
+        Color attenuation;
+        RT_STAT(Stats::local().count_scatter(mat.type_name()));
+        bool reflected = mat.scatter(r, rec, attenuation, scattered, wb.current.sampler[k]);
+
+        // Same arithmetic as trace_path: absorbed paths end black, paths at max_depth end with
+        // their throughput if there is a sky.
+        Color throughput =
+            wb.current.throughput(k) * (reflected ? attenuation : Color(0, 0, 0));
+        if (!reflected || depth + 1 >= max_depth) {
+            if (!reflected || sky)
+                wb.results[wb.current.slot[k]] += throughput;
+            RT_STAT(if (reflected) Stats::local().max_depth_terminations++);
+        } else if (!continue_path(throughput, depth + 1, wb.current.sampler[k], ws)) {
+            wb.results[wb.current.slot[k]] += throughput;
+        } else {
+            Real pdf = lights ? mat.scatter_pdf(rec, scattered.direction()) : 0;
+            wb.next.push(scattered, throughput, pdf, wb.current.slot[k], wb.current.sampler[k]);
+        }
+    }
+
+    /**
+     * @brief Decides whether a path with the given throughput is extended to `depth`. Applies
+     * min_throughput and Russian roulette: ended paths get a zero throughput, survivors of the
+     * roulette are divided by their survival probability.
+     */
+    bool continue_path(Color &throughput, int depth, Sampler &sampler, WorkerStats &ws) const {
+        Real strongest = std::max({throughput.x(), throughput.y(), throughput.z()});
+        bool alive = strongest >= min_throughput;
+        if (alive && russian_roulette && depth >= roulette_min_depth) {
+            Real survival = std::min(strongest, Real(0.95));
+            alive = sampler.next_1d() < survival;
+            if (alive)
+                throughput = throughput / survival;
+        }
+        if (!alive) {
+            throughput = Color(0, 0, 0);
+            ws.roulette_terminations++;
+        }
+        return alive;
+    }
+
+    /**
+     * @brief Follows the path of a camera ray, starting from the result of its first bounce.
+     * @param aov If set, the AOVs of the sample are recorded along the path.
+     * @return Color Color carried by the path.
+     */
+    template <typename World>
+    Color trace_path(CameraRayScatter next, const World &world, Sampler &sampler,
+                     WorkerStats &ws, AOVPath *aov = nullptr) const {
+        Color radiance = next.light; // Light gathered along the path so far
+        auto r_color = next.color;   // Track color for the current ray
+        for (int d = 1; d < max_depth; d++) {
+
+            if (!next.reflected) {
+                break;
+            }
+            if (!continue_path(r_color, d, sampler, ws)) {
+                return radiance + r_color;
+            }
+
+            RT_STAT(Stats::local().count_ray(d));
+            next = scatter_ray(next.ray, world, sampler, ws, d, next.pdf, aov);
+            radiance += r_color * next.light;
+            r_color = r_color * next.color; // Accumulate color
+            ws.secondary_rays++;
+        }
+        RT_STAT(if (next.reflected) Stats::local().max_depth_terminations++);
+        // A path cut off at max_depth still ends with its throughput, as if it saw a white sky.
+        if (next.reflected && !sky)
+            return radiance;
+        return radiance + r_color;
+    }
+
+#ifdef RT_ENABLE_STATS
+    static void count_packet(const RayPacket &packet, const PacketHits &hits) {
+        auto &counters = Stats::local();
+        for (int lane = 0; lane < packet.count; lane++) {
+            counters.count_ray(0);
+            counters.world_queries++;
+            counters.world_hits += hits.hit[lane];
+        }
+    }
+#endif
 
     void initialize() {
-        image_height = int(image_width / aspect_ratio);
-        image_height = (image_height < 1) ? 1 : image_height;
+        image_height = get_image_height();
 
         pixel_samples_scale = 1.0 / samples_per_pixel;
 
-        center = Point3(0, 0, 0);
+        if (sampler_type == SamplerType::BlueNoise)
+            BlueNoiseTile::get(); // Built on first use, better here than in a worker
+
+        center = lookfrom;
 
         // Determine viewport dimensions.
-        auto focal_length = 1.0;
-        auto viewport_height = 2.0;
+        auto focal_length = (lookfrom - lookat).length();
+        auto theta = degrees_to_radians(vfov);
+        auto h = std::tan(theta / 2);
+        auto viewport_height = 2 * h * focal_length;
         auto viewport_width = viewport_height * (double(image_width) / image_height);
 
+        // Calculate the u,v,w unit basis vectors for the camera coordinate frame.
+        Vec3 w = unit_vector(lookfrom - lookat);
+        Vec3 u = unit_vector(cross(vup, w));
+        Vec3 v = cross(w, u);
+
         // Calculate the vectors across the horizontal and down the vertical viewport edges.
-        auto viewport_u = Vec3(viewport_width, 0, 0);
-        auto viewport_v = Vec3(0, -viewport_height, 0);
+        auto viewport_u = viewport_width * u;
+        auto viewport_v = viewport_height * -v;
 
         // Calculate the horizontal and vertical delta vectors from pixel to pixel.
         pixel_delta_u = viewport_u / image_width;
@@ -194,18 +888,15 @@ class Camera {
 
         // Calculate the location of the upper left pixel.
         auto viewport_upper_left =
-            center - Vec3(0, 0, focal_length) - viewport_u / 2 - viewport_v / 2;
+            center - (focal_length * w) - viewport_u / 2 - viewport_v / 2;
         pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
     }
 
-    Ray get_ray(int i, int j, int sample_index) const {
-        // Construct a camera ray originating from the origin and directed at randomly sampled
-        // point around the pixel location i, j.
+    Ray get_ray(int i, int j, Sampler &sampler) const {
+        // Construct a camera ray originating from the origin and directed at a point around the
+        // pixel location i, j, jittered by the first dimension of the sample pattern.
 
-        auto offset = sample_square();
-        if (sample_index == 0) {
-            offset = Vec3(0, 0, 0);
-        }
+        auto offset = sample_square(sampler);
 
         auto pixel_sample = pixel00_loc + ((i + offset.x()) * pixel_delta_u) +
                             ((j + offset.y()) * pixel_delta_v);
@@ -216,9 +907,15 @@ class Camera {
         return Ray(ray_origin, ray_direction);
     }
 
-    Vec3 sample_square() const {
-        // Returns the vector to a random point in the [-.5,-.5]-[+.5,+.5] unit square.
-        return Vec3(random_double() - 0.5, random_double() - 0.5, 0);
+    Vec3 sample_square(Sampler &sampler) const {
+        // Returns the vector to a sampled point in the [-.5,-.5]-[+.5,+.5] unit square.
+        auto [u, v] = sampler.next_2d();
+        return Vec3(u - Real(0.5), v - Real(0.5), 0);
+    }
+
+    Sampler make_sampler(int i, int j, int sample) const {
+        return Sampler(sampler_type, seed, i, j, uint64_t(j) * image_width + i,
+                       uint32_t(sample), uint32_t(samples_per_pixel));
     }
 
     /**
@@ -226,32 +923,167 @@ class Camera {
      * 
      * @param r 
      * @param world 
+     * @param sampler Sample source of the current camera sample.
+     * @param depth Bounces before `r`, 0 for camera rays.
+     * @param ray_pdf Density with which the previous bounce picked `r`, see surface_light.
+     * @param aov If set and still open, the hit is recorded in the sample's AOVs.
      * @return CameraRayScatter Struct containing color of the ray and reflected ray.
      */
-    CameraRayScatter scatter_ray(const Ray &r, const Hittable &world) const {
+    template <typename World>
+    CameraRayScatter scatter_ray(const Ray &r, const World &world, Sampler &sampler,
+                                 WorkerStats &ws, int depth, Real ray_pdf,
+                                 AOVPath *aov = nullptr) const {
         HitRecord rec;
+        bool hit = world.hit(r, Interval(0.0001, infinity), rec);
+        RT_STAT(Stats::local().world_queries++);
+        RT_STAT(Stats::local().world_hits += hit);
+        if (aov && aov->open)
+            record_aov(*aov, r, hit, rec);
+        return shade(r, hit, rec, sampler, world, ws, depth, ray_pdf);
+    }
 
-        if (world.hit(r, Interval(0.0001, infinity), rec)) {
+    // Records the hit of a path's ray in the AOVs of its sample, see AOVPath.
+    void record_aov(AOVPath &aov, const Ray &r, bool hit, const HitRecord &rec) const {
+        AOVSample &s = aov.sample;
+        if (!hit) {
+            s = AOVSample{s.albedo * miss_color(r), Vec3(0, 0, 0), 0};
+            aov.open = false;
+            return;
+        }
+        s.albedo = s.albedo * rec.mat->surface_albedo();
+        s.normal = rec.normal;
+        s.depth += rec.t * r.direction().length();
+        aov.open = rec.mat->is_specular();
+    }
+
+    Color sky_color(const Ray &r) const {
+        Vec3 unit_direction = unit_vector(r.direction());
+        Real a = Real(0.5) * (unit_direction.y() + 1);
+        return (1 - a) * Color(1.0, 1.0, 1.0) + a * Color(0.5, 0.7, 1.0);
+    }
 
-            // Old code -> Randomly Scatter Rays
-            // Vec3 direction = rec.normal + random_unit_vector();
-            // return 0.5 * ray_color(Ray(rec.p, direction), world, current_depth + 1);
+    Color miss_color(const Ray &r) const { return sky ? sky_color(r) : Color(0, 0, 0); }
 
-            // New code -> Scatter Rays based on Material
-            Ray scattered;
-            Color attenuation;
-            if (rec.mat->scatter(r, rec, attenuation, scattered)) {
-                return CameraRayScatter(attenuation, true, scattered);
+    /**
+     * @brief Light the surface at `rec` sends back along `r`: its own emission, and with lights
+     * the direct light from a shadow ray towards a sampled point on one of them.
+     *
+     * Light reaches a diffuse surface both ways, by a bounce that happens to hit a light and by
+     * the shadow ray, so each is weighted by the power heuristic of the two densities (Veach).
+     * `ray_pdf` is the density with which the previous bounce picked `r`, 0 for camera rays and
+     * specular bounces, whose light is only found by hitting it. There is no shadow ray at the
+     * last bounce (`depth` + 1 == max_depth): its scattered ray is not traced either, so the
+     * light it would bring is one bounce longer than any path the camera follows.
+     */
+    template <typename M, typename World>
+    Color surface_light(const M &mat, const Ray &r, const HitRecord &rec, int depth,
+                        Real ray_pdf, Sampler &sampler, const World &world,
+                        WorkerStats &ws) const {
+        Color light = mat.emitted(rec);
+        if (rec.light >= 0 && ray_pdf > 0 && lights) {
+            light = light * power_heuristic(ray_pdf, lights->pdf(rec.light, r, rec));
+        }
+        if (!lights || !mat.samples_direct_light() || depth + 1 >= max_depth)
+            return light;
+
+        Real u_light = sampler.next_1d();
+        auto [u, v] = sampler.next_2d();
+        LightSample ls;
+        if (!lights->sample(rec.p, u_light, u, v, ls) || ls.pdf <= 0)
+            return light;
+        Color f = mat.evaluate(rec, ls.direction);
+        if (std::max({f.x(), f.y(), f.z()}) <= 0)
+            return light;
+
+        ws.shadow_rays++;
+        RT_STAT(Stats::local().world_queries++);
+        Ray shadow(offset_ray_origin(rec.p, rec.normal, rec.p_error, ls.direction),
+                   ls.direction);
+        if (world.hit_any(shadow, Interval(0.0001, ls.distance * Real(0.999))))
+            return light;
+        Real weight = power_heuristic(ls.pdf, mat.scatter_pdf(rec, ls.direction));
+        return light + f * ls.radiance * (weight / ls.pdf);
+    }
+
+    /**
+     * @brief Scatters a ray whose intersection with the world has already been found.
+     */
+    template <typename World>
+    CameraRayScatter shade(const Ray &r, bool hit, const HitRecord &rec, Sampler &sampler,
+                           const World &world, WorkerStats &ws, int depth, Real ray_pdf) const {
+        if (hit) {
+            return with_material(world, rec, [&](const auto &mat) {
+                return shade_hit(mat, r, rec, sampler, world, ws, depth, ray_pdf);
+            });
+        }
+
+        return CameraRayScatter(miss_color(r), false, Ray(), Color(0, 0, 0));
+    }
+
+    // Shades a hit on `mat`, see shade.
+    template <typename M, typename World>
+    CameraRayScatter shade_hit(const M &mat, const Ray &r, const HitRecord &rec,
+                               Sampler &sampler, const World &world, WorkerStats &ws, int depth,
+                               Real ray_pdf) const {
+        Color light = lights ? surface_light(mat, r, rec, depth, ray_pdf, sampler, world, ws)
+                             : mat.emitted(rec);
+
+        // Old code -> Randomly Scatter Rays
+        // Vec3 direction = rec.normal + random_unit_vector(rng);
+        // return 0.5 * ray_color(Ray(rec.p, direction), world, current_depth + 1);
+
+        // New code -> Scatter Rays based on Material
+        Ray scattered;
+        Color attenuation;
+        RT_STAT(Stats::local().count_scatter(mat.type_name()));
+        if (mat.scatter(r, rec, attenuation, scattered, sampler)) {
+            Real pdf = lights ? mat.scatter_pdf(rec, scattered.direction()) : 0;
+            return CameraRayScatter(attenuation, true, scattered, light, pdf);
+        }
+
+        // If the ray is not scattered, return black. (Fully absorbed)
+        return CameraRayScatter(Color(0, 0, 0), false, Ray(), light);
+    }
+
+    /**
+     * @brief Calls `f` with the world as the type the render loops are compiled for. FlatScene
+     * is final and holds a closed set of primitive and material types, so with static_dispatch
+     * the loops compiled for it call its hit functions directly and dispatch materials with
+     * visit_material. Any other world, such as a HittableList of user-defined objects, is
+     * passed as a Hittable and every call stays virtual.
+     */
+    template <typename F> void dispatch_world(const Hittable &world, F &&f) const {
+        if (static_dispatch) {
+            if (auto flat = dynamic_cast<const FlatScene *>(&world)) {
+                f(*flat);
+                return;
             }
+        }
+        f(world);
+    }
 
-            // If the ray is not scattered, return black. (Fully absorbed)
-            return CameraRayScatter(Color(0, 0, 0), false);
+    // Calls `f` with the material of hit `rec` as its concrete type in the loops compiled for a
+    // FlatScene, or as a Material in those for a Hittable. A FlatScene hit is dispatched on its
+    // material ID, without loading the material. Instances can keep materials outside the
+    // scene's table (ID -1), those are dispatched on their kind.
+    template <typename World, typename F>
+    static decltype(auto) with_material(const World &world, const HitRecord &rec, F &&f) {
+        if constexpr (std::is_same_v<World, Hittable>) {
+            return f(*rec.mat);
+        } else {
+            if (rec.mat_id >= 0)
+                return world.visit_material(rec.mat_id, f);
+            return visit_material(*rec.mat, f);
         }
+    }
 
-        Vec3 unit_direction = unit_vector(r.direction());
-        auto a = 0.5 * (unit_direction.y() + 1.0);
-        
-        auto skyColor = (1.0 - a) * Color(1.0, 1.0, 1.0) + a * Color(0.5, 0.7, 1.0);
-        return CameraRayScatter(skyColor, false);
+    // The material of hit `rec`, which its bin says is an `M`.
+    template <typename M, typename World>
+    static const M &material_as(const World &world, const HitRecord &rec) {
+        if constexpr (!std::is_same_v<World, Hittable>) {
+            if (rec.mat_id >= 0)
+                return *std::get_if<M>(&world.materials[rec.mat_id]);
+        }
+        return static_cast<const M &>(*rec.mat);
     }
 };
\ No newline at end of file
@@ -0,0 +1,275 @@
+#pragma once
+
+#include "math.hpp"
+#include "scheduler.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+#if !defined(RT_NO_SIMD) && __has_include(<experimental/simd>)
+#include <experimental/simd>
+#define RT_DENOISE_SIMD 1
+#else
+#define RT_DENOISE_SIMD 0
+#endif
+
+/**
+ * @brief AOVs of one camera sample: the albedo, shading normal and distance along the path of
+ * the first surface it hits (see AOVPath). A miss has the sky color as albedo and a zero normal
+ * and depth.
+ */
+struct AOVSample {
+    Color albedo;
+    Vec3 normal;
+    Real depth = 0;
+};
+
+/**
+ * @brief AOVs of a camera sample while its path is traced. Specular hits are looked through:
+ * they tint the albedo and the AOVs are taken from the surface they reflect, so `open` stays
+ * set until a non-specular hit or a miss. A path that ends first keeps its last specular hit.
+ */
+struct AOVPath {
+    AOVSample sample{Color(1, 1, 1), Vec3(0, 0, 0), 0};
+    bool open = true;
+};
+
+/**
+ * @brief Per-pixel AOVs, row by row. While a render runs they hold sums over the samples of
+ * each pixel, afterwards the means.
+ */
+struct AOVBuffers {
+    std::vector<Color> albedo;
+    std::vector<Vec3> normal;
+    std::vector<Real> depth;
+
+    void assign(size_t pixel_count) {
+        albedo.assign(pixel_count, Color(0, 0, 0));
+        normal.assign(pixel_count, Vec3(0, 0, 0));
+        depth.assign(pixel_count, 0);
+    }
+
+    void add(size_t p, const AOVSample &s) {
+        albedo[p] += s.albedo;
+        normal[p] += s.normal;
+        depth[p] += s.depth;
+    }
+
+    void scale(size_t p, Real s) {
+        albedo[p] *= s;
+        normal[p] *= s;
+        depth[p] *= s;
+    }
+};
+
+/**
+ * @brief Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010), guided by AOVs.
+ *
+ * The color is divided by the albedo first, so textures and material edges are put back
+ * unblurred afterwards and only the lighting is filtered. Each pass is a 5x5 B3-spline kernel
+ * whose taps are spread 2^pass pixels apart, so four passes cover a 61 pixel wide footprint for
+ * the cost of 100 taps. A tap's weight falls off with its difference to the center pixel in
+ * color, normal and relative depth, which keeps geometric edges sharp.
+ *
+ * Works in single precision on padded planes of floats, one per channel, so the inner loop
+ * reads contiguous memory. Rows are split over the thread pool and the pixels of a row are
+ * filtered several at a time with std::experimental::simd where available (RT_NO_SIMD disables
+ * it).
+ */
+class Denoiser {
+    public:
+    int iterations = 4;        // Filter passes
+    float sigma_color = 0.6f;  // Color difference at which a tap's weight drops to about 1/e
+    float sigma_normal = 0.5f; // Same for the length of the normal difference
+    float sigma_depth = 0.02f; // Same for the depth difference, relative to the depth
+
+    /**
+     * @brief Filters `image` in place. `aovs` holds the per-pixel means of the same render.
+     */
+    void run(std::vector<Color> &image, const AOVBuffers &aovs, int width, int height,
+             ThreadPool &pool) {
+        prepare(image, aovs, width, height, pool);
+
+        // Bands of rows, a few per worker so uneven bands balance out.
+        int band = std::max(1, height / (4 * pool.size()));
+        int bands = (height + band - 1) / band;
+        int src = 0;
+        for (int pass = 0; pass < iterations; pass++) {
+            int step = 1 << pass;
+            // The color threshold tightens each pass, as the noise left is lower.
+            float color_scale = float(1 << pass) / (sigma_color * sigma_color);
+            pool.run(bands, [&](int b, int) {
+                for (int y = b * band; y < std::min(height, (b + 1) * band); y++) {
+                    filter_row(y, step, color_scale, src);
+                }
+            });
+            src = 1 - src;
+        }
+
+        // Put the albedo back.
+        pool.run(bands, [&](int b, int) {
+            for (int y = b * band; y < std::min(height, (b + 1) * band); y++) {
+                for (int x = 0; x < width; x++) {
+                    size_t p = size_t(y) * width + x;
+                    size_t q = index(x, y);
+                    const Color &a = aovs.albedo[p];
+                    for (int c = 0; c < 3; c++) {
+                        float v = plane(color_plane(src, c))[q];
+                        image[p].e[c] = a[c] > albedo_epsilon ? Real(v * float(a[c])) : Real(v);
+                    }
+                }
+            }
+        });
+    }
+
+    private:
+    static constexpr float albedo_epsilon = 1e-3f;
+
+    // Planes: two sets of color channels to ping-pong between, then the guides.
+    static constexpr int normal_plane = 6;
+    static constexpr int depth_plane = 9;
+    static constexpr int mask_plane = 10; // 1 inside the image, 0 in the padding
+    static constexpr int plane_count = 11;
+
+    int width = 0, height = 0;
+    int pad = 0;    // Padding on every side, wide enough for the farthest tap
+    int stride = 0; // Padded row length
+    size_t plane_size = 0;
+    std::vector<float> planes;
+
+    static int color_plane(int set, int c) { return 3 * set + c; }
+    float *plane(int k) { return planes.data() + k * plane_size; }
+    size_t index(int x, int y) const { return size_t(y + pad) * stride + x + pad; }
+
+    void prepare(const std::vector<Color> &image, const AOVBuffers &aovs, int w, int h,
+                 ThreadPool &pool) {
+        int wanted_pad = 2 << std::max(0, iterations - 1);
+        if (w != width || h != height || wanted_pad != pad) {
+            width = w;
+            height = h;
+            pad = wanted_pad;
+            stride = width + 2 * pad;
+            plane_size = size_t(stride) * (height + 2 * pad);
+            // The padding is all zeros with a zero mask and is never written, so the taps that
+            // fall outside the image get no weight.
+            planes.assign(plane_size * plane_count, 0.0f);
+        }
+
+        int band = std::max(1, height / (4 * pool.size()));
+        pool.run((height + band - 1) / band, [&](int b, int) {
+            for (int y = b * band; y < std::min(height, (b + 1) * band); y++) {
+                for (int x = 0; x < width; x++) {
+                    size_t p = size_t(y) * width + x;
+                    size_t q = index(x, y);
+                    const Color &a = aovs.albedo[p];
+                    for (int c = 0; c < 3; c++) {
+                        float v = float(image[p][c]);
+                        plane(color_plane(0, c))[q] =
+                            a[c] > albedo_epsilon ? v / float(a[c]) : v;
+                        plane(normal_plane + c)[q] = float(aovs.normal[p][c]);
+                    }
+                    plane(depth_plane)[q] = float(aovs.depth[p]);
+                    plane(mask_plane)[q] = 1;
+                }
+            }
+        });
+    }
+
+    void filter_row(int y, int step, float color_scale, int src) {
+        int x = 0;
+#if RT_DENOISE_SIMD
+        using Lanes = std::experimental::native_simd<float>;
+        for (; x + (int)Lanes::size() <= width; x += (int)Lanes::size()) {
+            filter_pixels<Lanes>(x, y, step, color_scale, src);
+        }
+#endif
+        for (; x < width; x++) {
+            filter_pixels<float>(x, y, step, color_scale, src);
+        }
+    }
+
+    template <typename V> static V load(const float *p) {
+        if constexpr (std::is_same_v<V, float>)
+            return *p;
+#if RT_DENOISE_SIMD
+        else
+            return V(p, std::experimental::element_aligned);
+#endif
+    }
+
+    template <typename V> static void store(const V &v, float *p) {
+        if constexpr (std::is_same_v<V, float>)
+            *p = v;
+#if RT_DENOISE_SIMD
+        else
+            v.copy_to(p, std::experimental::element_aligned);
+#endif
+    }
+
+    // exp(-x) for x >= 0, approximated by (1 - x / 8)^8 and clamped to 0 past x = 8 where
+    // exp(-x) is negligible. Multiplies only, so it vectorizes and needs no division per tap.
+    template <typename V> static V exp_neg(V x) {
+        V y = 1.0f - x * 0.125f;
+        if constexpr (std::is_same_v<V, float>)
+            y = std::max(y, 0.0f);
+#if RT_DENOISE_SIMD
+        else
+            y = std::experimental::max(y, V(0.0f));
+#endif
+        y = y * y;
+        y = y * y;
+        return y * y;
+    }
+
+    // Filters the pixels starting at (x, y), as many as V has lanes, from color set `src` into
+    // the other set.
+    template <typename V>
+    void filter_pixels(int x, int y, int step, float color_scale, int src) {
+        static constexpr float kernel[3] = {3.0f / 8, 1.0f / 4, 1.0f / 16};
+        const float normal_scale = 1 / (sigma_normal * sigma_normal);
+        const float depth_scale = 1 / (sigma_depth * sigma_depth);
+
+        size_t p = index(x, y);
+        const float *cr = plane(color_plane(src, 0));
+        const float *cg = plane(color_plane(src, 1));
+        const float *cb = plane(color_plane(src, 2));
+        const float *nx = plane(normal_plane);
+        const float *ny = plane(normal_plane + 1);
+        const float *nz = plane(normal_plane + 2);
+        const float *depth = plane(depth_plane);
+        const float *mask = plane(mask_plane);
+
+        V pr = load<V>(cr + p), pg = load<V>(cg + p), pb = load<V>(cb + p);
+        V pnx = load<V>(nx + p), pny = load<V>(ny + p), pnz = load<V>(nz + p);
+        V pz = load<V>(depth + p);
+        V inv_pz2 = depth_scale / (pz * pz + 1e-6f);
+
+        V sum_w = 0.0f, sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f;
+        for (int dy = -2; dy <= 2; dy++) {
+            for (int dx = -2; dx <= 2; dx++) {
+                size_t q = p + ptrdiff_t(dy * step) * stride + dx * step;
+                V qr = load<V>(cr + q), qg = load<V>(cg + q), qb = load<V>(cb + q);
+                V er = qr - pr, eg = qg - pg, eb = qb - pb;
+                V ex = load<V>(nx + q) - pnx, ey = load<V>(ny + q) - pny,
+                  ez = load<V>(nz + q) - pnz;
+                V ed = load<V>(depth + q) - pz;
+
+                V distance = (er * er + eg * eg + eb * eb) * color_scale +
+                             (ex * ex + ey * ey + ez * ez) * normal_scale + ed * ed * inv_pz2;
+                V w = exp_neg(distance) * load<V>(mask + q) *
+                      (kernel[dx < 0 ? -dx : dx] * kernel[dy < 0 ? -dy : dy]);
+                sum_w += w;
+                sum_r += w * qr;
+                sum_g += w * qg;
+                sum_b += w * qb;
+            }
+        }
+
+        // The center tap always has full weight, so sum_w > 0.
+        int dst = 1 - src;
+        store(sum_r / sum_w, plane(color_plane(dst, 0)) + p);
+        store(sum_g / sum_w, plane(color_plane(dst, 1)) + p);
+        store(sum_b / sum_w, plane(color_plane(dst, 2)) + p);
+    }
+};
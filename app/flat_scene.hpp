@@ -0,0 +1,482 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "hittable.hpp"
+#include "instance.hpp"
+#include "light.hpp"
+#include "material.hpp"
+#include "math.hpp"
+#include "mesh.hpp"
+#include "objects.hpp"
+#include "packet.hpp"
+#include "ray.hpp"
+#include "transform.hpp"
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+// Closed set of materials a FlatScene can store by value.
+using MaterialVariant = std::variant<Lambertian, Metal, DiffuseLight>;
+
+struct FlatSphere {
+    Point3 center;
+    Real radius;
+    int mat_id;
+};
+
+// A triangle mesh is a single primitive of the scene BVH, with the mesh's own BVH below it.
+struct FlatMesh {
+    shared_ptr<const TriangleMesh> mesh;
+    int mat_id;
+    std::string source; // OBJ file it was loaded from, if any
+};
+
+// Entry of the instance table. The scene BVH over the instances is the top level (TLAS), the
+// shared objects with their own BVHs are the bottom level (BLAS).
+struct FlatInstance {
+    Transform to_object;
+    Real error_scale; // See Instance
+    int object;       // Index into FlatScene::instance_objects
+    int mat_id;       // Material of the whole instance, -1 to keep the object's own materials
+};
+
+enum class PrimitiveType : uint8_t {
+    Sphere,
+    Mesh,
+    Instance,
+};
+
+// Tag and index of a primitive in the array of its type.
+struct PrimitiveRef {
+    PrimitiveType type;
+    int index;
+};
+
+/**
+ * @brief Data-oriented scene: one contiguous array per primitive type, materials stored by
+ * value and referenced by index, and a BVH over tagged primitive references.
+ *
+ * There is no shared_ptr or virtual call between the BVH and the primitives, and hit records
+ * carry a material ID, so nothing is reference counted in the hot loop. Build it from a
+ * HittableList with FlatSceneBuilder. Instanced meshes are hit directly too; only other
+ * instanced Hittables, such as user-defined objects, are called through their virtual hit. The
+ * class is final, so the camera's render loops compiled for it inline its hit functions (see
+ * Camera::static_dispatch).
+ *
+ * Spheres and meshes with a DiffuseLight material are collected into a LightList by build(),
+ * and hits on them carry its light index. Instances are never lights.
+ */
+class FlatScene final : public Hittable {
+    public:
+    std::vector<FlatSphere> spheres;
+    std::vector<FlatMesh> meshes;
+    std::vector<FlatInstance> instances;
+    // Geometry shared by the instances
+    std::vector<shared_ptr<const Hittable>> instance_objects;
+    std::vector<MaterialVariant> materials;
+    std::vector<PrimitiveRef> primitives; // Ordered to match the BVH leaves.
+
+    /**
+     * @brief (Re)builds the acceleration structure and the light list. Call after filling the
+     * primitive arrays.
+     */
+    void build() {
+        build_lights();
+        instance_meshes.clear();
+        for (const auto &object : instance_objects) {
+            instance_meshes.push_back(dynamic_cast<const TriangleMesh *>(object.get()));
+        }
+
+        primitives.clear();
+        for (int i = 0; i < (int)spheres.size(); i++) {
+            primitives.push_back(PrimitiveRef{PrimitiveType::Sphere, i});
+        }
+        for (int i = 0; i < (int)meshes.size(); i++) {
+            primitives.push_back(PrimitiveRef{PrimitiveType::Mesh, i});
+        }
+        for (int i = 0; i < (int)instances.size(); i++) {
+            primitives.push_back(PrimitiveRef{PrimitiveType::Instance, i});
+        }
+
+        std::vector<AABB> bounds;
+        bounds.reserve(primitives.size());
+        for (const auto &prim : primitives) {
+            bounds.push_back(primitive_bounds(prim));
+        }
+        bvh.build(bounds);
+
+        // Reorder so each BVH leaf is a contiguous range of `primitives`.
+        std::vector<PrimitiveRef> ordered;
+        ordered.reserve(primitives.size());
+        for (int i : bvh.indices) {
+            ordered.push_back(primitives[i]);
+        }
+        primitives = std::move(ordered);
+        for (int i = 0; i < (int)bvh.indices.size(); i++) {
+            bvh.indices[i] = i;
+        }
+
+        bbox = bvh.nodes.empty() ? AABB() : bvh.nodes[0].bbox;
+    }
+
+    /**
+     * @brief Updates the BVH and the lights after spheres or instances moved, without
+     * rebuilding the tree (see BVHTree::refit). The primitives must be the ones of the last
+     * build().
+     */
+    void refit() {
+        build_lights();
+        refit_bounds.resize(primitives.size());
+        for (size_t i = 0; i < primitives.size(); i++) {
+            refit_bounds[i] = primitive_bounds(primitives[i]);
+        }
+        bvh.refit(refit_bounds);
+        bbox = bvh.nodes.empty() ? AABB() : bvh.nodes[0].bbox;
+    }
+
+    bool hit(const Ray &r, Interval ray_t, HitRecord &rec) const override {
+        return bvh.traverse(r, ray_t, rec,
+                            [this](int prim, const Ray &r, Interval t, HitRecord &rec) {
+                                return hit_primitive(primitives[prim], r, t, rec);
+                            });
+    }
+
+    bool hit_any(const Ray &r, Interval ray_t) const override {
+        return bvh.traverse_any(r, ray_t, [this](int prim, const Ray &r, Interval t) {
+            return hit_any_primitive(primitives[prim], r, t);
+        });
+    }
+
+#if RT_PACKET_SIMD
+    /**
+     * @brief Walks the BVH once for the whole packet (see BVHTree::traverse_packet) and tests
+     * every ray of the packet against a node's box and a leaf's spheres at once with the SIMD
+     * kernels of PacketLanes. Meshes and instances are hit one ray at a time. The roots are the
+     * ones hit() finds, so the image is bit-identical to tracing the rays one by one.
+     */
+    void hit_packet(const RayPacket &packet, Interval ray_t, PacketHits &out) const override {
+        const PacketLanes lanes(packet);
+        const PacketMask active = PacketLanes::active_mask(packet.count);
+        PacketReals closest = ray_t.max;
+        // Sphere each lane hit last, its record is filled in at the end. -1 once something else
+        // is closer.
+        std::array<int, packet_size> closest_sphere;
+        closest_sphere.fill(-1);
+        for (int lane = 0; lane < packet.count; lane++) {
+            out.hit[lane] = false;
+        }
+
+        auto hit_box = [&](const AABB &box) {
+            return lanes.hit_box(box, ray_t.min, active, closest);
+        };
+        auto hit_leaf = [&](int first, int count, unsigned mask) {
+            RT_STAT(Stats::local().primitive_tests += int64_t(count) * std::popcount(mask));
+            for (int i = first; i < first + count; i++) {
+                PrimitiveRef prim = primitives[bvh.indices[i]];
+                if (prim.type == PrimitiveType::Sphere) {
+                    const FlatSphere &s = spheres[prim.index];
+                    auto ok = lanes.hit_sphere(s.center, s.radius, ray_t.min,
+                                               PacketLanes::mask_of(mask), closest);
+                    for (int lane = 0; lane < packet.count; lane++) {
+                        if (ok[lane]) {
+                            out.hit[lane] = true;
+                            closest_sphere[lane] = prim.index;
+                        }
+                    }
+                    continue;
+                }
+
+                for (int lane = 0; lane < packet.count; lane++) {
+                    if (!((mask >> lane) & 1))
+                        continue;
+                    if (hit_primitive(prim, packet.rays[lane],
+                                      Interval(ray_t.min, closest[lane]), out.recs[lane])) {
+                        out.hit[lane] = true;
+                        closest[lane] = out.recs[lane].t;
+                        closest_sphere[lane] = -1;
+                    }
+                }
+            }
+        };
+        bvh.traverse_packet(packet.rays[0].direction(), hit_box, hit_leaf);
+
+        for (int lane = 0; lane < packet.count; lane++) {
+            if (closest_sphere[lane] >= 0)
+                set_sphere_record(closest_sphere[lane], packet.rays[lane], closest[lane],
+                                  out.recs[lane]);
+        }
+    }
+#endif
+
+    AABB bounding_box() const override { return bbox; }
+
+    const LightList *light_list() const override { return lights.empty() ? nullptr : &lights; }
+
+    const Material &material(int mat_id) const {
+        return std::visit([](const auto &m) -> const Material & { return m; },
+                          materials[mat_id]);
+    }
+
+    // Calls `f` with material `mat_id` as its concrete type, like the free visit_material.
+    // Tests the alternatives in turn rather than with std::visit, whose table of function
+    // pointers keeps `f` from being inlined.
+    template <typename F> decltype(auto) visit_material(int mat_id, F &&f) const {
+        const MaterialVariant &mat = materials[mat_id];
+        if (auto lambertian = std::get_if<Lambertian>(&mat))
+            return f(*lambertian);
+        if (auto metal = std::get_if<Metal>(&mat))
+            return f(*metal);
+        return f(*std::get_if<DiffuseLight>(&mat));
+    }
+
+    int bvh_node_count() const { return (int)bvh.nodes.size(); }
+
+    private:
+    BVHTree bvh;
+    AABB bbox;
+    std::vector<AABB> refit_bounds; // Scratch of refit(), kept to reuse its memory
+    // Each instance object as a TriangleMesh, or null if it is another kind of Hittable.
+    std::vector<const TriangleMesh *> instance_meshes;
+    LightList lights;
+    std::vector<int> sphere_lights; // Light index of each sphere, -1 if it is not a light
+    std::vector<int> mesh_lights;   // Same for the meshes
+
+    // Emitters with no power are left out (see LightList::add), so they are never sampled and
+    // their hits keep light -1.
+    void build_lights() {
+        lights.clear();
+        sphere_lights.assign(spheres.size(), -1);
+        mesh_lights.assign(meshes.size(), -1);
+        for (int i = 0; i < (int)spheres.size(); i++) {
+            if (auto light = std::get_if<DiffuseLight>(&materials[spheres[i].mat_id]))
+                sphere_lights[i] = lights.add_sphere(spheres[i].center, spheres[i].radius,
+                                                     light->emit);
+        }
+        for (int i = 0; i < (int)meshes.size(); i++) {
+            if (auto light = std::get_if<DiffuseLight>(&materials[meshes[i].mat_id]))
+                mesh_lights[i] = lights.add_mesh(*meshes[i].mesh, light->emit);
+        }
+    }
+
+    bool hit_primitive(PrimitiveRef prim, const Ray &r, Interval ray_t, HitRecord &rec) const {
+        switch (prim.type) {
+        case PrimitiveType::Sphere:
+            return hit_sphere(prim.index, r, ray_t, rec);
+        case PrimitiveType::Mesh:
+            return hit_mesh(prim.index, r, ray_t, rec);
+        case PrimitiveType::Instance:
+            return hit_instance(instances[prim.index], r, ray_t, rec);
+        }
+        return false;
+    }
+
+    bool hit_any_primitive(PrimitiveRef prim, const Ray &r, Interval ray_t) const {
+        switch (prim.type) {
+        case PrimitiveType::Sphere: {
+            const auto &s = spheres[prim.index];
+            Real root;
+            return Sphere::intersect(r, s.center, s.radius, ray_t, root);
+        }
+        case PrimitiveType::Mesh:
+            return meshes[prim.index].mesh->hit_any(r, ray_t);
+        case PrimitiveType::Instance: {
+            const auto &inst = instances[prim.index];
+            if (const TriangleMesh *mesh = instance_meshes[inst.object])
+                return Instance::hit_any_transformed(*mesh, inst.to_object, r, ray_t);
+            return Instance::hit_any_transformed(*instance_objects[inst.object], inst.to_object,
+                                                 r, ray_t);
+        }
+        }
+        return false;
+    }
+
+    AABB primitive_bounds(PrimitiveRef prim) const {
+        switch (prim.type) {
+        case PrimitiveType::Sphere: {
+            const auto &s = spheres[prim.index];
+            auto rvec = Vec3(s.radius, s.radius, s.radius);
+            return AABB(s.center - rvec, s.center + rvec);
+        }
+        case PrimitiveType::Mesh:
+            return meshes[prim.index].mesh->bounding_box();
+        case PrimitiveType::Instance: {
+            const auto &inst = instances[prim.index];
+            return inst.to_object.inverse().box(instance_objects[inst.object]->bounding_box());
+        }
+        }
+        return AABB();
+    }
+
+    bool hit_sphere(int index, const Ray &r, Interval ray_t, HitRecord &rec) const {
+        const FlatSphere &s = spheres[index];
+        Real root;
+        if (!Sphere::intersect(r, s.center, s.radius, ray_t, root))
+            return false;
+
+        set_sphere_record(index, r, root, rec);
+        return true;
+    }
+
+    void set_sphere_record(int index, const Ray &r, Real root, HitRecord &rec) const {
+        const FlatSphere &s = spheres[index];
+        Sphere::set_hit_record(r, root, s.center, s.radius, &material(s.mat_id), rec);
+        rec.mat_id = s.mat_id;
+        rec.light = sphere_lights[index];
+    }
+
+    bool hit_mesh(int index, const Ray &r, Interval ray_t, HitRecord &rec) const {
+        const FlatMesh &m = meshes[index];
+        if (!m.mesh->hit(r, ray_t, rec))
+            return false;
+        rec.mat = &material(m.mat_id);
+        rec.mat_id = m.mat_id;
+        rec.light = mesh_lights[index];
+        return true;
+    }
+
+    bool hit_instance(const FlatInstance &inst, const Ray &r, Interval ray_t,
+                      HitRecord &rec) const {
+        // Meshes, the common case, are hit without a virtual call.
+        const TriangleMesh *mesh = instance_meshes[inst.object];
+        bool hit = mesh ? Instance::hit_transformed(*mesh, inst.to_object, inst.error_scale, r,
+                                                    ray_t, rec)
+                        : Instance::hit_transformed(*instance_objects[inst.object],
+                                                    inst.to_object, inst.error_scale, r, ray_t,
+                                                    rec);
+        if (!hit)
+            return false;
+        rec.light = -1;
+        // Otherwise the object set its own material, which is not in the table. mat_id would
+        // still hold the ID of an earlier hit of this traversal.
+        rec.mat_id = inst.mat_id;
+        if (inst.mat_id >= 0)
+            rec.mat = &material(inst.mat_id);
+        return true;
+    }
+};
+
+/**
+ * @brief Converts a HittableList of Sphere, TriangleMesh and Instance objects with Lambertian,
+ * Metal or DiffuseLight materials into a FlatScene. Materials shared between objects are stored
+ * once. Throws on other types.
+ *
+ * Instances can also be added straight to the instance table with add_instance, which avoids a
+ * heap object per instance.
+ */
+class FlatSceneBuilder {
+    public:
+    FlatSceneBuilder &add(const HittableList &list) {
+        for (const auto &object : list.get_objects()) {
+            add(object);
+        }
+        return *this;
+    }
+
+    FlatSceneBuilder &add(const shared_ptr<Hittable> &object) {
+        if (auto list = dynamic_cast<const HittableList *>(object.get())) {
+            return add(*list);
+        }
+        if (auto instance = dynamic_cast<const Instance *>(object.get())) {
+            const Hittable &object = *instance->get_object();
+            scene.instances.push_back(FlatInstance{instance->get_to_object(),
+                                                   instance->get_error_scale(),
+                                                   object_id(instance->get_object()),
+                                                   single_material_id(object)});
+            return *this;
+        }
+        if (auto mesh = std::dynamic_pointer_cast<const TriangleMesh>(object)) {
+            scene.meshes.push_back(FlatMesh{mesh, material_id(mesh->get_material().get()), ""});
+            return *this;
+        }
+
+        auto sphere = dynamic_cast<const Sphere *>(object.get());
+        if (sphere == nullptr) {
+            throw std::runtime_error("FlatSceneBuilder: unsupported primitive type.");
+        }
+        scene.spheres.push_back(
+            FlatSphere{sphere->center, sphere->radius, material_id(sphere->mat.get())});
+        return *this;
+    }
+
+    /**
+     * @brief Adds an instance of `object` to the instance table. `mat`, if given, replaces the
+     * materials of the object for this instance.
+     */
+    FlatSceneBuilder &add_instance(const shared_ptr<const Hittable> &object,
+                                   const Transform &to_world,
+                                   const shared_ptr<const Material> &mat = nullptr) {
+        Transform to_object = to_world.inverse();
+        int mat_id = -1;
+        if (mat) {
+            // Keeps the material alive until build(), so its address stays a unique key.
+            if (material_ids.find(mat.get()) == material_ids.end())
+                instance_materials.push_back(mat);
+            mat_id = material_id(mat.get());
+        } else {
+            mat_id = single_material_id(*object);
+        }
+        scene.instances.push_back(
+            FlatInstance{to_object, to_world.max_stretch(), object_id(object), mat_id});
+        return *this;
+    }
+
+    FlatScene build() {
+        scene.build();
+        material_ids.clear();
+        object_ids.clear();
+        instance_materials.clear();
+        return std::move(scene);
+    }
+
+    private:
+    FlatScene scene;
+    std::unordered_map<const Material *, int> material_ids;
+    std::unordered_map<const Hittable *, int> object_ids;
+    std::vector<shared_ptr<const Material>> instance_materials;
+
+    int object_id(const shared_ptr<const Hittable> &object) {
+        auto [it, inserted] =
+            object_ids.emplace(object.get(), (int)scene.instance_objects.size());
+        if (inserted)
+            scene.instance_objects.push_back(object);
+        return it->second;
+    }
+
+    // Material ID of objects made of a single material, so instances of them get a material ID
+    // in their hit records. -1 for anything else.
+    int single_material_id(const Hittable &object) {
+        if (auto sphere = dynamic_cast<const Sphere *>(&object))
+            return material_id(sphere->mat.get());
+        auto mesh = dynamic_cast<const TriangleMesh *>(&object);
+        if (mesh && mesh->get_material())
+            return material_id(mesh->get_material().get());
+        return -1;
+    }
+
+    int material_id(const Material *mat) {
+        auto it = material_ids.find(mat);
+        if (it != material_ids.end())
+            return it->second;
+
+        if (auto lambertian = dynamic_cast<const Lambertian *>(mat)) {
+            scene.materials.emplace_back(std::in_place_type<Lambertian>, *lambertian);
+        } else if (auto metal = dynamic_cast<const Metal *>(mat)) {
+            scene.materials.emplace_back(std::in_place_type<Metal>, *metal);
+        } else if (auto light = dynamic_cast<const DiffuseLight *>(mat)) {
+            scene.materials.emplace_back(std::in_place_type<DiffuseLight>, *light);
+        } else {
+            throw std::runtime_error("FlatSceneBuilder: unsupported material type.");
+        }
+
+        int id = (int)scene.materials.size() - 1;
+        material_ids.emplace(mat, id);
+        return id;
+    }
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "math.hpp"
+#include "ray.hpp"
+#include <array>
+
+class Material;
+
+class HitRecord {
+    public:
+    Point3 p;
+    Vec3 normal;
+    Real t;
+    Real p_error = 0; // Bound on the absolute error of p, see offset_ray_origin.
+    bool front_face;
+    // Plain pointer, so recording a hit does not touch a shared reference count. The object
+    // that was hit keeps the material alive.
+    const Material *mat = nullptr;
+    int mat_id = -1; // Index into the material table of a FlatScene, -1 for other objects.
+    int light = -1;  // Index into the light list of a FlatScene for hits on a light, or -1.
+
+    /**
+     * @brief Set the face normal object using the given ray and outward  normal (the normal
+     * calculated).
+     */
+    void set_face_normal(const Ray &r, const Vec3 &outward_normal) {
+        // Sets the hit record normal vector.
+        // NOTE: the parameter `outward_normal` is assumed to have unit length.
+
+        front_face = dot(r.direction(), outward_normal) < 0;
+        normal = front_face ? outward_normal : -outward_normal;
+    }
+};
+
+// Number of coherent rays traced together in packet mode.
+constexpr int packet_size = 4;
+
+/**
+ * @brief A group of rays traced together. Only the first `count` lanes are active.
+ */
+struct RayPacket {
+    std::array<Ray, packet_size> rays;
+    int count = packet_size;
+};
+
+struct PacketHits {
+    std::array<HitRecord, packet_size> recs;
+    std::array<bool, packet_size> hit;
+};
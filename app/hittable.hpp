@@ -1,84 +1,249 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <memory>
-#include <mutex>
+#include <utility>
 #include <vector>
 
+#include "aabb.hpp"
+#include "arena.hpp"
+#include "bvh_tree.hpp"
+#include "hit_record.hpp"
 #include "interval.hpp"
 #include "math.hpp"
 #include "ray.hpp"
+#include "stats.hpp"
 
 using std::make_shared;
 using std::shared_ptr;
 
-class Material;
+class LightList;
 
-class HitRecord {
+class Hittable {
     public:
-    Point3 p;
-    Vec3 normal;
-    double t;
-    bool front_face;
-    shared_ptr<Material> mat;
+    virtual ~Hittable() {}
+    virtual bool hit(const Ray &r, Interval ray_t, HitRecord &rec) const = 0;
+    virtual AABB bounding_box() const = 0;
 
     /**
-     * @brief Set the face normal object using the given ray and outward  normal (the normal
-     * calculated).
+     * @brief Whether anything is hit in `ray_t`, for shadow rays. Stops at the first hit found
+     * instead of searching for the closest one, and fills in no record. The default calls
+     * hit().
      */
-    void set_face_normal(const Ray &r, const Vec3 &outward_normal) {
-        // Sets the hit record normal vector.
-        // NOTE: the parameter `outward_normal` is assumed to have unit length.
+    virtual bool hit_any(const Ray &r, Interval ray_t) const {
+        HitRecord rec;
+        return hit(r, ray_t, rec);
+    }
 
-        front_face = dot(r.direction(), outward_normal) < 0;
-        normal = front_face ? outward_normal : -outward_normal;
+    // Emitters of the scene for next-event estimation, or null if it has none.
+    virtual const LightList *light_list() const { return nullptr; }
+
+    /**
+     * @brief Finds the closest hit for every active ray of the packet. The default traces the
+     * rays one by one; objects with a vectorized intersection override this.
+     */
+    virtual void hit_packet(const RayPacket &packet, Interval ray_t, PacketHits &out) const {
+        for (int lane = 0; lane < packet.count; lane++) {
+            out.hit[lane] = hit(packet.rays[lane], ray_t, out.recs[lane]);
+        }
     }
 };
 
-class Hittable {
+/**
+ * @brief Immutable scene published by HittableList::commit.
+ *
+ * Nothing changes it after it is made, so any number of render threads read it without locks or
+ * checks while the list it came from is edited for the next frame. The objects are shared with
+ * the list: edit a scene by adding, removing or replacing objects, not by changing an object
+ * that a snapshot may be rendering. The objects sit under a BVH built by the constructor, on
+ * the thread that commits, and hit() walks it over plain pointers without touching reference
+ * counts.
+ */
+class SceneSnapshot : public Hittable, public std::enable_shared_from_this<SceneSnapshot> {
     public:
-    virtual ~Hittable() {}
-    virtual bool hit(const Ray &r, Interval ray_t, HitRecord &rec) const = 0;
+    SceneSnapshot(std::vector<shared_ptr<Hittable>> objects, const AABB &bbox, uint64_t version)
+        : owners(std::move(objects)), bbox(bbox), version(version) {
+        std::vector<AABB> bounds;
+        bounds.reserve(owners.size());
+        for (const auto &object : owners) {
+            bounds.push_back(object->bounding_box());
+        }
+        tree.build(bounds);
+
+        // Leaf order, so leaves index the pointers directly. `owners` keeps the list's order.
+        this->objects.reserve(owners.size());
+        for (int i : tree.indices) {
+            this->objects.push_back(owners[i].get());
+        }
+        for (int i = 0; i < (int)tree.indices.size(); i++) {
+            tree.indices[i] = i;
+        }
+    }
+
+    bool hit(const Ray &r, Interval ray_t, HitRecord &rec) const override {
+        return tree.traverse(r, ray_t, rec,
+                             [this](int prim, const Ray &r, Interval t, HitRecord &rec) {
+                                 return objects[prim]->hit(r, t, rec);
+                             });
+    }
+
+    bool hit_any(const Ray &r, Interval ray_t) const override {
+        return tree.traverse_any(r, ray_t, [this](int prim, const Ray &r, Interval t) {
+            return objects[prim]->hit_any(r, t);
+        });
+    }
+
+    AABB bounding_box() const override { return bbox; }
+
+    // The objects in the order they were added to the list.
+    const std::vector<shared_ptr<Hittable>> &get_objects() const { return owners; }
+
+    // Number of the commit that made this snapshot, counting from 1.
+    uint64_t get_version() const { return version; }
+
+    private:
+    std::vector<shared_ptr<Hittable>> owners; // Keeps the objects alive
+    std::vector<const Hittable *> objects;    // In BVH leaf order
+    BVHTree tree;
+    AABB bbox;
+    uint64_t version;
 };
 
+/**
+ * @brief List of objects, and the builder of scene snapshots.
+ *
+ * The list can be rendered directly as long as nothing edits it during the render. To keep
+ * editing while frames render, commit() the list and render its snapshot(): the render works on
+ * an immutable copy and the next edits go to the list.
+ */
 class HittableList : public Hittable {
     private:
-    std::mutex m;
-    bool is_locked = false;
     std::vector<shared_ptr<Hittable>> objects;
+    AABB bbox;
+    shared_ptr<Arena> arena;
+
+    // Snapshot publication, RCU style: readers load the raw pointer and take a reference to it.
+    // A snapshot replaced by a commit waits in `retired` until no reader can still be between
+    // those two steps with its pointer, then the list drops its reference and the last render
+    // holding one frees it. Readers register in the counter of the current epoch, and commit()
+    // advances the epoch when the readers of the one before it are gone (see reclaim).
+    struct Retired {
+        shared_ptr<const SceneSnapshot> snapshot;
+        uint64_t epoch; // Epoch when it was replaced
+    };
+    std::atomic<const SceneSnapshot *> published{nullptr};
+    mutable std::atomic<uint64_t> epoch{0};
+    mutable std::array<std::atomic<int>, 2> readers{}; // Readers mid-acquire, by epoch parity
+    shared_ptr<const SceneSnapshot> latest;
+    std::vector<Retired> retired;
+    uint64_t commits = 0;
+
+    // Advances the epoch as far as the readers allow, then drops the retired snapshots no
+    // reader can reach. After an advance from e to e + 1 every reader registered in e - 1 or
+    // earlier is done. A snapshot replaced in epoch e was loaded, if at all, by readers
+    // registered in e or earlier, so it is unreachable once the epoch is e + 2. A steady stream
+    // of readers registers in the current epoch only, so the older counter drains and the epoch
+    // keeps advancing.
+    void reclaim() {
+        for (int step = 0; step < 2; step++) {
+            uint64_t e = epoch.load();
+            if (readers[(e + 1) & 1].load() != 0)
+                break;
+            epoch.store(e + 1);
+        }
+        uint64_t now = epoch.load();
+        std::erase_if(retired, [now](const Retired &r) { return r.epoch + 2 <= now; });
+    }
     public:
 
     HittableList() {}
     HittableList(shared_ptr<Hittable> object) { add(object); }
 
-    void clear() { objects.clear(); }
+    void clear() {
+        objects.clear();
+        bbox = AABB();
+    }
 
     void add(shared_ptr<Hittable> object) {
-        lock();
-        objects.push_back(object); 
-        unlock();
+        objects.push_back(object);
+        bbox = AABB(bbox, object->bounding_box());
     }
 
-    void lock() {
-        m.lock();
-        is_locked = true;
+    // Removes every occurrence of `object`.
+    void remove(const shared_ptr<Hittable> &object) {
+        std::erase(objects, object);
+        bbox = AABB();
+        for (const auto &o : objects) {
+            bbox = AABB(bbox, o->bounding_box());
+        }
     }
 
-    void unlock() {
-        m.unlock();
-        is_locked = false;
+    const std::vector<shared_ptr<Hittable>> &get_objects() const { return objects; }
+
+    /**
+     * @brief Creates an object, such as a primitive or a material, in the list's arena instead
+     * of with one heap allocation each (see ArenaAllocator). The objects may outlive the list.
+     */
+    template <typename T, typename... Args> shared_ptr<T> make(Args &&...args) {
+        if (!arena)
+            arena = make_shared<Arena>(256 * 1024);
+        return std::allocate_shared<T>(ArenaAllocator<T>(arena), std::forward<Args>(args)...);
     }
 
-    bool hit(const Ray &r, Interval ray_t, HitRecord &rec) const override {
-        
-        if (!is_locked) {
-            throw std::runtime_error("HittableList is not locked!. Please lock the list before calling hit. This is to ensure thread safety.");
+    /**
+     * @brief Publishes the current objects as a new snapshot, which snapshot() returns from
+     * then on. Renders holding an older snapshot finish with it, and it is freed when the last
+     * of them lets go. Call from the thread that edits the list.
+     */
+    shared_ptr<const SceneSnapshot> commit() {
+        shared_ptr<const SceneSnapshot> replaced = std::move(latest);
+        latest = make_shared<const SceneSnapshot>(objects, bbox, ++commits);
+        // Sequentially consistent with snapshot(): a reader that loads the replaced pointer
+        // registered before this store, so in the epoch recorded below or an earlier one.
+        published.store(latest.get());
+        if (replaced)
+            retired.push_back(Retired{std::move(replaced), epoch.load()});
+        reclaim();
+        return latest;
+    }
+
+    /**
+     * @brief The latest committed snapshot, null before the first commit. Safe to call from any
+     * thread while the list is edited, and never waits for the editing thread. Take it once per
+     * render, not per ray.
+     */
+    shared_ptr<const SceneSnapshot> snapshot() const {
+        // Register in the current epoch. If commit() advanced it meanwhile, the registration
+        // may have been missed, so retry in the new one.
+        uint64_t e;
+        while (true) {
+            e = epoch.load();
+            readers[e & 1].fetch_add(1);
+            if (epoch.load() == e)
+                break;
+            readers[e & 1].fetch_sub(1);
         }
+        const SceneSnapshot *current = published.load();
+        shared_ptr<const SceneSnapshot> result =
+            current ? current->shared_from_this() : nullptr;
+        readers[e & 1].fetch_sub(1, std::memory_order_release);
+        return result;
+    }
+
+    // Snapshots replaced by commits that the list still holds, at most a few unless a reader
+    // stalls while taking its reference.
+    size_t retired_count() const { return retired.size(); }
 
+    AABB bounding_box() const override { return bbox; }
+
+    bool hit(const Ray &r, Interval ray_t, HitRecord &rec) const override {
         HitRecord temp_rec;
         bool hit_anything = false;
         auto closest_so_far = ray_t.max;
 
+        RT_STAT(Stats::local().primitive_tests += objects.size());
         for (int i = 0; i < objects.size(); i++) {
             auto object = objects[i].get();
             if (object->hit(r, Interval(ray_t.min, closest_so_far), temp_rec)) {
@@ -87,7 +252,8 @@ class HittableList : public Hittable {
                 rec = temp_rec;
             }
         }
-        // Old code for the loop above. Below is slower because it involves copying the pointer which will do stuff like mutex locking,
+        // Old code for the loop above. Below is slower because it involves copying the pointer
+        // which will do stuff like mutex locking,
         //  obliterating performance in multithreaded environments.
         // ---
         // for (const auto &object : objects) {
@@ -100,4 +266,13 @@ class HittableList : public Hittable {
 
         return hit_anything;
     }
-};
\ No newline at end of file
+
+    bool hit_any(const Ray &r, Interval ray_t) const override {
+        for (int i = 0; i < (int)objects.size(); i++) {
+            RT_STAT(Stats::local().primitive_tests++);
+            if (objects[i].get()->hit_any(r, ray_t))
+                return true;
+        }
+        return false;
+    }
+};
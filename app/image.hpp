@@ -0,0 +1,207 @@
+#pragma once
+
+#include "math.hpp"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Applies the gamma 2 transform and quantizes every pixel to 8 bit RGB, writing the
+ * bytes to `out` (3 * count bytes). The loop is branch free so the compiler can vectorize it.
+ */
+inline void quantize_rgb8(const Color *pixels, size_t count, uint8_t *out) {
+    for (size_t p = 0; p < count; p++) {
+        for (int c = 0; c < 3; c++) {
+            // Apply a linear to gamma transform for gamma 2, then translate the [0,1] component
+            // values to the byte range [0,255].
+            Real v = std::sqrt(std::max(pixels[p].e[c], Real(0)));
+            v = std::min(v, Real(0.999));
+            out[3 * p + c] = uint8_t(256 * v);
+        }
+    }
+}
+
+/**
+ * @brief Binary PPM (P6). Header and pixels are assembled in one buffer and written at once.
+ */
+inline void write_ppm(const std::string &path, const std::vector<Color> &pixels, int width,
+                      int height) {
+    std::string header =
+        "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+
+    std::vector<uint8_t> buffer(header.size() + pixels.size() * 3);
+    std::memcpy(buffer.data(), header.data(), header.size());
+    quantize_rgb8(pixels.data(), pixels.size(), buffer.data() + header.size());
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+}
+
+/**
+ * @brief Portable float map: linear 32 bit float RGB, no gamma or clamping, rows stored bottom
+ * to top. A negative scale marks the data as little endian.
+ */
+inline void write_pfm(const std::string &path, const std::vector<Color> &pixels, int width,
+                      int height) {
+    std::string header =
+        "PF\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n-1.0\n";
+
+    std::vector<uint8_t> buffer(header.size() + pixels.size() * 3 * sizeof(float));
+    std::memcpy(buffer.data(), header.data(), header.size());
+
+    std::vector<float> row(size_t(width) * 3);
+    uint8_t *data = buffer.data() + header.size();
+    for (int j = 0; j < height; j++) {
+        const Color *src = &pixels[size_t(height - 1 - j) * width];
+        for (int i = 0; i < width; i++) {
+            for (int c = 0; c < 3; c++) {
+                row[i * 3 + c] = float(src[i].e[c]);
+            }
+        }
+        std::memcpy(data + j * row.size() * sizeof(float), row.data(),
+                    row.size() * sizeof(float));
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+}
+
+/**
+ * @brief Minimal PNG encoder without dependencies. The image data is wrapped in uncompressed
+ * (stored) deflate blocks, which costs some file size but no CPU time compared to zlib.
+ */
+class PngEncoder {
+    public:
+    static std::vector<uint8_t> encode(const std::vector<Color> &pixels, int width,
+                                       int height) {
+        // Scanlines prefixed with a filter type byte (0 = none).
+        const size_t row_bytes = size_t(width) * 3;
+        std::vector<uint8_t> raw((row_bytes + 1) * height);
+        for (int j = 0; j < height; j++) {
+            raw[j * (row_bytes + 1)] = 0;
+            quantize_rgb8(&pixels[size_t(j) * width], width, &raw[j * (row_bytes + 1) + 1]);
+        }
+
+        std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+        std::vector<uint8_t> ihdr;
+        put_u32(ihdr, width);
+        put_u32(ihdr, height);
+        ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0}); // 8 bit depth, truecolor RGB, no interlace
+        put_chunk(png, "IHDR", ihdr);
+
+        put_chunk(png, "IDAT", zlib_stored(raw));
+        put_chunk(png, "IEND", {});
+        return png;
+    }
+
+    private:
+    static void put_u32(std::vector<uint8_t> &out, uint32_t v) {
+        out.push_back(uint8_t(v >> 24));
+        out.push_back(uint8_t(v >> 16));
+        out.push_back(uint8_t(v >> 8));
+        out.push_back(uint8_t(v));
+    }
+
+    static uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc) {
+        static const std::array<uint32_t, 256> table = [] {
+            std::array<uint32_t, 256> t;
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                }
+                t[n] = c;
+            }
+            return t;
+        }();
+
+        for (size_t i = 0; i < len; i++) {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+    static uint32_t adler32(const std::vector<uint8_t> &data) {
+        uint32_t a = 1, b = 0;
+        size_t i = 0;
+        while (i < data.size()) {
+            // 5552 is the largest block for which b cannot overflow before the modulo.
+            size_t block_end = std::min(data.size(), i + 5552);
+            for (; i < block_end; i++) {
+                a += data[i];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+        return (b << 16) | a;
+    }
+
+    static std::vector<uint8_t> zlib_stored(const std::vector<uint8_t> &data) {
+        std::vector<uint8_t> out = {0x78, 0x01}; // Deflate, 32K window, no preset dictionary
+        out.reserve(data.size() + data.size() / 65535 * 5 + 16);
+
+        size_t pos = 0;
+        do {
+            size_t len = std::min<size_t>(65535, data.size() - pos);
+            bool last = pos + len == data.size();
+            out.push_back(last ? 1 : 0);
+            out.push_back(uint8_t(len));
+            out.push_back(uint8_t(len >> 8));
+            out.push_back(uint8_t(~len));
+            out.push_back(uint8_t(~len >> 8));
+            out.insert(out.end(), data.begin() + pos, data.begin() + pos + len);
+            pos += len;
+        } while (pos < data.size());
+
+        put_u32(out, adler32(data));
+        return out;
+    }
+
+    static void put_chunk(std::vector<uint8_t> &png, const char *type,
+                          const std::vector<uint8_t> &data) {
+        put_u32(png, (uint32_t)data.size());
+        size_t type_start = png.size();
+        png.insert(png.end(), type, type + 4);
+        png.insert(png.end(), data.begin(), data.end());
+        uint32_t crc = crc32(&png[type_start], png.size() - type_start, 0xffffffffu);
+        put_u32(png, crc ^ 0xffffffffu);
+    }
+};
+
+inline void write_png(const std::string &path, const std::vector<Color> &pixels, int width,
+                      int height) {
+    auto png = PngEncoder::encode(pixels, width, height);
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(png.data()), png.size());
+}
+
+/**
+ * @brief Writes the image in the format matching the file extension: .ppm (binary P6), .pfm
+ * (linear float HDR) or .png.
+ */
+inline void write_image(const std::string &path, const std::vector<Color> &pixels, int width,
+                        int height) {
+    auto ext = std::filesystem::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+
+    if (ext == ".ppm") {
+        write_ppm(path, pixels, width, height);
+    } else if (ext == ".pfm") {
+        write_pfm(path, pixels, width, height);
+    } else if (ext == ".png") {
+        write_png(path, pixels, width, height);
+    } else {
+        throw std::runtime_error("Unsupported image format '" + ext +
+                                 "'. Use .ppm, .pfm or .png.");
+    }
+}
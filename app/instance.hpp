@@ -0,0 +1,83 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "hittable.hpp"
+#include "interval.hpp"
+#include "math.hpp"
+#include "ray.hpp"
+#include "transform.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+/**
+ * @brief Places shared geometry in the world with an affine transform. Rays are moved into
+ * object space instead of transforming the geometry, so any number of instances share one copy
+ * of the object and its BVH.
+ */
+class Instance : public Hittable {
+    public:
+    Instance(shared_ptr<const Hittable> object, const Transform &to_world)
+        : object(object), to_object(to_world.inverse()), error_scale(to_world.max_stretch()),
+          bbox(to_world.box(object->bounding_box())) {}
+
+    bool hit(const Ray &r, Interval ray_t, HitRecord &rec) const override {
+        return hit_transformed(*object, to_object, error_scale, r, ray_t, rec);
+    }
+
+    bool hit_any(const Ray &r, Interval ray_t) const override {
+        return hit_any_transformed(*object, to_object, r, ray_t);
+    }
+
+    AABB bounding_box() const override { return bbox; }
+
+    const shared_ptr<const Hittable> &get_object() const { return object; }
+    const Transform &get_to_object() const { return to_object; }
+    Real get_error_scale() const { return error_scale; }
+
+    /**
+     * @brief Intersects `object` through its world-to-object transform. Shared with the
+     * instance table of FlatScene.
+     *
+     * The object space direction is not normalized, so t is the same in both spaces and the
+     * world space hit point comes straight from the world ray. `Object` is Hittable, or a final
+     * class such as TriangleMesh whose hit is then called directly.
+     */
+    template <typename Object>
+    static bool hit_transformed(const Object &object, const Transform &to_object,
+                                Real error_scale, const Ray &r, Interval ray_t,
+                                HitRecord &rec) {
+        Ray local(to_object.point(r.origin()), to_object.vector(r.direction()));
+        if (!object.hit(local, ray_t, rec))
+            return false;
+
+        rec.p = r.at(rec.t);
+        // Normals transform with the inverse transpose of the object-to-world transform, that
+        // is the transpose of to_object. This keeps the sign of dot(direction, normal), so
+        // front_face is still valid.
+        rec.normal = unit_vector(to_object.transpose_vector(rec.normal));
+
+        const Point3 &o = r.origin();
+        auto magnitude =
+            std::max({std::fabs(rec.p.x()), std::fabs(rec.p.y()), std::fabs(rec.p.z()),
+                      std::fabs(o.x()), std::fabs(o.y()), std::fabs(o.z())});
+        rec.p_error = std::max(rec.p_error * error_scale,
+                               magnitude * std::numeric_limits<Real>::epsilon() * 8);
+        return true;
+    }
+
+    // Shadow ray counterpart of hit_transformed.
+    template <typename Object>
+    static bool hit_any_transformed(const Object &object, const Transform &to_object,
+                                    const Ray &r, Interval ray_t) {
+        return object.hit_any(Ray(to_object.point(r.origin()), to_object.vector(r.direction())),
+                              ray_t);
+    }
+
+    private:
+    shared_ptr<const Hittable> object;
+    Transform to_object;
+    Real error_scale; // How much the object-to-world transform can stretch an error
+    AABB bbox;
+};
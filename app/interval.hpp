@@ -2,34 +2,53 @@
 
 #include "math.hpp"
 
-class Interval {
+template <typename T>
+class IntervalT {
     public:
-      double min, max;
+      T min, max;
   
-      Interval() : min(+infinity), max(-infinity) {} // Default interval is empty
+      // Default interval is empty
+      IntervalT()
+          : min(+std::numeric_limits<T>::infinity()),
+            max(-std::numeric_limits<T>::infinity()) {}
   
-      Interval(double min, double max) : min(min), max(max) {}
+      IntervalT(T min, T max) : min(min), max(max) {}
+
+      // Create the interval tightly enclosing the two input intervals.
+      IntervalT(const IntervalT &a, const IntervalT &b)
+          : min(a.min <= b.min ? a.min : b.min), max(a.max >= b.max ? a.max : b.max) {}
   
-      double size() const {
+      T size() const {
           return max - min;
       }
   
-      bool contains(double x) const {
+      bool contains(T x) const {
           return min <= x && x <= max;
       }
   
-      bool surrounds(double x) const {
+      bool surrounds(T x) const {
           return min < x && x < max;
       }
 
-      double clamp(double x) const {
+      T clamp(T x) const {
         if (x < min) return min;
         if (x > max) return max;
         return x;
     }
+
+      IntervalT expand(T delta) const {
+          auto padding = delta / 2;
+          return IntervalT(min - padding, max + padding);
+      }
   
-      static const Interval empty, universe;
+      static const IntervalT empty, universe;
   };
   
-  const Interval Interval::empty    = Interval(+infinity, -infinity);
-  const Interval Interval::universe = Interval(-infinity, +infinity);
\ No newline at end of file
+  template <typename T>
+  const IntervalT<T> IntervalT<T>::empty =
+      IntervalT<T>(+std::numeric_limits<T>::infinity(), -std::numeric_limits<T>::infinity());
+  template <typename T>
+  const IntervalT<T> IntervalT<T>::universe =
+      IntervalT<T>(-std::numeric_limits<T>::infinity(), +std::numeric_limits<T>::infinity());
+
+  using Interval = IntervalT<Real>;
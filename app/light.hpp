@@ -0,0 +1,228 @@
+#pragma once
+
+#include "hittable.hpp"
+#include "math.hpp"
+#include "mesh.hpp"
+#include "objects.hpp"
+#include "ray.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/**
+ * @brief A direction towards a light, picked by LightList::sample.
+ */
+struct LightSample {
+    Vec3 direction; // Unit length
+    Real distance;  // To the sampled point on the light
+    Color radiance; // Emitted towards the shading point
+    Real pdf;       // Solid angle density of the direction, including the choice of light
+};
+
+// Weight of a sample taken with density `f` when density `g` could also have produced it, by
+// the power heuristic of multiple importance sampling.
+inline Real power_heuristic(Real f, Real g) { return f * f / (f * f + g * g); }
+
+/**
+ * @brief Emitters of a scene, for next-event estimation: spheres and triangle meshes with a
+ * DiffuseLight material. One light is picked per sample, in proportion to its emitted power.
+ *
+ * Sphere lights are sampled uniformly over the cone they subtend, which only produces
+ * directions that hit the sphere. Mesh lights are sampled uniformly by area. The lights refer
+ * to the scene's geometry, which must outlive the list.
+ */
+class LightList {
+    public:
+    bool empty() const { return lights.empty(); }
+    int size() const { return (int)lights.size(); }
+
+    void clear() {
+        lights.clear();
+        triangle_areas.clear();
+        power_cdf.clear();
+    }
+
+    // Adds a sphere light and returns its index, or -1 if it emits no power and is not a light.
+    int add_sphere(const Point3 &center, Real radius, const Color &emit) {
+        Light light;
+        light.center = center;
+        light.radius = radius;
+        light.emit = emit;
+        light.area = 4 * pi * radius * radius;
+        return add(light);
+    }
+
+    // Adds a mesh light and returns its index, or -1 like add_sphere. Each triangle emits from
+    // the side its winding faces, like the front faces of TriangleMesh.
+    int add_mesh(const TriangleMesh &mesh, const Color &emit) {
+        Light light;
+        light.mesh = &mesh;
+        light.emit = emit;
+        light.first_triangle = (int)triangle_areas.size();
+        const auto &v = mesh.get_vertices();
+        const auto &idx = mesh.get_indices();
+        // Running sum of the triangle areas, to pick a triangle by area.
+        for (int tri = 0; tri < mesh.triangle_count(); tri++) {
+            Vec3 e1 = v[idx[3 * tri + 1]] - v[idx[3 * tri]];
+            Vec3 e2 = v[idx[3 * tri + 2]] - v[idx[3 * tri]];
+            light.area += cross(e1, e2).length() / 2;
+            triangle_areas.push_back(light.area);
+        }
+        int index = add(light);
+        if (index < 0)
+            triangle_areas.resize(light.first_triangle);
+        return index;
+    }
+
+    /**
+     * @brief Picks a light and a point on it as seen from `p`, from three uniform numbers.
+     * False if the point faces away from `p`, `p` is inside the light or no light emits.
+     */
+    bool sample(const Point3 &p, Real u_light, Real u, Real v, LightSample &out) const {
+        if (total_power() <= 0)
+            return false;
+        auto it = std::upper_bound(power_cdf.begin(), power_cdf.end(), u_light * total_power());
+        int i = int(it - power_cdf.begin());
+        i = std::min(i, size() - 1);
+        const Light &light = lights[i];
+        Real select = select_pdf(i);
+
+        if (light.mesh)
+            return sample_mesh(light, p, u, v, select, out);
+        return sample_sphere(light, p, u, v, select, out);
+    }
+
+    /**
+     * @brief Solid angle density with which sample() picks the direction of `r` from its
+     * origin, given that `r` hits light `index` at `rec`.
+     */
+    Real pdf(int index, const Ray &r, const HitRecord &rec) const {
+        if (total_power() <= 0)
+            return 0;
+        const Light &light = lights[index];
+        Real select = select_pdf(index);
+        if (light.mesh) {
+            Real length = r.direction().length();
+            Real distance = rec.t * length;
+            Real cosine = std::fabs(dot(rec.normal, r.direction())) / length;
+            return cosine > 0 ? select * distance * distance / (cosine * light.area) : 0;
+        }
+        Real one_minus_cos_max;
+        if (!sphere_cone(light, r.origin(), one_minus_cos_max))
+            return 0;
+        return select / (2 * pi * one_minus_cos_max);
+    }
+
+    private:
+    struct Light {
+        Point3 center;                     // Sphere lights
+        Real radius = 0;
+        const TriangleMesh *mesh = nullptr; // Mesh lights
+        int first_triangle = 0;            // Offset of its running areas in triangle_areas
+        Color emit;
+        Real area = 0;
+    };
+
+    std::vector<Light> lights;
+    std::vector<Real> triangle_areas; // Running area sum within each mesh light
+    std::vector<Real> power_cdf;      // Running sum of the emitted power
+
+    int add(const Light &light) {
+        Real power = (light.emit.x() + light.emit.y() + light.emit.z()) / 3 * light.area;
+        // Picked with probability 0, and a list of such lights only would divide 0 by 0.
+        if (!(power > 0))
+            return -1;
+        lights.push_back(light);
+        power_cdf.push_back((power_cdf.empty() ? 0 : power_cdf.back()) + power);
+        return (int)lights.size() - 1;
+    }
+
+    Real total_power() const { return power_cdf.empty() ? 0 : power_cdf.back(); }
+
+    // Probability that sample() picks light i.
+    Real select_pdf(int i) const {
+        return (power_cdf[i] - (i > 0 ? power_cdf[i - 1] : 0)) / total_power();
+    }
+
+    // 1 - cos of the half angle of the cone a sphere light subtends from p, without
+    // cancellation for small or distant spheres. False if p is inside the sphere.
+    static bool sphere_cone(const Light &light, const Point3 &p, Real &one_minus_cos_max) {
+        Real d2 = (light.center - p).length_squared();
+        Real r2 = light.radius * light.radius;
+        if (d2 <= r2)
+            return false;
+        Real sin2_max = r2 / d2;
+        one_minus_cos_max = sin2_max / (1 + std::sqrt(1 - sin2_max));
+        return one_minus_cos_max > 0;
+    }
+
+    bool sample_sphere(const Light &light, const Point3 &p, Real u, Real v, Real select,
+                       LightSample &out) const {
+        Real one_minus_cos_max;
+        if (!sphere_cone(light, p, one_minus_cos_max))
+            return false;
+
+        // Uniform direction in the cone around the sphere center.
+        Vec3 w = unit_vector(light.center - p);
+        Vec3 a = std::fabs(w.x()) > Real(0.9) ? Vec3(0, 1, 0) : Vec3(1, 0, 0);
+        Vec3 s = unit_vector(cross(w, a));
+        Vec3 t = cross(w, s);
+        Real one_minus_cos = u * one_minus_cos_max;
+        Real cos_theta = 1 - one_minus_cos;
+        Real sin_theta = std::sqrt(std::max(Real(0), one_minus_cos * (2 - one_minus_cos)));
+        Real phi = 2 * pi * v;
+        out.direction = unit_vector(sin_theta * std::cos(phi) * s +
+                                    sin_theta * std::sin(phi) * t + cos_theta * w);
+
+        // Distance to the near side. Directions at the rim of the cone can miss by rounding,
+        // they touch the sphere at the tangent point.
+        Real root;
+        if (Sphere::intersect(Ray(p, out.direction), light.center, light.radius,
+                              Interval(0, infinity), root))
+            out.distance = root;
+        else
+            out.distance = dot(light.center - p, out.direction);
+
+        out.radiance = light.emit;
+        out.pdf = select / (2 * pi * one_minus_cos_max);
+        return true;
+    }
+
+    bool sample_mesh(const Light &light, const Point3 &p, Real u, Real v, Real select,
+                     LightSample &out) const {
+        // Pick a triangle by area, then reuse u within it.
+        auto first = triangle_areas.begin() + light.first_triangle;
+        auto last = first + light.mesh->triangle_count();
+        Real target = u * light.area;
+        auto it = std::min(std::upper_bound(first, last, target), last - 1);
+        int tri = int(it - first);
+        Real before = it == first ? 0 : *(it - 1);
+        Real tri_area = *it - before;
+        u = tri_area > 0 ? std::clamp((target - before) / tri_area, Real(0), Real(1)) : 0;
+
+        // Uniform point on the triangle.
+        const auto &vs = light.mesh->get_vertices();
+        const auto &idx = light.mesh->get_indices();
+        const Point3 &v0 = vs[idx[3 * tri]];
+        const Point3 &v1 = vs[idx[3 * tri + 1]];
+        const Point3 &v2 = vs[idx[3 * tri + 2]];
+        Real su = std::sqrt(u);
+        Real b1 = 1 - su;
+        Real b2 = v * su;
+        Point3 q = v0 + b1 * (v1 - v0) + b2 * (v2 - v0);
+        Vec3 normal = unit_vector(cross(v1 - v0, v2 - v0));
+
+        Vec3 to_light = q - p;
+        Real distance = to_light.length();
+        if (distance <= 0)
+            return false;
+        out.direction = to_light / distance;
+        Real cosine = -dot(normal, out.direction);
+        if (cosine <= 0)
+            return false; // Back of the triangle, which does not emit
+        out.distance = distance;
+        out.radiance = light.emit;
+        out.pdf = select * distance * distance / (cosine * light.area);
+        return true;
+    }
+};
@@ -1,45 +1,261 @@
-
-#include "./logging.hpp"
-
+#include "animation.hpp"
 #include "camera.hpp"
+#include "flat_scene.hpp"
 #include "hittable.hpp"
 #include "material.hpp"
 #include "objects.hpp"
+#include "partial.hpp"
+#include "scene_file.hpp"
+#include "scenes.hpp"
+#include "session.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
 
 
-int main() {
+// Usage: main [scene.scene|scene.bscene] [--save file.scene|file.bscene]
+//             [--time-budget seconds]
+//             [--sampler independent|stratified|sobol|blue_noise] [--denoise [--aovs prefix]]
+//             [--no-nee] [--packets] [--adaptive [threshold] [--heatmap file]]
+//             [--partial file.rtpart [--tiles first:end] [--samples first:end]]
+//             [--frames N [--fps 24] [--frame-pattern frame_####.ppm]]
+//
+// Without a scene file the built-in three sphere scene is rendered. With --save the scene is
+// converted to the given file instead of being rendered. With --time-budget as many samples per
+// pixel as fit in the budget are taken instead of samples_per_pixel. --sampler picks the sample
+// pattern (see sampler.hpp), sobol by default. --denoise filters the image with the albedo,
+// normal and depth of the first non-specular hits (see denoise.hpp), and --aovs writes those to
+// <prefix>albedo.pfm, <prefix>normal.pfm and <prefix>depth.pfm. --no-nee turns off the shadow
+// rays towards the scene's lights (next-event estimation). --packets traces the primary rays of
+// adjacent pixels together (see FlatScene::hit_packet), which renders the same image.
+//
+// With --adaptive a pixel stops sampling once the relative standard error of its luminance
+// falls below the threshold, 0.01 by default (see Camera::adaptive_sampling), and --heatmap
+// writes an image of the samples each pixel took. Packets, time budgets and partial renders
+// take every sample, so they do not combine with --adaptive.
+//
+// Time budgets and partial renders accumulate sample sums without the AOVs the filter needs,
+// and a partial holds only part of the samples, so they do not combine with --denoise or
+// --aovs.
+//
+// With --partial only the given tiles (make_tiles order) and sample indices are rendered, by
+// default all of them, and written as a partial render for the merge tool (see partial.hpp).
+//
+// With --frames the scene's keyframes (see animation.hpp) are rendered as a sequence of N
+// frames at the given rate, to numbered files (see numbered_path). The built-in scene has its
+// own animation.
+//
+// Errors, such as a malformed scene file, an invalid tile or sample range or an unwritable
+// output, are printed and exit with status 1.
 
-    // World
-    HittableList world;
+// Parses the "first:end" range given to `option`. An empty end is -1. Throws if `text` is not
+// such a range.
+static std::pair<int, int> parse_range(const std::string &option, const std::string &text) {
+    auto invalid = [&] {
+        return std::runtime_error(option + " expects a range first:end, got \"" + text + "\"");
+    };
+    auto number = [&](const std::string &part) {
+        size_t used = 0;
+        int value = 0;
+        try {
+            value = std::stoi(part, &used);
+        } catch (const std::logic_error &) {
+            throw invalid();
+        }
+        if (used != part.size())
+            throw invalid();
+        return value;
+    };
 
-    shared_ptr<Material> mat_a = make_shared<Metal>(Color(0.8, 0.8, 0.8), 0.3);
-    shared_ptr<Material> mat_b = make_shared<Metal>(Color(0.1, 0.2, 0.5));
-    shared_ptr<Material> mat_c = make_shared<Metal>(Color(0.1, 0.2, 0.5), 0.1);
+    auto colon = text.find(':');
+    if (colon == std::string::npos)
+        throw invalid();
+    int first = number(text.substr(0, colon));
+    int end = colon + 1 < text.size() ? number(text.substr(colon + 1)) : -1;
+    return {first, end};
+}
 
-    world.add(make_shared<Sphere>(Point3(0.75, 0, -1), 0.5, mat_c));
-    world.add(make_shared<Sphere>(Point3(-0.75, 0, -1), 0.5, mat_b));
-    world.add(make_shared<Sphere>(Point3(0, -100.5, -1), 100, mat_a));
+static int run(int argc, char **argv) {
+    std::string scene_path;
+    std::string save_path;
+    double time_budget = 0;
+    std::string partial_path;
+    std::pair<int, int> tile_range{0, -1};
+    std::pair<int, int> sample_range{0, -1};
+    SamplerType sampler = SamplerType::Sobol;
+    bool denoise = false;
+    bool next_event_estimation = true;
+    bool packets = false;
+    bool adaptive = false;
+    double adaptive_threshold = 0.01;
+    std::string heatmap_path;
+    std::string aov_prefix;
+    int frames = 0;
+    double fps = 24;
+    std::string frame_pattern = "frame_####.ppm";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--save" && i + 1 < argc)
+            save_path = argv[++i];
+        else if (arg == "--time-budget" && i + 1 < argc)
+            time_budget = std::stod(argv[++i]);
+        else if (arg == "--partial" && i + 1 < argc)
+            partial_path = argv[++i];
+        else if (arg == "--tiles" && i + 1 < argc)
+            tile_range = parse_range(arg, argv[++i]);
+        else if (arg == "--samples" && i + 1 < argc)
+            sample_range = parse_range(arg, argv[++i]);
+        else if (arg == "--sampler" && i + 1 < argc)
+            sampler = parse_sampler(argv[++i]);
+        else if (arg == "--denoise")
+            denoise = true;
+        else if (arg == "--no-nee")
+            next_event_estimation = false;
+        else if (arg == "--packets")
+            packets = true;
+        else if (arg == "--adaptive") {
+            adaptive = true;
+            // The threshold is optional, a following argument that is not a number is left
+            // alone.
+            if (i + 1 < argc) {
+                char *end;
+                double value = std::strtod(argv[i + 1], &end);
+                if (end != argv[i + 1] && *end == '\0') {
+                    adaptive_threshold = value;
+                    i++;
+                }
+            }
+        } else if (arg == "--heatmap" && i + 1 < argc)
+            heatmap_path = argv[++i];
+        else if (arg == "--aovs" && i + 1 < argc)
+            aov_prefix = argv[++i];
+        else if (arg == "--frames" && i + 1 < argc)
+            frames = std::stoi(argv[++i]);
+        else if (arg == "--fps" && i + 1 < argc)
+            fps = std::stod(argv[++i]);
+        else if (arg == "--frame-pattern" && i + 1 < argc)
+            frame_pattern = argv[++i];
+        else
+            scene_path = arg;
+    }
+
+    if (!heatmap_path.empty() && !adaptive) {
+        std::cerr << "--heatmap needs --adaptive\n";
+        return 1;
+    }
+    if (adaptive && (packets || time_budget > 0 || !partial_path.empty())) {
+        std::cerr
+            << "--adaptive cannot be combined with --packets, --time-budget or --partial\n";
+        return 1;
+    }
+    if ((denoise || !aov_prefix.empty()) && (time_budget > 0 || !partial_path.empty())) {
+        std::cerr
+            << "--denoise and --aovs cannot be combined with --time-budget or --partial\n";
+        return 1;
+    }
 
     Camera cam;
-    cam.samples_per_pixel = 1;
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 400;
+    FlatScene scene;
+    SceneAnimation animation;
 
     // cam.samples_per_pixel = 20;
     // cam.output_file = "output_quality_debug.ppm";
 
     cam.image_width = 1920;
     cam.samples_per_pixel = 50;
-    cam.max_depth = 50;
     cam.output_file = "output_quality_high.ppm";
-
-    
+    cam.russian_roulette = true;
+    cam.min_throughput = 1e-4;
 
     auto start = std::chrono::high_resolution_clock::now();
-    world.lock();
-    cam.render(world);
-    world.unlock();
+    // The time budget covers the whole run, loading included.
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(time_budget));
+    if (!scene_path.empty()) {
+        SceneFileInfo info = load_scene(scene_path, scene, cam, &animation);
+        std::clog << "Loaded " << scene_path << ": " << info.spheres << " spheres, "
+                  << info.triangles << " triangles, " << info.materials << " materials in "
+                  << info.load_seconds * 1000 << "ms, BVH built in "
+                  << info.build_seconds * 1000 << "ms\n";
+    } else {
+        // World
+        HittableList world;
+        scene_three_spheres(world, cam);
+        animate_three_spheres(animation);
+        scene = FlatSceneBuilder().add(world).build();
+        std::chrono::duration<double> build_time =
+            std::chrono::high_resolution_clock::now() - start;
+        std::clog << "Scene: " << scene.spheres.size() << " spheres, " << scene.materials.size()
+                  << " materials, " << scene.bvh_node_count() << " BVH nodes, built in "
+                  << build_time.count() * 1000 << "ms\n";
+    }
+
+    cam.sampler_type = sampler;
+    cam.denoise = denoise;
+    cam.next_event_estimation = next_event_estimation;
+    cam.packet_tracing = packets;
+    cam.adaptive_sampling = adaptive;
+    cam.adaptive_threshold = adaptive_threshold;
+    cam.sample_heatmap_file = heatmap_path;
+    cam.render_aovs = !aov_prefix.empty();
+    cam.aov_file_prefix = aov_prefix;
+
+    if (!save_path.empty()) {
+        save_scene(save_path, scene, cam, &animation);
+        std::clog << "Saved " << save_path << "\n";
+        return 0;
+    }
+
+    // Path length of the whole run: the camera's stats only cover its last render.
+    double path_length = 0;
+    if (!partial_path.empty()) {
+        int end_sample = sample_range.second < 0 ? cam.samples_per_pixel : sample_range.second;
+        render_partial(cam, scene, tile_range.first, tile_range.second, sample_range.first,
+                       end_sample - sample_range.first, partial_path);
+        path_length = cam.stats().average_path_length(); // A single render of the whole range
+        std::clog << "Wrote partial render " << partial_path << "\n";
+    } else if (frames > 0) {
+        cam.show_progress = false;
+        AnimationReport report =
+            render_animation(cam, scene, animation, frames, fps, frame_pattern);
+        path_length = report.average_path_length();
+        std::clog << report.frames << " frames in " << report.seconds << "s, "
+                  << report.frames_per_second() << " frames/s, "
+                  << report.rays_per_second() / 1e6 << " Mrays/s\n"
+                  << "Per frame: refit " << report.refit_seconds / frames * 1000
+                  << "ms, render " << report.render_seconds / frames * 1000 << "ms, write "
+                  << report.write_seconds / frames * 1000 << "ms (waited for "
+                  << report.write_wait_seconds / frames * 1000 << "ms)\n";
+    } else if (time_budget > 0) {
+        cam.show_progress = false;
+        RenderSession session(cam, scene);
+        BudgetReport report = session.render_until(deadline);
+        session.write(cam.output_file);
+        std::clog << "Time budget " << time_budget << "s: " << report.samples
+                  << " samples per pixel in " << report.passes << " passes, "
+                  << report.rays_per_second() / 1e6 << " Mrays/s\n";
+        path_length = report.average_path_length();
+    } else {
+        cam.render(scene);
+        path_length = cam.stats().average_path_length();
+    }
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = end - start;
+    std::clog << "Average path length: " << path_length << " rays\n";
     std::clog << "Elapsed time: " << elapsed.count() << "s\n";
-}
\ No newline at end of file
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    try {
+        return run(argc, argv);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
@@ -3,49 +3,153 @@
 #include "hittable.hpp"
 #include "math.hpp"
 #include "ray.hpp"
+#include "sampler.hpp"
+#include <cstdint>
+
+// Materials the render loops are compiled for. Their classes are final and report their kind,
+// so visit_material can call them directly; every other material is Other.
+enum class MaterialKind : uint8_t {
+    Lambertian,
+    Metal,
+    DiffuseLight,
+    Other,
+};
 
 class Material {
     public:
+    Material() = default;
     virtual ~Material() {}
 
+    MaterialKind kind() const { return material_kind; }
+
+    // Name used by the stats layer to count scatter calls per material type.
+    virtual const char *type_name() const { return "Material"; }
+
+    // Base color of the surface, the albedo AOV of the denoiser. Black for materials without
+    // one.
+    virtual Color surface_albedo() const { return Color(0, 0, 0); }
+    // Mirror-like surfaces show what they reflect, so the denoiser's AOVs look through them.
+    virtual bool is_specular() const { return false; }
+
+    // Radiance the surface emits at the hit, black for everything but lights.
+    virtual Color emitted(const HitRecord &) const { return Color(0, 0, 0); }
+
+    // Next-event estimation: materials that return true here can evaluate their scattering for
+    // any direction, so the camera samples the lights from their surfaces.
+    virtual bool samples_direct_light() const { return false; }
+    // BSDF times the cosine to the normal, for light arriving from `direction`.
+    virtual Color evaluate(const HitRecord &, const Vec3 &) const { return Color(0, 0, 0); }
+    // Solid angle density with which scatter() picks `direction`.
+    virtual Real scatter_pdf(const HitRecord &, const Vec3 &) const { return 0; }
+
     virtual bool scatter(const Ray &r_in, const HitRecord &rec, Color &attenuation,
-                         Ray &scattered) const {
+                         Ray &scattered, Sampler &sampler) const {
         return false;
     }
+
+    protected:
+    explicit Material(MaterialKind kind) : material_kind(kind) {}
+
+    private:
+    MaterialKind material_kind = MaterialKind::Other;
 };
 
-class Lambertian : public Material {
+class Lambertian final : public Material {
     public:
     Color albedo;
-    Lambertian(const Color &a) : albedo(a) {}
+    Lambertian(const Color &a) : Material(MaterialKind::Lambertian), albedo(a) {}
+
+    const char *type_name() const override { return "Lambertian"; }
+    Color surface_albedo() const override { return albedo; }
+
+    bool samples_direct_light() const override { return true; }
+
+    Color evaluate(const HitRecord &rec, const Vec3 &direction) const override {
+        return albedo * scatter_pdf(rec, direction);
+    }
+
+    // scatter() picks normal + a unit vector, which is cosine distributed.
+    Real scatter_pdf(const HitRecord &rec, const Vec3 &direction) const override {
+        Real cosine = dot(rec.normal, unit_vector(direction));
+        return cosine > 0 ? cosine / pi : 0;
+    }
 
     bool scatter(const Ray &r_in, const HitRecord &rec, Color &attenuation,
-                 Ray &scattered) const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+                 Ray &scattered, Sampler &sampler) const override {
+        auto [u, v] = sampler.next_2d();
+        auto scatter_direction = rec.normal + sample_unit_vector(u, v);
 
         // Catch degenerate scatter direction
         if (scatter_direction.near_zero())
             scatter_direction = rec.normal;
 
-        scattered = Ray(rec.p, scatter_direction);
+        scattered = Ray(offset_ray_origin(rec.p, rec.normal, rec.p_error, scatter_direction),
+                        scatter_direction);
         attenuation = albedo;
         return true;
     }
 };
 
-class Metal : public Material {
+class Metal final : public Material {
     private:
     Color albedo;
-    double fuzz;
+    Real fuzz;
     public:
-    Metal(const Color &albedo, double fuzz=0) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+    Metal(const Color &albedo, Real fuzz=0)
+        : Material(MaterialKind::Metal), albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+
+    const char *type_name() const override { return "Metal"; }
+    Color surface_albedo() const override { return albedo; }
+    bool is_specular() const override { return fuzz < Real(0.1); }
+
+    const Color &get_albedo() const { return albedo; }
+    Real get_fuzz() const { return fuzz; }
 
     bool scatter(const Ray &r_in, const HitRecord &rec, Color &attenuation,
-                 Ray &scattered) const override {
+                 Ray &scattered, Sampler &sampler) const override {
         Vec3 reflected = reflect(r_in.direction(), rec.normal);
-        reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-        scattered = Ray(rec.p, reflected);
+        auto [u, v] = sampler.next_2d();
+        reflected = unit_vector(reflected) + (fuzz * sample_unit_vector(u, v));
+        scattered =
+            Ray(offset_ray_origin(rec.p, rec.normal, rec.p_error, reflected), reflected);
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
-};
\ No newline at end of file
+};
+
+/**
+ * @brief Emits `emit` from its front side and absorbs everything that hits it. Spheres and
+ * meshes made of it are lights of a FlatScene, which the camera samples directly (see
+ * LightList).
+ */
+class DiffuseLight final : public Material {
+    public:
+    Color emit;
+    DiffuseLight(const Color &emit) : Material(MaterialKind::DiffuseLight), emit(emit) {}
+
+    const char *type_name() const override { return "DiffuseLight"; }
+    Color surface_albedo() const override { return emit; }
+
+    Color emitted(const HitRecord &rec) const override {
+        return rec.front_face ? emit : Color(0, 0, 0);
+    }
+};
+
+/**
+ * @brief Calls `f` with `mat` as its concrete type if it is one of the closed set of materials,
+ * so `f` is instantiated per type and its calls to the material are direct and can be inlined.
+ * Any other material is passed as a Material and its calls stay virtual.
+ */
+template <typename F> decltype(auto) visit_material(const Material &mat, F &&f) {
+    switch (mat.kind()) {
+    case MaterialKind::Lambertian:
+        return f(static_cast<const Lambertian &>(mat));
+    case MaterialKind::Metal:
+        return f(static_cast<const Metal &>(mat));
+    case MaterialKind::DiffuseLight:
+        return f(static_cast<const DiffuseLight &>(mat));
+    case MaterialKind::Other:
+        break;
+    }
+    return f(mat);
+}
@@ -1,154 +1,251 @@
 #pragma once
 
 
+#include <algorithm>
 #include <cmath>
-#include <random>
+#include <cstdint>
 #include <iostream>
+#include <limits>
+#include <type_traits>
+
+// Scalar type of geometry, rays and colors. Configure with -DRT_FLOAT=ON to trace in single
+// precision, which halves the size of every ray and hit record and doubles the SIMD lane count.
+#ifdef RT_USE_FLOAT
+using Real = float;
+#else
+using Real = double;
+#endif
+
+const Real infinity = std::numeric_limits<Real>::infinity();
+const Real pi = Real(3.1415926535897932385);
+
+inline Real degrees_to_radians(Real degrees) {
+    return degrees * pi / 180;
+}
+
+/**
+ * @brief Small PCG32 generator (O'Neill, pcg-random.org). It is cheap to construct, so each
+ * camera sample gets its own generator seeded from the frame seed, pixel index and sample
+ * index. Nothing is shared between threads and the same seed always yields the same image,
+ * regardless of how the work is scheduled.
+ */
+class Rng {
+  public:
+    Rng(uint64_t seed = 0, uint64_t stream = 0) : state(0), inc((stream << 1u) | 1u) {
+        next_u32();
+        state += seed;
+        next_u32();
+    }
+
+    // Generator for one camera sample. The pixel picks the stream, the sample the seed.
+    static Rng for_sample(uint64_t frame_seed, uint64_t pixel_index, uint64_t sample_index) {
+        return Rng(mix64(frame_seed ^ mix64(sample_index)), pixel_index);
+    }
 
+    uint32_t next_u32() {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = uint32_t(((old_state >> 18u) ^ old_state) >> 27u);
+        uint32_t rot = uint32_t(old_state >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
 
+    // Returns a random real in [0,1).
+    double next_double() {
+        return next_u32() * 0x1p-32;
+    }
 
-const double infinity = std::numeric_limits<double>::infinity();
-const double pi = 3.1415926535897932385;
+    // Returns a random real in [0,1). Only the top 24 bits are used for float, since rounding a
+    // 32 bit value to float can round up to 1.
+    template <typename T> T next_real() {
+        if constexpr (std::is_same_v<T, float>)
+            return (next_u32() >> 8) * 0x1p-24f;
+        else
+            return T(next_double());
+    }
 
-inline double degrees_to_radians(double degrees) {
-    return degrees * pi / 180.0;
-}
+  private:
+    uint64_t state;
+    uint64_t inc;
 
-inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    // SplitMix64 finalizer, used to decorrelate neighbouring seeds.
+    static uint64_t mix64(uint64_t z) {
+        z += 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+};
+
+inline double random_double(Rng &rng) {
+    // Returns a random real in [0,1).
+    return rng.next_double();
 }
 
-inline double random_double(double min, double max) {
+inline double random_double(Rng &rng, double min, double max) {
     // Returns a random real in [min,max).
-    return min + (max-min)*random_double();
+    return min + (max-min)*random_double(rng);
+}
+
+inline Real random_real(Rng &rng) {
+    // Returns a random Real in [0,1).
+    return rng.next_real<Real>();
 }
 
-class Vec3 {
+template <typename T>
+class Vec3T {
   public:
-    double e[3];
+    T e[3];
+
+    Vec3T() : e{0,0,0} {}
+    Vec3T(T e0, T e1, T e2) : e{e0, e1, e2} {}
 
-    Vec3() : e{0,0,0} {}
-    Vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    // Explicit conversion between precisions.
+    template <typename U>
+    explicit Vec3T(const Vec3T<U>& v) : e{T(v.e[0]), T(v.e[1]), T(v.e[2])} {}
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
 
-    Vec3 operator-() const { return Vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    Vec3T operator-() const { return Vec3T(-e[0], -e[1], -e[2]); }
+    T operator[](int i) const { return e[i]; }
+    T& operator[](int i) { return e[i]; }
 
-    Vec3& operator+=(const Vec3& v) {
+    Vec3T& operator+=(const Vec3T& v) {
         e[0] += v.e[0];
         e[1] += v.e[1];
         e[2] += v.e[2];
         return *this;
     }
 
-    Vec3& operator*=(double t) {
+    Vec3T& operator*=(T t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
         return *this;
     }
 
-    Vec3& operator/=(double t) {
+    Vec3T& operator/=(T t) {
         return *this *= 1/t;
     }
 
-    double length() const {
+    T length() const {
         return std::sqrt(length_squared());
     }
 
-    double length_squared() const {
+    T length_squared() const {
         return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
     }
 
     bool near_zero() const {
         // Return true if the vector is close to zero in all dimensions.
-        const auto s = 1e-8;
-        return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
+        const T s = std::is_same_v<T, float> ? T(1e-6) : T(1e-8);
+        return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
     }
 
-    static Vec3 random() {
-        return Vec3(random_double(), random_double(), random_double());
+    static Vec3T random(Rng &rng) {
+        return Vec3T(rng.next_real<T>(), rng.next_real<T>(), rng.next_real<T>());
     }
 
-    static Vec3 random(double min, double max) {
-        return Vec3(random_double(min,max), random_double(min,max), random_double(min,max));
+    static Vec3T random(Rng &rng, T min, T max) {
+        return Vec3T(min + (max - min) * rng.next_real<T>(),
+                     min + (max - min) * rng.next_real<T>(),
+                     min + (max - min) * rng.next_real<T>());
     }
 };
 
+using Vec3 = Vec3T<Real>;
+
 // point3 is just an alias for vec3, but useful for geometric clarity in the code.
 using Point3 = Vec3;
 
 
 // Vector Utility Functions
+//
+// Scalar arguments are not deduced (std::type_identity_t), so `2 * v` or `0.5 * v` work for
+// either precision.
 
-inline std::ostream& operator<<(std::ostream& out, const Vec3& v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const Vec3T<T>& v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline Vec3 operator+(const Vec3& u, const Vec3& v) {
-    return Vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template <typename T>
+inline Vec3T<T> operator+(const Vec3T<T>& u, const Vec3T<T>& v) {
+    return Vec3T<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline Vec3 operator-(const Vec3& u, const Vec3& v) {
-    return Vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template <typename T>
+inline Vec3T<T> operator-(const Vec3T<T>& u, const Vec3T<T>& v) {
+    return Vec3T<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline Vec3 operator*(const Vec3& u, const Vec3& v) {
-    return Vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template <typename T>
+inline Vec3T<T> operator*(const Vec3T<T>& u, const Vec3T<T>& v) {
+    return Vec3T<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline Vec3 operator*(double t, const Vec3& v) {
-    return Vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
+template <typename T>
+inline Vec3T<T> operator*(std::type_identity_t<T> t, const Vec3T<T>& v) {
+    return Vec3T<T>(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline Vec3 operator*(const Vec3& v, double t) {
+template <typename T>
+inline Vec3T<T> operator*(const Vec3T<T>& v, std::type_identity_t<T> t) {
     return t * v;
 }
 
-inline Vec3 operator/(const Vec3& v, double t) {
+template <typename T>
+inline Vec3T<T> operator/(const Vec3T<T>& v, std::type_identity_t<T> t) {
     return (1/t) * v;
 }
 
-inline double dot(const Vec3& u, const Vec3& v) {
+template <typename T>
+inline T dot(const Vec3T<T>& u, const Vec3T<T>& v) {
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
 }
 
-inline Vec3 cross(const Vec3& u, const Vec3& v) {
-    return Vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-                u.e[2] * v.e[0] - u.e[0] * v.e[2],
-                u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+template <typename T>
+inline Vec3T<T> cross(const Vec3T<T>& u, const Vec3T<T>& v) {
+    return Vec3T<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                    u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                    u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline Vec3 unit_vector(const Vec3& v) {
+template <typename T>
+inline Vec3T<T> unit_vector(const Vec3T<T>& v) {
     return v / v.length();
 }
 
-inline Vec3 random_unit_vector() {
-    auto p = Vec3::random(-1,1);
+inline Vec3 random_unit_vector(Rng &rng) {
+    auto p = Vec3::random(rng, -1, 1);
     if (p.length_squared() >= 1) // If the length of the vector is greater than 1, force normalization so that it is a unit vector.
         return unit_vector(p);
     return p;
 }
 
+// Maps a point of the unit square to a point on the unit sphere, uniformly.
+inline Vec3 sample_unit_vector(Real u, Real v) {
+    Real z = 1 - 2 * u;
+    Real r = std::sqrt(std::max(Real(0), 1 - z * z));
+    Real phi = 2 * pi * v;
+    return Vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
 
-inline Vec3 random_on_hemisphere(const Vec3& normal) {
-    Vec3 on_unit_sphere = random_unit_vector();
-    if (dot(on_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
+inline Vec3 random_on_hemisphere(const Vec3& normal, Rng &rng) {
+    Vec3 on_unit_sphere = random_unit_vector(rng);
+    if (dot(on_unit_sphere, normal) > 0) // In the same hemisphere as the normal
         return on_unit_sphere;
     else
         return -on_unit_sphere;
 }
 
 
-inline Vec3 reflect(const Vec3& v, const Vec3& n) {
+template <typename T>
+inline Vec3T<T> reflect(const Vec3T<T>& v, const Vec3T<T>& n) {
     return v - 2*dot(v,n)*n;
 }
 
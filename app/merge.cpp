@@ -0,0 +1,31 @@
+// Merges partial renders of a frame, written by `main --partial`, into the final image.
+//
+// Usage: merge output.(ppm|pfm|png) part.rtpart...
+
+#include "image.hpp"
+#include "partial.hpp"
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: merge output.(ppm|pfm|png) part.rtpart...\n";
+        return 1;
+    }
+
+    std::vector<std::string> parts(argv + 2, argv + argc);
+    try {
+        MergedImage image = merge_partials(parts);
+        write_image(argv[1], image.pixels, image.width, image.height);
+        std::clog << "Merged " << parts.size() << " partial renders into " << argv[1] << ": "
+                  << image.width << "x" << image.height << ", " << image.min_samples;
+        if (image.max_samples != image.min_samples)
+            std::clog << " to " << image.max_samples;
+        std::clog << " samples per pixel\n";
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
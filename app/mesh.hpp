@@ -0,0 +1,208 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "bvh.hpp"
+#include "hittable.hpp"
+#include "interval.hpp"
+#include "math.hpp"
+#include "ray.hpp"
+#include "text_reader.hpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Indexed triangle mesh with its own BVH over the triangles.
+ *
+ * Vertices are stored once and shared between triangles through the index buffer, and there is
+ * no object per triangle: a mesh costs one vertex array, one index array and the BVH nodes.
+ * Shading uses the geometric normal.
+ */
+class TriangleMesh final : public Hittable {
+    public:
+    /**
+     * @brief Takes three indices per triangle into `vertices`. Throws if an index is out of
+     * range.
+     */
+    TriangleMesh(std::vector<Point3> vertices, std::vector<uint32_t> indices,
+                 shared_ptr<Material> mat)
+        : vertices(std::move(vertices)), indices(std::move(indices)), mat(mat) {
+        if (this->indices.size() % 3 != 0) {
+            throw std::runtime_error("TriangleMesh: index count is not a multiple of 3.");
+        }
+        for (uint32_t i : this->indices) {
+            if (i >= this->vertices.size()) {
+                throw std::runtime_error("TriangleMesh: vertex index out of range.");
+            }
+        }
+        build();
+    }
+
+    bool hit(const Ray &r, Interval ray_t, HitRecord &rec) const override {
+        return tree.traverse(r, ray_t, rec,
+                             [this](int tri, const Ray &r, Interval t, HitRecord &rec) {
+                                 return hit_triangle(tri, r, t, rec);
+                             });
+    }
+
+    bool hit_any(const Ray &r, Interval ray_t) const override {
+        return tree.traverse_any(r, ray_t, [this](int tri, const Ray &r, Interval t) {
+            Real root;
+            return intersect_triangle(tri, r, t, root);
+        });
+    }
+
+    AABB bounding_box() const override { return bbox; }
+
+    const std::vector<Point3> &get_vertices() const { return vertices; }
+    const std::vector<uint32_t> &get_indices() const { return indices; }
+    const shared_ptr<Material> &get_material() const { return mat; }
+
+    int triangle_count() const { return (int)(indices.size() / 3); }
+    int node_count() const { return (int)tree.nodes.size(); }
+    double build_seconds() const { return build_time; }
+
+    private:
+    std::vector<Point3> vertices;
+    std::vector<uint32_t> indices; // Three per triangle, ordered to match the BVH leaves.
+    shared_ptr<Material> mat;
+    BVHTree tree;
+    AABB bbox;
+    double build_time = 0;
+
+    void build() {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        std::vector<AABB> bounds;
+        bounds.reserve(triangle_count());
+        for (int tri = 0; tri < triangle_count(); tri++) {
+            const Point3 &v0 = vertices[indices[3 * tri]];
+            const Point3 &v1 = vertices[indices[3 * tri + 1]];
+            const Point3 &v2 = vertices[indices[3 * tri + 2]];
+            bounds.push_back(AABB(AABB(v0, v1), AABB(v2, v2)));
+        }
+        tree.build(bounds);
+
+        // Reorder the triangles to match the leaf order, so leaves index them directly.
+        std::vector<uint32_t> ordered;
+        ordered.reserve(indices.size());
+        for (int tri : tree.indices) {
+            ordered.insert(ordered.end(), indices.begin() + 3 * tri,
+                           indices.begin() + 3 * tri + 3);
+        }
+        indices = std::move(ordered);
+        for (int i = 0; i < (int)tree.indices.size(); i++) {
+            tree.indices[i] = i;
+        }
+
+        bbox = tree.nodes.empty() ? AABB() : tree.nodes[0].bbox;
+
+        auto end = std::chrono::high_resolution_clock::now();
+        build_time = std::chrono::duration<double>(end - start).count();
+    }
+
+    // Möller–Trumbore ray/triangle intersection, sets `t` on a hit in `ray_t`.
+    bool intersect_triangle(int tri, const Ray &r, Interval ray_t, Real &t) const {
+        const Point3 &v0 = vertices[indices[3 * tri]];
+        Vec3 e1 = vertices[indices[3 * tri + 1]] - v0;
+        Vec3 e2 = vertices[indices[3 * tri + 2]] - v0;
+        Vec3 pvec = cross(r.direction(), e2);
+        auto det = dot(e1, pvec);
+        if (det == 0) // Ray parallel to the triangle, or a degenerate triangle
+            return false;
+
+        auto inv_det = 1 / det;
+        Vec3 tvec = r.origin() - v0;
+        auto u = dot(tvec, pvec) * inv_det;
+        if (u < 0 || u > 1)
+            return false;
+
+        Vec3 qvec = cross(tvec, e1);
+        auto v = dot(r.direction(), qvec) * inv_det;
+        if (v < 0 || u + v > 1)
+            return false;
+
+        t = dot(e2, qvec) * inv_det;
+        return ray_t.surrounds(t);
+    }
+
+    bool hit_triangle(int tri, const Ray &r, Interval ray_t, HitRecord &rec) const {
+        Real t;
+        if (!intersect_triangle(tri, r, ray_t, t))
+            return false;
+
+        const Point3 &v0 = vertices[indices[3 * tri]];
+        Vec3 e1 = vertices[indices[3 * tri + 1]] - v0;
+        Vec3 e2 = vertices[indices[3 * tri + 2]] - v0;
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.mat = mat.get();
+        rec.set_face_normal(r, unit_vector(cross(e1, e2)));
+
+        // p = origin + t * direction, so its error scales with the larger of the two.
+        const Point3 &o = r.origin();
+        auto magnitude =
+            std::max({std::fabs(rec.p.x()), std::fabs(rec.p.y()), std::fabs(rec.p.z()),
+                      std::fabs(o.x()), std::fabs(o.y()), std::fabs(o.z())});
+        rec.p_error = magnitude * std::numeric_limits<Real>::epsilon() * 8;
+        return true;
+    }
+};
+
+/**
+ * @brief Loads the triangles of a Wavefront OBJ file.
+ *
+ * Only `v` and `f` records are used: polygons are fan triangulated, negative indices count back
+ * from the last vertex, and texture and normal indices are ignored. Everything else is skipped.
+ * The file is memory mapped and tokenized in place, so there is no allocation per line.
+ */
+inline shared_ptr<TriangleMesh> load_obj(const std::string &path, shared_ptr<Material> mat) {
+    MappedFile file(path);
+    LineReader in(std::string_view(file.data(), file.size()), path);
+
+    std::vector<Point3> vertices;
+    std::vector<uint32_t> indices;
+
+    // Resolves the vertex index at the start of a face token such as "7", "7/2" or "-1//3".
+    auto vertex_index = [&](std::string_view tok) -> uint32_t {
+        int64_t index = 0;
+        auto [end, ec] = std::from_chars(tok.data(), tok.data() + tok.size(), index);
+        if (ec != std::errc() || (end != tok.data() + tok.size() && *end != '/'))
+            in.fail("invalid face index '" + std::string(tok) + "'");
+
+        int64_t resolved = index < 0 ? (int64_t)vertices.size() + index : index - 1;
+        if (index == 0 || resolved < 0 || resolved >= (int64_t)vertices.size())
+            in.fail("face index " + std::to_string(index) + " out of range");
+        return uint32_t(resolved);
+    };
+
+    while (in.next_line()) {
+        std::string_view record = in.token();
+        if (record == "v") {
+            Real x = Real(in.number());
+            Real y = Real(in.number());
+            Real z = Real(in.number());
+            vertices.emplace_back(x, y, z);
+        } else if (record == "f") {
+            uint32_t first = vertex_index(in.token());
+            uint32_t prev = vertex_index(in.token());
+            int count = 2;
+            for (std::string_view tok = in.token(); !tok.empty(); tok = in.token()) {
+                uint32_t current = vertex_index(tok);
+                indices.insert(indices.end(), {first, prev, current});
+                prev = current;
+                count++;
+            }
+            if (count < 3)
+                in.fail("face with fewer than 3 vertices");
+        }
+    }
+
+    return make_shared<TriangleMesh>(std::move(vertices), std::move(indices), mat);
+}
@@ -3,45 +3,89 @@
 #include "hittable.hpp"
 #include "math.hpp"
 #include "ray.hpp"
+#include <algorithm>
 #include <memory>
 
 class Sphere : public Hittable {
     public:
     Point3 center;
-    double radius;
+    Real radius;
     shared_ptr<Material> mat;
     public:
     
-    Sphere(Point3 center, double radius, shared_ptr<Material> mat) : center(center), radius(radius), mat(mat) {};
+    Sphere(Point3 center, Real radius, shared_ptr<Material> mat)
+        : center(center), radius(radius), mat(mat) {};
 
     virtual bool hit(const Ray& r, Interval ray_t, HitRecord& rec) const override{
-        Vec3 oc = center - r.origin();
-        auto a = r.direction().length_squared();
-        auto h = dot(r.direction(), oc);
-        auto c = oc.length_squared() - radius*radius;
+        Real root;
+        if (!intersect(r, center, radius, ray_t, root))
+            return false;
+
+        set_hit_record(r, root, center, radius, mat.get(), rec);
+        return true;
+    }
+
+    bool hit_any(const Ray &r, Interval ray_t) const override {
+        Real root;
+        return intersect(r, center, radius, ray_t, root);
+    }
 
-        auto discriminant = h*h - a*c;
+    /**
+     * @brief Finds the nearest root in `ray_t`, shared by every sphere representation.
+     *
+     * Robust form of the quadratic (Haines et al., "Precision Improvements for Ray/Sphere
+     * Intersection", Ray Tracing Gems): the discriminant is taken from the distance between the
+     * center and the ray instead of h*h - a*c, and the root closer to zero is derived from the
+     * other one as c/q, so neither suffers catastrophic cancellation. This matters in single
+     * precision, where the textbook form makes large spheres speckled.
+     */
+    static bool intersect(const Ray &r, const Point3 &center, Real radius, Interval ray_t,
+                          Real &root) {
+        const Vec3 &d = r.direction();
+        Vec3 oc = center - r.origin();
+        auto a = d.length_squared();
+        auto h = dot(d, oc);
+        Vec3 l = oc - (h / a) * d; // From the closest point on the line to the center
+        auto discriminant = a * (radius * radius - l.length_squared());
         if (discriminant < 0)
             return false;
 
-        auto sqrtd = std::sqrt(discriminant);
+        auto q = h + std::copysign(std::sqrt(discriminant), h);
+        auto c = oc.length_squared() - radius * radius;
+        auto near_root = c / q;
+        auto far_root = q / a;
+        if (far_root < near_root)
+            std::swap(near_root, far_root);
 
         // Find the nearest root that lies in the acceptable range.
-        auto root = (h - sqrtd) / a;
+        root = near_root;
         if (!ray_t.surrounds(root)) {
-            root = (h + sqrtd) / a;
+            root = far_root;
             if (!ray_t.surrounds(root))
                 return false;
         }
+        return true;
+    }
 
+    // Fills in the record for a hit at `root`. Shared with FlatScene so both produce identical
+    // records.
+    static void set_hit_record(const Ray &r, Real root, const Point3 &center, Real radius,
+                               const Material *mat, HitRecord &rec) {
         rec.t = root;
         rec.p = r.at(rec.t);
         rec.mat = mat;
         Vec3 outward_normal = (rec.p - center) / radius;
         rec.set_face_normal(r, outward_normal);
 
-        return true;
+        // The error of p scales with the largest numbers that went into it, which for a big
+        // sphere are its center and radius rather than p itself.
+        auto magnitude = std::max({std::fabs(center.x()), std::fabs(center.y()),
+                                   std::fabs(center.z())}) + radius;
+        rec.p_error = magnitude * std::numeric_limits<Real>::epsilon() * 8;
     }
 
-    
+    AABB bounding_box() const override {
+        auto rvec = Vec3(radius, radius, radius);
+        return AABB(center - rvec, center + rvec);
+    }
 };
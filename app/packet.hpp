@@ -0,0 +1,154 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "hit_record.hpp"
+#include "math.hpp"
+#include "ray.hpp"
+#include <type_traits>
+
+#if !defined(RT_NO_SIMD) && __has_include(<experimental/simd>)
+#include <experimental/simd>
+#define RT_PACKET_SIMD 1
+#else
+#define RT_PACKET_SIMD 0
+#endif
+
+#if RT_PACKET_SIMD
+// The native ABI when a packet fits a SIMD register, otherwise (double without AVX) fixed_size,
+// which the library emulates with scalars or register pairs.
+using PacketReals =
+    std::experimental::simd<Real, std::experimental::simd_abi::deduce_t<Real, packet_size>>;
+using PacketMask = PacketReals::mask_type;
+constexpr bool packet_lanes_native = !std::is_same_v<
+    PacketReals::abi_type, std::experimental::simd_abi::fixed_size<packet_size>>;
+
+/**
+ * @brief The rays of a packet spread over SIMD lanes, one ray per lane, so the whole packet is
+ * tested against one box or primitive at a time. Inactive lanes repeat the first ray.
+ */
+struct PacketLanes {
+    PacketReals ox, oy, oz, dx, dy, dz;
+    PacketReals inv_dx, inv_dy, inv_dz;
+    PacketReals a; // Squared length of each direction
+
+    explicit PacketLanes(const RayPacket &packet) {
+        for (int lane = 0; lane < packet_size; lane++) {
+            const Ray &r = packet.rays[lane < packet.count ? lane : 0];
+            ox[lane] = r.origin().x();
+            oy[lane] = r.origin().y();
+            oz[lane] = r.origin().z();
+            dx[lane] = r.direction().x();
+            dy[lane] = r.direction().y();
+            dz[lane] = r.direction().z();
+        }
+        inv_dx = 1 / dx;
+        inv_dy = 1 / dy;
+        inv_dz = 1 / dz;
+        a = dx * dx + dy * dy + dz * dz;
+    }
+
+    // Mask of the lanes whose bit is set in `bits`.
+    static PacketMask mask_of(unsigned bits) {
+        bool lanes[packet_size];
+        for (int lane = 0; lane < packet_size; lane++) {
+            lanes[lane] = (bits >> lane) & 1;
+        }
+        return PacketMask(lanes, std::experimental::element_aligned);
+    }
+
+    // Mask of the first `count` lanes.
+    static PacketMask active_mask(int count) { return mask_of((1u << count) - 1); }
+
+    /**
+     * @brief AABB::hit for every lane of `active`, within (t_min, closest) of each lane, as a
+     * bit per lane. Each axis can only narrow the interval, so checking it once after all three
+     * axes gives the answer of the scalar test, which stops at the first axis that empties it.
+     * Without native lanes the emulation is slower than testing the lanes one by one, so it
+     * does that instead.
+     */
+    unsigned hit_box(const AABB &box, Real t_min, PacketMask active,
+                     const PacketReals &closest) const {
+        namespace stdx = std::experimental;
+        if constexpr (!packet_lanes_native) {
+            unsigned bits = 0;
+            for (int lane = 0; lane < packet_size; lane++) {
+                if (active[lane] &&
+                    box.hit(Point3(ox[lane], oy[lane], oz[lane]),
+                            Vec3(inv_dx[lane], inv_dy[lane], inv_dz[lane]),
+                            Interval(t_min, closest[lane])))
+                    bits |= 1u << lane;
+            }
+            return bits;
+        }
+
+        PacketReals lo = t_min;
+        PacketReals hi = closest;
+        auto slab = [&](const Interval &ax, const PacketReals &o, const PacketReals &inv) {
+            PacketReals t0 = (ax.min - o) * inv;
+            PacketReals t1 = (ax.max - o) * inv;
+            auto swapped = t0 > t1;
+            PacketReals t0_copy = t0;
+            stdx::where(swapped, t0) = t1;
+            stdx::where(swapped, t1) = t0_copy;
+            stdx::where(t0 > lo, lo) = t0;
+            stdx::where(t1 < hi, hi) = t1;
+        };
+        slab(box.x, ox, inv_dx);
+        slab(box.y, oy, inv_dy);
+        slab(box.z, oz, inv_dz);
+
+        auto hit = active && !(hi <= lo);
+        unsigned bits = 0;
+        for (int lane = 0; lane < packet_size; lane++) {
+            if (hit[lane])
+                bits |= 1u << lane;
+        }
+        return bits;
+    }
+
+    /**
+     * @brief Sphere::intersect for every lane of `active`, with the same floating point
+     * operations in the same order, so the roots are bit-identical. Lanes that hit the sphere
+     * in (t_min, closest_so_far) have closest_so_far set to the root, and are returned.
+     */
+    PacketMask hit_sphere(const Point3 &center, Real radius, Real t_min, PacketMask active,
+                          PacketReals &closest_so_far) const {
+        namespace stdx = std::experimental;
+        PacketReals ocx = center.x() - ox;
+        PacketReals ocy = center.y() - oy;
+        PacketReals ocz = center.z() - oz;
+        PacketReals h = dx * ocx + dy * ocy + dz * ocz;
+        PacketReals s = h / a;
+        PacketReals lx = ocx - s * dx;
+        PacketReals ly = ocy - s * dy;
+        PacketReals lz = ocz - s * dz;
+        const PacketReals r2 = radius * radius;
+
+        PacketReals discriminant = a * (r2 - (lx * lx + ly * ly + lz * lz));
+        auto valid = active && discriminant >= 0;
+        if (stdx::none_of(valid))
+            return valid;
+
+        PacketReals sqrtd = stdx::sqrt(stdx::max(discriminant, PacketReals(0)));
+        PacketReals q = h + stdx::copysign(sqrtd, h);
+        PacketReals c = (ocx * ocx + ocy * ocy + ocz * ocz) - r2;
+
+        PacketReals root = c / q;
+        PacketReals far_root = q / a;
+        auto swapped = far_root < root;
+        PacketReals near_copy = root;
+        stdx::where(swapped, root) = far_root;
+        stdx::where(swapped, far_root) = near_copy;
+
+        const PacketReals t_min_lanes = t_min;
+        auto near_ok = valid && t_min_lanes < root && root < closest_so_far;
+        auto far_ok =
+            valid && !near_ok && t_min_lanes < far_root && far_root < closest_so_far;
+        stdx::where(far_ok, root) = far_root;
+
+        auto ok = near_ok || far_ok;
+        stdx::where(ok, closest_so_far) = root;
+        return ok;
+    }
+};
+#endif
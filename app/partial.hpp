@@ -0,0 +1,367 @@
+#pragma once
+
+#include "camera.hpp"
+#include "flat_scene.hpp"
+#include "hittable.hpp"
+#include "math.hpp"
+#include "scheduler.hpp"
+#include "text_reader.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Partial renders let several processes share a frame. Each renders a range of tiles and/or a
+// range of sample indices and writes a .rtpart file: a PartialHeader followed by one FixedColor
+// sum per pixel of its tiles, tile by tile in make_tiles order and row by row within a tile.
+// merge_partials adds the sums up and divides by the samples each pixel received.
+//
+// Samples draw their random numbers from (seed, pixel, sample index), so a sample is the same
+// in whichever process traces it, and the fixed point sums make merging exact: any split of the
+// same tiles and samples merges into bit-identical images.
+
+/**
+ * @brief Sum of color samples in 32.32 fixed point. Each sample is rounded once when it is
+ * added, and integer addition is associative, so the same samples sum to the same bits in any
+ * grouping.
+ */
+struct FixedColor {
+    static constexpr double one = 0x1p32;
+
+    int64_t v[3] = {0, 0, 0};
+
+    FixedColor &operator+=(const Color &c) {
+        for (int k = 0; k < 3; k++) {
+            v[k] += std::llround(double(c[k]) * one);
+        }
+        return *this;
+    }
+
+    FixedColor &operator+=(const FixedColor &other) {
+        for (int k = 0; k < 3; k++) {
+            v[k] += other.v[k];
+        }
+        return *this;
+    }
+
+    // The sum divided by `samples`.
+    Color mean(int samples) const {
+        double scale = 1.0 / (one * samples);
+        return Color(Real(v[0] * scale), Real(v[1] * scale), Real(v[2] * scale));
+    }
+};
+
+struct PartialHeader {
+    char magic[8]; // "RTPART\0\0"
+    uint32_t version;
+    int32_t image_width;
+    int32_t image_height;
+    int32_t tile_size;
+    uint64_t seed;
+    int32_t first_tile;
+    int32_t end_tile;
+    int32_t first_sample;
+    int32_t sample_count;
+    int32_t sampler;         // SamplerType
+    int32_t pattern_samples; // Samples per pixel of the stratified pattern, 0 for the others
+    uint64_t settings_hash;  // partial_settings_hash of the camera
+    uint64_t scene_hash;     // partial_scene_hash of the world
+};
+
+static_assert(sizeof(PartialHeader) == 72, "Partial render header must have no padding.");
+static_assert(sizeof(FixedColor) == 24, "Partial render pixels must have no padding.");
+
+inline constexpr char partial_magic[8] = {'R', 'T', 'P', 'A', 'R', 'T', '\0', '\0'};
+inline constexpr uint32_t partial_version = 3;
+
+/**
+ * @brief 64-bit FNV-1a hash of the values that identify a frame. Values are hashed by their
+ * bytes, so partials only match when rendered by builds with the same precision.
+ */
+class FrameHash {
+    public:
+    void add_bytes(const void *data, size_t size) {
+        auto bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 0x100000001b3;
+        }
+    }
+
+    template <typename T> void add(const T &value) {
+        static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T>);
+        add_bytes(&value, sizeof(value));
+    }
+
+    void add(const Vec3 &v) {
+        for (int k = 0; k < 3; k++) {
+            add(v[k]);
+        }
+    }
+
+    uint64_t value() const { return hash; }
+
+    private:
+    uint64_t hash = 0xcbf29ce484222325;
+};
+
+/**
+ * @brief Hash of the camera settings that change a frame other than those the header records:
+ * the view, the path length and its termination, the sky and next-event estimation.
+ */
+inline uint64_t partial_settings_hash(const Camera &cam) {
+    FrameHash h;
+    h.add(sizeof(Real));
+    h.add(cam.aspect_ratio);
+    h.add(cam.max_depth);
+    h.add(cam.vfov);
+    h.add(cam.lookfrom);
+    h.add(cam.lookat);
+    h.add(cam.vup);
+    h.add(cam.russian_roulette);
+    h.add(cam.roulette_min_depth);
+    h.add(cam.min_throughput);
+    h.add(cam.sky);
+    h.add(cam.next_event_estimation);
+    return h.value();
+}
+
+/**
+ * @brief Hash of the geometry and materials of a FlatScene, meshes and instances included.
+ * Other worlds are opaque, only their bounding box is hashed.
+ */
+inline uint64_t partial_scene_hash(const Hittable &world) {
+    FrameHash h;
+    auto add_box = [&](const AABB &box) {
+        for (int axis = 0; axis < 3; axis++) {
+            h.add(box.axis_interval(axis).min);
+            h.add(box.axis_interval(axis).max);
+        }
+    };
+    auto flat = dynamic_cast<const FlatScene *>(&world);
+    if (!flat) {
+        add_box(world.bounding_box());
+        return h.value();
+    }
+    auto add_mesh = [&](const TriangleMesh &mesh) {
+        const auto &vertices = mesh.get_vertices();
+        const auto &indices = mesh.get_indices();
+        h.add(vertices.size());
+        h.add_bytes(vertices.data(), vertices.size() * sizeof(Point3));
+        h.add(indices.size());
+        h.add_bytes(indices.data(), indices.size() * sizeof(uint32_t));
+    };
+
+    h.add(flat->materials.size());
+    for (const auto &mat : flat->materials) {
+        h.add(mat.index());
+        if (auto lambertian = std::get_if<Lambertian>(&mat)) {
+            h.add(lambertian->albedo);
+        } else if (auto metal = std::get_if<Metal>(&mat)) {
+            h.add(metal->get_albedo());
+            h.add(metal->get_fuzz());
+        } else if (auto light = std::get_if<DiffuseLight>(&mat)) {
+            h.add(light->emit);
+        }
+    }
+    h.add(flat->spheres.size());
+    for (const auto &s : flat->spheres) {
+        h.add(s.center);
+        h.add(s.radius);
+        h.add(s.mat_id);
+    }
+    h.add(flat->meshes.size());
+    for (const auto &m : flat->meshes) {
+        add_mesh(*m.mesh);
+        h.add(m.mat_id);
+    }
+    h.add(flat->instance_objects.size());
+    for (const auto &object : flat->instance_objects) {
+        if (auto mesh = dynamic_cast<const TriangleMesh *>(object.get()))
+            add_mesh(*mesh);
+        else
+            add_box(object->bounding_box());
+    }
+    h.add(flat->instances.size());
+    for (const auto &inst : flat->instances) {
+        h.add_bytes(inst.to_object.m, sizeof(inst.to_object.m));
+        h.add(inst.object);
+        h.add(inst.mat_id);
+    }
+    return h.value();
+}
+
+/**
+ * @brief Renders samples [first_sample, first_sample + sample_count) of the tiles
+ * [first_tile, end_tile) and writes them to a partial render file. end_tile -1 renders to the
+ * last tile.
+ */
+inline void render_partial(Camera &cam, const Hittable &world, int first_tile, int end_tile,
+                           int first_sample, int sample_count, const std::string &path) {
+    int width = cam.image_width;
+    int height = cam.get_image_height();
+    std::vector<Tile> tiles = make_tiles(width, height, cam.tile_size);
+    if (end_tile < 0)
+        end_tile = (int)tiles.size();
+    if (first_sample < 0 || sample_count < 1) {
+        throw std::runtime_error("Partial render needs a non-empty sample range.");
+    }
+
+    std::vector<FixedColor> sums(size_t(width) * height);
+    cam.add_samples(world, first_sample, sample_count, sums, first_tile, end_tile);
+
+    PartialHeader header{};
+    std::memcpy(header.magic, partial_magic, sizeof(header.magic));
+    header.version = partial_version;
+    header.image_width = width;
+    header.image_height = height;
+    header.tile_size = cam.tile_size;
+    header.seed = cam.seed;
+    header.first_tile = first_tile;
+    header.end_tile = end_tile;
+    header.first_sample = first_sample;
+    header.sample_count = sample_count;
+    header.sampler = int32_t(cam.sampler_type);
+    header.pattern_samples =
+        cam.sampler_type == SamplerType::Stratified ? cam.samples_per_pixel : 0;
+    header.settings_hash = partial_settings_hash(cam);
+    header.scene_hash = partial_scene_hash(world);
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Could not open partial render file " + path +
+                                 " for writing.");
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (int t = first_tile; t < end_tile; t++) {
+        const Tile &tile = tiles[t];
+        for (int j = tile.y0; j < tile.y1; j++) {
+            out.write(reinterpret_cast<const char *>(&sums[size_t(j) * width + tile.x0]),
+                      sizeof(FixedColor) * (tile.x1 - tile.x0));
+        }
+    }
+    if (!out) {
+        throw std::runtime_error("Failed to write partial render file " + path + ".");
+    }
+}
+
+/**
+ * @brief Image merged from partial renders.
+ */
+struct MergedImage {
+    std::vector<Color> pixels;
+    int width = 0;
+    int height = 0;
+    int min_samples = 0; // Fewest and most samples any pixel received
+    int max_samples = 0;
+};
+
+/**
+ * @brief Merges partial render files of one frame. Throws if they disagree on the image size,
+ * tiles, seed, sample pattern, camera settings or scene, if two of them cover the same sample
+ * of a tile, or if a tile is not covered.
+ */
+inline MergedImage merge_partials(const std::vector<std::string> &paths) {
+    if (paths.empty()) {
+        throw std::runtime_error("No partial renders to merge.");
+    }
+
+    MergedImage image;
+    PartialHeader frame{};
+    std::vector<Tile> tiles;
+    std::vector<FixedColor> sums;
+    std::vector<int> samples;
+    // Sample ranges each tile received, to catch overlapping partials.
+    std::vector<std::vector<std::pair<int, int>>> tile_samples;
+
+    for (const auto &path : paths) {
+        MappedFile file(path);
+        PartialHeader header;
+        if (file.size() < sizeof(header)) {
+            throw std::runtime_error(path + ": partial render file is truncated.");
+        }
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (std::memcmp(header.magic, partial_magic, sizeof(header.magic)) != 0 ||
+            header.version != partial_version) {
+            throw std::runtime_error(path +
+                                     ": not a partial render, or an unsupported version.");
+        }
+
+        if (tiles.empty()) {
+            frame = header;
+            if (header.image_width < 1 || header.image_height < 1) {
+                throw std::runtime_error(path + ": invalid image size.");
+            }
+            tiles = make_tiles(header.image_width, header.image_height, header.tile_size);
+            sums.resize(size_t(header.image_width) * header.image_height);
+            samples.resize(sums.size());
+            tile_samples.resize(tiles.size());
+        } else if (header.image_width != frame.image_width ||
+                   header.image_height != frame.image_height ||
+                   header.tile_size != frame.tile_size || header.seed != frame.seed ||
+                   header.sampler != frame.sampler ||
+                   header.pattern_samples != frame.pattern_samples ||
+                   header.settings_hash != frame.settings_hash ||
+                   header.scene_hash != frame.scene_hash) {
+            throw std::runtime_error(path + ": partial render of a different frame.");
+        }
+        if (header.first_tile < 0 || header.first_tile > header.end_tile ||
+            header.end_tile > (int)tiles.size() || header.sample_count < 1) {
+            throw std::runtime_error(path + ": invalid tile or sample range.");
+        }
+
+        size_t pixel_count = 0;
+        for (int t = header.first_tile; t < header.end_tile; t++) {
+            pixel_count += tiles[t].pixel_count();
+        }
+        if (file.size() != sizeof(header) + pixel_count * sizeof(FixedColor)) {
+            throw std::runtime_error(path + ": file size does not match its header.");
+        }
+
+        const char *data = file.data() + sizeof(header);
+        for (int t = header.first_tile; t < header.end_tile; t++) {
+            const Tile &tile = tiles[t];
+            tile_samples[t].emplace_back(header.first_sample,
+                                         header.first_sample + header.sample_count);
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    FixedColor sum;
+                    std::memcpy(&sum, data, sizeof(sum));
+                    data += sizeof(sum);
+                    sums[size_t(j) * frame.image_width + i] += sum;
+                    samples[size_t(j) * frame.image_width + i] += header.sample_count;
+                }
+            }
+        }
+    }
+
+    for (size_t t = 0; t < tiles.size(); t++) {
+        auto &ranges = tile_samples[t];
+        if (ranges.empty()) {
+            throw std::runtime_error("Tile " + std::to_string(t) + " is in no partial render.");
+        }
+        std::sort(ranges.begin(), ranges.end());
+        for (size_t r = 1; r < ranges.size(); r++) {
+            if (ranges[r].first < ranges[r - 1].second) {
+                throw std::runtime_error("Tile " + std::to_string(t) +
+                                         " has overlapping sample ranges.");
+            }
+        }
+    }
+
+    image.width = frame.image_width;
+    image.height = frame.image_height;
+    image.pixels.resize(sums.size());
+    auto [min_samples, max_samples] = std::minmax_element(samples.begin(), samples.end());
+    image.min_samples = *min_samples;
+    image.max_samples = *max_samples;
+    for (size_t p = 0; p < sums.size(); p++) {
+        image.pixels[p] = sums[p].mean(samples[p]);
+    }
+    return image;
+}
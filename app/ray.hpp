@@ -2,20 +2,35 @@
 
 #include "math.hpp"
 
-class Ray {
+template <typename T>
+class RayT {
     public:
-      Ray() {}
+      RayT() {}
   
-      Ray(const Point3& origin, const Vec3& direction) : orig(origin), dir(direction) {}
+      RayT(const Vec3T<T>& origin, const Vec3T<T>& direction) : orig(origin), dir(direction) {}
   
-      const Point3& origin() const  { return orig; }
-      const Vec3& direction() const { return dir; }
+      const Vec3T<T>& origin() const  { return orig; }
+      const Vec3T<T>& direction() const { return dir; }
   
-      Point3 at(double t) const {
+      Vec3T<T> at(T t) const {
           return orig + t*dir;
       }
   
     private:
-      Point3 orig;
-      Vec3 dir;
-  };
\ No newline at end of file
+      Vec3T<T> orig;
+      Vec3T<T> dir;
+  };
+
+using Ray = RayT<Real>;
+
+/**
+ * @brief Origin for a ray leaving a surface at `p` in direction `dir`: `p` pushed off the
+ * surface along the normal `n` by `error`, the bound on the error of `p` reported by the
+ * primitive. A fixed epsilon is too small for points computed from large coordinates (and in
+ * single precision), so the new ray would hit its own surface again and cause acne.
+ */
+template <typename T>
+inline Vec3T<T> offset_ray_origin(const Vec3T<T> &p, const Vec3T<T> &n, T error,
+                                  const Vec3T<T> &dir) {
+    return dot(dir, n) < 0 ? p - error * n : p + error * n;
+}
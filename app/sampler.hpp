@@ -0,0 +1,369 @@
+#pragma once
+
+#include "math.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Sample patterns for the pixel jitter and the scatter directions of the materials. Every
+// pattern is a function of the frame seed, pixel, sample index and dimension, so renders stay
+// deterministic however the work is split. One-off decisions such as Russian roulette always
+// use the sample's random stream.
+enum class SamplerType : uint8_t {
+    Independent, // Uniform random numbers
+    Stratified,  // Correlated multi-jittered samples over the spp strata (Kensler 2013)
+    Sobol,       // Sobol (0,2) sequence with hash-based Owen scrambling (Burley 2020)
+    BlueNoise,   // Sobol points shared by all pixels, shifted per pixel by a blue-noise tile
+};
+
+inline const char *sampler_name(SamplerType type) {
+    switch (type) {
+    case SamplerType::Independent:
+        return "independent";
+    case SamplerType::Stratified:
+        return "stratified";
+    case SamplerType::Sobol:
+        return "sobol";
+    case SamplerType::BlueNoise:
+        return "blue_noise";
+    }
+    return "unknown";
+}
+
+inline SamplerType parse_sampler(const std::string &name) {
+    for (auto type : {SamplerType::Independent, SamplerType::Stratified, SamplerType::Sobol,
+                      SamplerType::BlueNoise}) {
+        if (name == sampler_name(type))
+            return type;
+    }
+    throw std::runtime_error("Unknown sampler '" + name +
+                             "', use independent, stratified, sobol or blue_noise.");
+}
+
+/**
+ * @brief Tileable 64x64 blue-noise texture with values evenly spread over [0,1), made with the
+ * void-and-cluster method (Ulichney 1993). Neighbouring texels have very different values, so
+ * per-pixel offsets taken from it push the sampling error to high frequencies, where it is much
+ * less visible than white noise. Built once, on first use.
+ */
+class BlueNoiseTile {
+    public:
+    static constexpr int size = 64;
+
+    static const BlueNoiseTile &get() {
+        static const BlueNoiseTile tile;
+        return tile;
+    }
+
+    // Wraps around in both directions.
+    Real value(int x, int y) const {
+        return values[(y & (size - 1)) * size + (x & (size - 1))];
+    }
+
+    private:
+    std::vector<Real> values;
+
+    BlueNoiseTile() {
+        constexpr int n = size * size;
+        constexpr double sigma = 1.5;
+
+        // Gaussian energy of a point at each toroidal offset.
+        std::vector<double> kernel(n);
+        for (int dy = 0; dy < size; dy++) {
+            for (int dx = 0; dx < size; dx++) {
+                int x = std::min(dx, size - dx);
+                int y = std::min(dy, size - dy);
+                kernel[dy * size + dx] = std::exp(-(x * x + y * y) / (2 * sigma * sigma));
+            }
+        }
+
+        std::vector<uint8_t> on(n, 0);
+        std::vector<double> energy(n, 0);
+        auto set = [&](int p, bool value) {
+            on[p] = value;
+            double sign = value ? 1 : -1;
+            int px = p % size, py = p / size;
+            for (int y = 0; y < size; y++) {
+                const double *row = &kernel[((y - py) & (size - 1)) * size];
+                for (int x = 0; x < size; x++) {
+                    energy[y * size + x] += sign * row[(x - px) & (size - 1)];
+                }
+            }
+        };
+        // Densest point of the pattern, and the emptiest spot outside it.
+        auto tightest_cluster = [&] {
+            int best = -1;
+            for (int p = 0; p < n; p++) {
+                if (on[p] && (best < 0 || energy[p] > energy[best]))
+                    best = p;
+            }
+            return best;
+        };
+        auto largest_void = [&] {
+            int best = -1;
+            for (int p = 0; p < n; p++) {
+                if (!on[p] && (best < 0 || energy[p] < energy[best]))
+                    best = p;
+            }
+            return best;
+        };
+
+        // Initial pattern: random points, relaxed by moving the tightest cluster to the largest
+        // void until that no longer changes anything.
+        int initial = n / 10;
+        Rng rng(1);
+        for (int placed = 0; placed < initial;) {
+            int p = int(rng.next_u32() % n);
+            if (!on[p]) {
+                set(p, true);
+                placed++;
+            }
+        }
+        for (int step = 0; step < n; step++) {
+            int cluster = tightest_cluster();
+            set(cluster, false);
+            int hole = largest_void();
+            set(hole, true);
+            if (hole == cluster)
+                break;
+        }
+
+        // Rank the initial points by removing the tightest cluster first, then fill the rest of
+        // the tile by adding the largest void first.
+        std::vector<int> rank(n);
+        auto initial_on = on;
+        auto initial_energy = energy;
+        for (int r = initial - 1; r >= 0; r--) {
+            int cluster = tightest_cluster();
+            set(cluster, false);
+            rank[cluster] = r;
+        }
+        on = std::move(initial_on);
+        energy = std::move(initial_energy);
+        for (int r = initial; r < n; r++) {
+            int hole = largest_void();
+            set(hole, true);
+            rank[hole] = r;
+        }
+
+        values.resize(n);
+        for (int p = 0; p < n; p++) {
+            values[p] = Real((rank[p] + 0.5) / n);
+        }
+    }
+};
+
+/**
+ * @brief Two sample values in [0,1).
+ */
+struct Sample2D {
+    Real u;
+    Real v;
+};
+
+/**
+ * @brief Sample source of one camera sample. Each next_2d call is a new dimension of the
+ * pattern: the first is the pixel jitter, then one per bounce. next_1d draws from the sample's
+ * random stream, whatever the pattern.
+ */
+class Sampler {
+    public:
+    Sampler() = default;
+
+    /**
+     * @param sample_count Samples per pixel the stratified pattern is laid out for. Later
+     * samples start new sets of strata.
+     */
+    Sampler(SamplerType type, uint64_t frame_seed, int i, int j, uint64_t pixel_index,
+            uint32_t sample_index, uint32_t sample_count)
+        : rng(Rng::for_sample(frame_seed, pixel_index, sample_index)), type(type),
+          sample(sample_index), sample_count(std::max(sample_count, 1U)), x(i), y(j) {
+        uint32_t frame = uint32_t(frame_seed) ^ hash(uint32_t(frame_seed >> 32));
+        // Blue noise shares the sequence between pixels, the others decorrelate them.
+        seed = type == SamplerType::BlueNoise ? hash(frame)
+                                              : hash(frame, uint32_t(pixel_index));
+    }
+
+    Real next_1d() { return random_real(rng); }
+
+    Sample2D next_2d() {
+        uint32_t dim = dimension++;
+        switch (type) {
+        case SamplerType::Independent:
+            break;
+        case SamplerType::Stratified:
+            return stratified(dim);
+        case SamplerType::Sobol:
+            return sobol(sample, hash(seed, dim));
+        case SamplerType::BlueNoise:
+            return blue_noise(dim);
+        }
+        Real u = random_real(rng);
+        Real v = random_real(rng);
+        return Sample2D{u, v};
+    }
+
+    private:
+    Rng rng;
+    SamplerType type = SamplerType::Independent;
+    uint32_t seed = 0;        // Scrambling seed of the pixel's pattern
+    uint32_t sample = 0;
+    uint32_t sample_count = 1;
+    uint32_t dimension = 0;
+    int x = 0, y = 0;         // Pixel, for the blue-noise tile
+
+    // Integer hash with good avalanche (Wellons' lowbias32).
+    static uint32_t hash(uint32_t x) {
+        x ^= x >> 16;
+        x *= 0x7feb352dU;
+        x ^= x >> 15;
+        x *= 0x846ca68bU;
+        x ^= x >> 16;
+        return x;
+    }
+
+    static uint32_t hash(uint32_t a, uint32_t b) { return hash(a ^ (hash(b) + 0x9e3779b9U)); }
+
+    static uint32_t reverse_bits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+        x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+        x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Owen scrambling of the bits of x, from the most significant down (Burley 2020).
+    static uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+        x = reverse_bits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cU;
+        x ^= x * 0xb82f1e52U;
+        x ^= x * 0xc7afe638U;
+        x ^= x * 0x8d22f6e6U;
+        return reverse_bits(x);
+    }
+
+    // The first two dimensions of the Sobol sequence, as 32 bit fractions.
+    static uint32_t sobol0(uint32_t i) { return reverse_bits(i); }
+
+    // The second dimension is linear in the bits of i, so it is the XOR of one table entry per
+    // byte of i. Scrambled indices have all 32 bits set at random, which makes the bit by bit
+    // loop slow.
+    static uint32_t sobol1(uint32_t i) {
+        static constexpr auto tables = [] {
+            std::array<std::array<uint32_t, 256>, 4> t{};
+            for (int byte = 0; byte < 4; byte++) {
+                for (uint32_t b = 0; b < 256; b++) {
+                    uint32_t r = 0;
+                    uint32_t v = 1U << 31;
+                    for (int bit = 0; bit < 8 * byte; bit++) {
+                        v ^= v >> 1;
+                    }
+                    for (uint32_t bits = b; bits; bits >>= 1, v ^= v >> 1) {
+                        if (bits & 1)
+                            r ^= v;
+                    }
+                    t[byte][b] = r;
+                }
+            }
+            return t;
+        }();
+        return tables[0][i & 255] ^ tables[1][(i >> 8) & 255] ^ tables[2][(i >> 16) & 255] ^
+               tables[3][i >> 24];
+    }
+
+    // Permutation of [0, l) selected by p (Kensler 2013).
+    static uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+        uint32_t w = l - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do {
+            i ^= p;
+            i *= 0xe170893dU;
+            i ^= p >> 16;
+            i ^= (i & w) >> 4;
+            i ^= p >> 8;
+            i *= 0x0929eb3fU;
+            i ^= p >> 23;
+            i ^= (i & w) >> 1;
+            i *= 1 | p >> 27;
+            i *= 0x6935fa69U;
+            i ^= (i & w) >> 11;
+            i *= 0x74dcb303U;
+            i ^= (i & w) >> 2;
+            i *= 0x9e501cc3U;
+            i ^= (i & w) >> 2;
+            i *= 0xc860a3dfU;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= l);
+        return (i + p) % l;
+    }
+
+    // 32 bit fraction to a Real in [0,1). Only the top 24 bits are used for float, see Rng.
+    static Real to_unit(uint32_t x) {
+        if constexpr (std::is_same_v<Real, float>)
+            return (x >> 8) * 0x1p-24f;
+        else
+            return x * 0x1p-32;
+    }
+
+    // Clamps x in [0,1] to the largest Real below 1.
+    static Real below_one(double x) {
+        return std::min(Real(x), Real(1) - std::numeric_limits<Real>::epsilon() / 2);
+    }
+
+    // Correlated multi-jittered point `sample` of a set of sample_count (Kensler 2013), with
+    // the strata shuffled differently for every dimension and set. Each coordinate picks one of
+    // the m * n fine strata of its axis: the sample's column or row, then the other one within
+    // it.
+    Sample2D stratified(uint32_t dim) const {
+        uint32_t count = sample_count;
+        uint32_t p = hash(hash(seed, dim), sample / count);
+        uint32_t s = sample % count;
+        uint32_t m = std::max(1U, uint32_t(std::sqrt(double(count)))); // Columns
+        uint32_t n = (count + m - 1) / m;                                // Rows
+
+        s = permute(s, count, p * 0x51633e2dU);
+        uint32_t sx = permute(s % m, m, p * 0x68bc21ebU);
+        uint32_t sy = permute(s / m, n, p * 0x02e5be93U);
+        double jx = hash(s, p * 0x967a889bU) * 0x1p-32;
+        double jy = hash(s, p * 0x368cc8b7U) * 0x1p-32;
+        return Sample2D{below_one((sx + (sy + jx) / n) / m),
+                        below_one((sy + (sx + jy) / m) / n)};
+    }
+
+    // Owen-scrambled Sobol point. The index is scrambled too, which shuffles the order of the
+    // points without breaking up the power-of-two blocks that are well stratified, so different
+    // dimensions are not correlated.
+    static Sample2D sobol(uint32_t index, uint32_t dim_seed) {
+        index = owen_scramble(index, hash(dim_seed));
+        return Sample2D{to_unit(owen_scramble(sobol0(index), hash(dim_seed, 1))),
+                        to_unit(owen_scramble(sobol1(index), hash(dim_seed, 2)))};
+    }
+
+    // Sobol point shared by every pixel, shifted modulo 1 by two blue-noise values (Georgiev
+    // and Fajardo 2016). Each dimension reads the tile at its own offset.
+    Sample2D blue_noise(uint32_t dim) const {
+        const BlueNoiseTile &tile = BlueNoiseTile::get();
+        uint32_t h = hash(seed, dim);
+        Sample2D p = sobol(sample, h);
+        Real du = tile.value(x + int(h & 63), y + int((h >> 6) & 63));
+        Real dv = tile.value(x + int((h >> 12) & 63), y + int((h >> 18) & 63));
+        p.u += du;
+        p.v += dv;
+        if (p.u >= 1)
+            p.u -= 1;
+        if (p.v >= 1)
+            p.v -= 1;
+        return p;
+    }
+};
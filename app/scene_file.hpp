@@ -0,0 +1,578 @@
+#pragma once
+
+#include "animation.hpp"
+#include "camera.hpp"
+#include "flat_scene.hpp"
+#include "material.hpp"
+#include "math.hpp"
+#include "mesh.hpp"
+#include "text_reader.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Scene files come in two variants, picked by extension:
+//
+// .scene  - Human-editable text, one directive per line, '#' starts a comment:
+//
+//             image_width 1920
+//             samples_per_pixel 50
+//             lookfrom 13 2 3
+//             material ground lambertian 0.5 0.5 0.5
+//             material mirror metal 0.95 0.95 0.95 0.0
+//             material lamp light 4 4 4
+//             sphere 0 -1000 0 1000 ground
+//             sphere 0 1 0 1 lamp
+//             keyframe 0 0 0 0
+//             keyframe 2 0 3 0
+//             mesh bunny.obj mirror
+//
+//           Camera directives: aspect_ratio, image_width, samples_per_pixel, max_depth, seed,
+//           vfov, lookfrom, lookat, vup, and `sky 0` for a scene lit by its lights only.
+//           Materials must be declared before the objects using them; the metal fuzz defaults
+//           to 0, a light's color is its emitted radiance. Mesh paths are relative to the scene
+//           file. `keyframe time dx dy dz` animates the sphere declared last: at `time` seconds
+//           it is moved by the offset (see SceneAnimation). Keyframes are ignored unless the
+//           caller asks for the animation.
+//
+// .bscene - Compact little-endian binary: a BinarySceneHeader, the material records, then the
+//           sphere records in the memory layout of FlatSphere. The file is memory mapped and
+//           the spheres are copied into the FlatScene in one block, without parsing or
+//           per-object allocation. Meshes are not supported in this format.
+
+/**
+ * @brief What load_scene read and how long it took.
+ */
+struct SceneFileInfo {
+    size_t spheres = 0;
+    size_t triangles = 0;
+    size_t materials = 0;
+    double load_seconds = 0;  // Reading and decoding the file
+    double build_seconds = 0; // Building the BVH
+};
+
+struct BinarySceneHeader {
+    char magic[8];      // "RTSCENE\0"
+    uint32_t version;
+    uint32_t real_size; // sizeof(Real) of the build that wrote the sphere records, 4 or 8
+    uint64_t material_count;
+    uint64_t sphere_count;
+    double aspect_ratio;
+    double vfov;
+    double lookfrom[3];
+    double lookat[3];
+    double vup[3];
+    uint64_t seed;
+    int32_t image_width;
+    int32_t samples_per_pixel;
+    int32_t max_depth;
+    uint32_t flags; // binary_scene_no_sky, 0 in files written before there were flags
+};
+
+constexpr uint32_t binary_scene_no_sky = 1; // Camera::sky is off
+
+enum class BinaryMaterialType : uint32_t {
+    Lambertian,
+    Metal,
+    DiffuseLight,
+};
+
+struct BinaryMaterial {
+    BinaryMaterialType type;
+    uint32_t reserved;
+    double albedo[3]; // Emitted radiance for lights
+
+    double fuzz;
+};
+
+// On-disk sphere record, laid out exactly like FlatSphere when T is Real.
+template <typename T>
+struct BinarySphere {
+    T center[3];
+    T radius;
+    int32_t mat_id;
+};
+
+static_assert(std::is_trivially_copyable_v<FlatSphere> &&
+                  sizeof(FlatSphere) == sizeof(BinarySphere<Real>) &&
+                  offsetof(FlatSphere, radius) == offsetof(BinarySphere<Real>, radius) &&
+                  offsetof(FlatSphere, mat_id) == offsetof(BinarySphere<Real>, mat_id),
+              "FlatSphere must match the binary sphere record");
+
+constexpr char binary_scene_magic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+constexpr uint32_t binary_scene_version = 1;
+
+/**
+ * @brief Parser of the text scene format. Works directly on the file bytes with
+ * std::from_chars, so it does not allocate per line or per number.
+ */
+class SceneTextParser {
+    public:
+    SceneTextParser(std::string_view text, const std::string &source)
+        : in(text, source), directory(std::filesystem::path(source).parent_path()) {}
+
+    // Keyframes go to `animation`, or are checked and dropped if it is null.
+    void parse(FlatScene &scene, Camera &cam, SceneAnimation *animation = nullptr) {
+        while (in.next_line()) {
+            std::string_view directive = in.token();
+            if (directive.empty())
+                continue;
+
+            if (directive == "sphere") {
+                Point3 center = vec3();
+                Real radius = Real(in.number());
+                scene.spheres.push_back(FlatSphere{center, radius, material(in.token())});
+            } else if (directive == "keyframe") {
+                if (scene.spheres.empty())
+                    in.fail("keyframe before the first sphere");
+                double time = in.number();
+                Vec3 offset = vec3();
+                if (animation)
+                    animation->add_sphere_keyframe((int)scene.spheres.size() - 1, time, offset);
+            } else if (directive == "mesh") {
+                add_mesh(scene);
+            } else if (directive == "material") {
+                add_material(scene);
+            } else if (directive == "aspect_ratio") {
+                cam.aspect_ratio = in.number();
+            } else if (directive == "image_width") {
+                cam.image_width = in.integer<int>();
+            } else if (directive == "samples_per_pixel") {
+                cam.samples_per_pixel = in.integer<int>();
+            } else if (directive == "max_depth") {
+                cam.max_depth = in.integer<int>();
+            } else if (directive == "seed") {
+                cam.seed = in.integer<uint64_t>();
+            } else if (directive == "vfov") {
+                cam.vfov = in.number();
+            } else if (directive == "lookfrom") {
+                cam.lookfrom = vec3();
+            } else if (directive == "lookat") {
+                cam.lookat = vec3();
+            } else if (directive == "vup") {
+                cam.vup = vec3();
+            } else if (directive == "sky") {
+                cam.sky = in.integer<int>() != 0;
+            } else {
+                in.fail("unknown directive '" + std::string(directive) + "'");
+            }
+
+            if (!in.at_line_end())
+                in.fail("unexpected trailing value");
+        }
+    }
+
+    private:
+    // Lets the material table be searched with string_views of the file.
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+    };
+
+    LineReader in;
+    std::filesystem::path directory; // Mesh paths are relative to it
+    std::unordered_map<std::string, int, NameHash, std::equal_to<>> material_ids;
+
+    Vec3 vec3() {
+        Real x = Real(in.number());
+        Real y = Real(in.number());
+        Real z = Real(in.number());
+        return Vec3(x, y, z);
+    }
+
+    void add_material(FlatScene &scene) {
+        std::string_view name = in.token();
+        std::string_view type = in.token();
+        if (name.empty())
+            in.fail("material needs a name");
+        if (material_ids.find(name) != material_ids.end())
+            in.fail("material '" + std::string(name) + "' is declared twice");
+
+        if (type == "lambertian") {
+            scene.materials.emplace_back(std::in_place_type<Lambertian>, vec3());
+        } else if (type == "metal") {
+            Color albedo = vec3();
+            Real fuzz = in.at_line_end() ? 0 : Real(in.number());
+            scene.materials.emplace_back(std::in_place_type<Metal>, albedo, fuzz);
+        } else if (type == "light") {
+            scene.materials.emplace_back(std::in_place_type<DiffuseLight>, vec3());
+        } else {
+            in.fail("unknown material type '" + std::string(type) + "'");
+        }
+        material_ids.emplace(name, (int)scene.materials.size() - 1);
+    }
+
+    void add_mesh(FlatScene &scene) {
+        std::string_view file = in.token();
+        if (file.empty())
+            in.fail("mesh needs an OBJ file");
+        std::string path = (directory / file).string();
+        int mat_id = material(in.token());
+        // The FlatScene hit record points at its own copy of the material, so the mesh needs
+        // none.
+        scene.meshes.push_back(FlatMesh{load_obj(path, nullptr), mat_id, path});
+    }
+
+    int material(std::string_view name) {
+        auto it = material_ids.find(name);
+        if (it == material_ids.end())
+            in.fail("undeclared material '" + std::string(name) + "'");
+        return it->second;
+    }
+};
+
+template <typename T>
+void copy_binary_spheres(const char *data, size_t count, std::vector<FlatSphere> &spheres) {
+    spheres.resize(count);
+    if constexpr (std::is_same_v<T, Real>) {
+        std::memcpy(spheres.data(), data, count * sizeof(FlatSphere));
+    } else {
+        // Written by a build of the other precision, convert record by record.
+        for (size_t i = 0; i < count; i++) {
+            BinarySphere<T> s;
+            std::memcpy(&s, data + i * sizeof(s), sizeof(s));
+            Point3 center(Real(s.center[0]), Real(s.center[1]), Real(s.center[2]));
+            spheres[i] = FlatSphere{center, Real(s.radius), s.mat_id};
+        }
+    }
+}
+
+/**
+ * @brief Decodes a memory mapped .bscene file into the (empty) scene and applies its camera.
+ */
+inline void load_scene_binary(const MappedFile &file, FlatScene &scene, Camera &cam) {
+    BinarySceneHeader header;
+    if (file.size() < sizeof(header)) {
+        throw std::runtime_error("Binary scene file is truncated.");
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, binary_scene_magic, sizeof(header.magic)) != 0 ||
+        header.version != binary_scene_version) {
+        throw std::runtime_error("Not a binary scene file, or an unsupported version.");
+    }
+    if (header.real_size != sizeof(float) && header.real_size != sizeof(double)) {
+        throw std::runtime_error("Binary scene file has an invalid scalar size.");
+    }
+
+    size_t sphere_size = header.real_size == sizeof(float) ? sizeof(BinarySphere<float>)
+                                                           : sizeof(BinarySphere<double>);
+    size_t materials_offset = sizeof(header);
+    size_t spheres_offset = materials_offset + header.material_count * sizeof(BinaryMaterial);
+    if (header.material_count > file.size() || header.sphere_count > file.size() ||
+        file.size() != spheres_offset + header.sphere_count * sphere_size) {
+        throw std::runtime_error("Binary scene file size does not match its header.");
+    }
+
+    cam.aspect_ratio = header.aspect_ratio;
+    cam.vfov = header.vfov;
+    cam.lookfrom =
+        Point3(Real(header.lookfrom[0]), Real(header.lookfrom[1]), Real(header.lookfrom[2]));
+    cam.lookat = Point3(Real(header.lookat[0]), Real(header.lookat[1]), Real(header.lookat[2]));
+    cam.vup = Vec3(Real(header.vup[0]), Real(header.vup[1]), Real(header.vup[2]));
+    cam.seed = header.seed;
+    cam.image_width = header.image_width;
+    cam.samples_per_pixel = header.samples_per_pixel;
+    cam.max_depth = header.max_depth;
+    cam.sky = (header.flags & binary_scene_no_sky) == 0;
+
+    scene.materials.reserve(header.material_count);
+    for (size_t i = 0; i < header.material_count; i++) {
+        BinaryMaterial m;
+        std::memcpy(&m, file.data() + materials_offset + i * sizeof(m), sizeof(m));
+        Color albedo(Real(m.albedo[0]), Real(m.albedo[1]), Real(m.albedo[2]));
+        switch (m.type) {
+        case BinaryMaterialType::Lambertian:
+            scene.materials.emplace_back(std::in_place_type<Lambertian>, albedo);
+            break;
+        case BinaryMaterialType::Metal:
+            scene.materials.emplace_back(std::in_place_type<Metal>, albedo, Real(m.fuzz));
+            break;
+        case BinaryMaterialType::DiffuseLight:
+            scene.materials.emplace_back(std::in_place_type<DiffuseLight>, albedo);
+            break;
+        default:
+            throw std::runtime_error("Binary scene file has an unknown material type.");
+        }
+    }
+
+    const char *sphere_data = file.data() + spheres_offset;
+    if (header.real_size == sizeof(float))
+        copy_binary_spheres<float>(sphere_data, header.sphere_count, scene.spheres);
+    else
+        copy_binary_spheres<double>(sphere_data, header.sphere_count, scene.spheres);
+
+    for (const auto &s : scene.spheres) {
+        if (s.mat_id < 0 || s.mat_id >= (int)scene.materials.size()) {
+            throw std::runtime_error("Binary scene file references a missing material.");
+        }
+    }
+}
+
+/**
+ * @brief Writer of the text scene format. Numbers are printed in their shortest exact form, so
+ * a scene survives a round trip unchanged.
+ */
+class SceneTextWriter {
+    public:
+    static void write(const std::string &path, const FlatScene &scene, const Camera &cam,
+                      const SceneAnimation *animation = nullptr) {
+        std::string out;
+        out.reserve(64 + scene.spheres.size() * 48);
+
+        out += "# Camera\naspect_ratio ";
+        append_number(out, cam.aspect_ratio);
+        out += "\nimage_width ";
+        append_number(out, cam.image_width);
+        out += "\nsamples_per_pixel ";
+        append_number(out, cam.samples_per_pixel);
+        out += "\nmax_depth ";
+        append_number(out, cam.max_depth);
+        out += "\nseed ";
+        append_number(out, cam.seed);
+        out += "\nvfov ";
+        append_number(out, cam.vfov);
+        out += "\nlookfrom";
+        append_vec3(out, cam.lookfrom);
+        out += "\nlookat";
+        append_vec3(out, cam.lookat);
+        out += "\nvup";
+        append_vec3(out, cam.vup);
+        if (!cam.sky)
+            out += "\nsky 0";
+
+        out += "\n\n# Materials\n";
+        for (size_t i = 0; i < scene.materials.size(); i++) {
+            out += "material m";
+            append_number(out, i);
+            if (auto lambertian = std::get_if<Lambertian>(&scene.materials[i])) {
+                out += " lambertian";
+                append_vec3(out, lambertian->albedo);
+            } else if (auto metal = std::get_if<Metal>(&scene.materials[i])) {
+                out += " metal";
+                append_vec3(out, metal->get_albedo());
+                out += ' ';
+                append_number(out, metal->get_fuzz());
+            } else if (auto light = std::get_if<DiffuseLight>(&scene.materials[i])) {
+                out += " light";
+                append_vec3(out, light->emit);
+            }
+            out += '\n';
+        }
+
+        if (!scene.meshes.empty())
+            out += "\n# Meshes: OBJ file, material\n";
+        for (const auto &m : scene.meshes) {
+            if (m.source.empty()) {
+                throw std::runtime_error("Only meshes loaded from OBJ files can be saved.");
+            }
+            out += "mesh " + std::filesystem::absolute(m.source).string() + " m";
+            append_number(out, m.mat_id);
+            out += '\n';
+        }
+
+        // Keyframes of each sphere, written after it.
+        std::vector<const std::vector<Keyframe> *> sphere_keys(scene.spheres.size(), nullptr);
+        if (animation) {
+            for (const auto &track : animation->get_tracks()) {
+                if (track.type != PrimitiveType::Sphere ||
+                    track.index >= (int)sphere_keys.size())
+                    throw std::runtime_error("Only animations of the scene's spheres can be "
+                                             "saved.");
+                sphere_keys[track.index] = &track.keys;
+            }
+        }
+
+        out += "\n# Spheres: center radius material, then keyframes: time offset\n";
+        for (size_t i = 0; i < scene.spheres.size(); i++) {
+            const FlatSphere &s = scene.spheres[i];
+            out += "sphere";
+            append_vec3(out, s.center);
+            out += ' ';
+            append_number(out, s.radius);
+            out += " m";
+            append_number(out, s.mat_id);
+            out += '\n';
+            if (!sphere_keys[i])
+                continue;
+            for (const Keyframe &key : *sphere_keys[i]) {
+                out += "keyframe ";
+                append_number(out, key.time);
+                append_vec3(out, key.offset);
+                out += '\n';
+            }
+        }
+
+        std::ofstream file(path, std::ios::binary);
+        file.write(out.data(), out.size());
+        if (!file) {
+            throw std::runtime_error("Could not write " + path);
+        }
+    }
+
+    private:
+    template <typename T> static void append_number(std::string &out, T value) {
+        char buf[32];
+        auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value); // Shortest exact form
+        out.append(buf, end);
+    }
+
+    static void append_vec3(std::string &out, const Vec3 &v) {
+        for (int i = 0; i < 3; i++) {
+            out += ' ';
+            append_number(out, v[i]);
+        }
+    }
+};
+
+inline void save_scene_binary(const std::string &path, const FlatScene &scene,
+                              const Camera &cam) {
+    if (!scene.meshes.empty()) {
+        throw std::runtime_error("Meshes can only be saved in .scene files.");
+    }
+
+    BinarySceneHeader header{};
+    std::memcpy(header.magic, binary_scene_magic, sizeof(header.magic));
+    header.version = binary_scene_version;
+    header.real_size = sizeof(Real);
+    header.material_count = scene.materials.size();
+    header.sphere_count = scene.spheres.size();
+    header.aspect_ratio = cam.aspect_ratio;
+    header.vfov = cam.vfov;
+    for (int i = 0; i < 3; i++) {
+        header.lookfrom[i] = cam.lookfrom[i];
+        header.lookat[i] = cam.lookat[i];
+        header.vup[i] = cam.vup[i];
+    }
+    header.seed = cam.seed;
+    header.image_width = cam.image_width;
+    header.samples_per_pixel = cam.samples_per_pixel;
+    header.max_depth = cam.max_depth;
+    header.flags = cam.sky ? 0 : binary_scene_no_sky;
+
+    std::vector<BinaryMaterial> materials(scene.materials.size());
+    for (size_t i = 0; i < scene.materials.size(); i++) {
+        BinaryMaterial &m = materials[i];
+        const Color *albedo = nullptr;
+        if (auto lambertian = std::get_if<Lambertian>(&scene.materials[i])) {
+            m.type = BinaryMaterialType::Lambertian;
+            albedo = &lambertian->albedo;
+        } else if (auto metal = std::get_if<Metal>(&scene.materials[i])) {
+            m.type = BinaryMaterialType::Metal;
+            albedo = &metal->get_albedo();
+            m.fuzz = metal->get_fuzz();
+        } else if (auto light = std::get_if<DiffuseLight>(&scene.materials[i])) {
+            m.type = BinaryMaterialType::DiffuseLight;
+            albedo = &light->emit;
+        }
+        for (int c = 0; c < 3; c++) {
+            m.albedo[c] = (*albedo)[c];
+        }
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(materials.data()),
+               materials.size() * sizeof(BinaryMaterial));
+
+    // The records are assembled field by field in a zeroed buffer, a block at a time, so the
+    // padding after mat_id (4 bytes in double builds) is written as zeros rather than whatever
+    // FlatSphere holds there, and the same scene always gives the same bytes.
+    using Record = BinarySphere<Real>;
+    constexpr size_t block = 4096;
+    std::vector<char> records(std::min(block, scene.spheres.size()) * sizeof(Record));
+    for (size_t first = 0; first < scene.spheres.size(); first += block) {
+        size_t count = std::min(block, scene.spheres.size() - first);
+        std::fill(records.begin(), records.end(), 0);
+        for (size_t i = 0; i < count; i++) {
+            const FlatSphere &s = scene.spheres[first + i];
+            char *record = records.data() + i * sizeof(Record);
+            Real center[3] = {s.center.x(), s.center.y(), s.center.z()};
+            int32_t mat_id = s.mat_id;
+            std::memcpy(record + offsetof(Record, center), center, sizeof(center));
+            std::memcpy(record + offsetof(Record, radius), &s.radius, sizeof(s.radius));
+            std::memcpy(record + offsetof(Record, mat_id), &mat_id, sizeof(mat_id));
+        }
+        file.write(records.data(), count * sizeof(Record));
+    }
+    if (!file) {
+        throw std::runtime_error("Could not write " + path);
+    }
+}
+
+inline std::string scene_file_extension(const std::string &path) {
+    std::string ext = std::filesystem::path(path).extension().string();
+    if (ext != ".scene" && ext != ".bscene") {
+        throw std::runtime_error("Unknown scene file extension '" + ext +
+                                 "', use .scene or .bscene.");
+    }
+    return ext;
+}
+
+/**
+ * @brief Replaces the contents of the scene with the spheres and materials of the file, applies
+ * its camera settings to `cam` and builds the BVH. The format is picked by extension (.scene
+ * text, .bscene binary). If `animation` is given it is replaced by the keyframes of the file,
+ * which only text files have. Throws std::runtime_error on malformed files.
+ */
+inline SceneFileInfo load_scene(const std::string &path, FlatScene &scene, Camera &cam,
+                                SceneAnimation *animation = nullptr) {
+    std::string ext = scene_file_extension(path);
+    auto start = std::chrono::steady_clock::now();
+
+    // Everything goes, instances included: their material IDs would index the new table.
+    scene = FlatScene();
+    if (animation)
+        animation->clear();
+    {
+        MappedFile file(path);
+        if (ext == ".bscene")
+            load_scene_binary(file, scene, cam);
+        else
+            SceneTextParser(std::string_view(file.data(), file.size()), path)
+                .parse(scene, cam, animation);
+    }
+    auto loaded = std::chrono::steady_clock::now();
+    scene.build();
+    auto built = std::chrono::steady_clock::now();
+
+    SceneFileInfo info;
+    info.spheres = scene.spheres.size();
+    for (const auto &m : scene.meshes) {
+        info.triangles += m.mesh->triangle_count();
+    }
+    info.materials = scene.materials.size();
+    info.load_seconds = std::chrono::duration<double>(loaded - start).count();
+    info.build_seconds = std::chrono::duration<double>(built - loaded).count();
+    return info;
+}
+
+/**
+ * @brief Writes the scene and the camera settings, in the format picked by extension (.scene
+ * text, .bscene binary). The keyframes of `animation`, if given, can only be saved to text
+ * files.
+ */
+inline void save_scene(const std::string &path, const FlatScene &scene, const Camera &cam,
+                       const SceneAnimation *animation = nullptr) {
+    if (!scene.instances.empty()) {
+        throw std::runtime_error("Scenes with instances can not be saved to a file.");
+    }
+    bool animated = animation && !animation->empty();
+    if (scene_file_extension(path) == ".bscene") {
+        if (animated)
+            throw std::runtime_error("Animated scenes can only be saved in .scene files.");
+        save_scene_binary(path, scene, cam);
+    } else {
+        SceneTextWriter::write(path, scene, cam, animated ? animation : nullptr);
+    }
+}
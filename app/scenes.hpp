@@ -0,0 +1,315 @@
+#pragma once
+
+#include "animation.hpp"
+#include "camera.hpp"
+#include "flat_scene.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+#include "math.hpp"
+#include "mesh.hpp"
+#include "objects.hpp"
+#include "transform.hpp"
+#include <string>
+#include <vector>
+
+// Canonical scenes shared by main and the benchmark. Each one fills in the world and sets up
+// the camera placement and path depth; resolution and sample count are left to the caller.
+//
+// Most scenes fill a HittableList, creating their objects in the list's arena with
+// HittableList::make. Scenes too large for one object per primitive write to a FlatSceneBuilder
+// directly.
+
+inline void scene_three_spheres(HittableList &world, Camera &cam) {
+    shared_ptr<Material> mat_a = world.make<Metal>(Color(0.8, 0.8, 0.8), 0.3);
+    shared_ptr<Material> mat_b = world.make<Metal>(Color(0.1, 0.2, 0.5));
+    shared_ptr<Material> mat_c = world.make<Metal>(Color(0.1, 0.2, 0.5), 0.1);
+
+    world.add(world.make<Sphere>(Point3(0.75, 0, -1), 0.5, mat_c));
+    world.add(world.make<Sphere>(Point3(-0.75, 0, -1), 0.5, mat_b));
+    world.add(world.make<Sphere>(Point3(0, -100.5, -1), 100, mat_a));
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.max_depth = 50;
+}
+
+/**
+ * @brief Two second animation of scene_three_spheres: the right sphere hops twice while the
+ * left one rolls towards the camera and back. Sphere indices follow the order of the scene's
+ * list.
+ */
+inline void animate_three_spheres(SceneAnimation &animation) {
+    for (int hop = 0; hop < 2; hop++) {
+        animation.add_sphere_keyframe(0, hop, Vec3(0, 0, 0));
+        animation.add_sphere_keyframe(0, hop + 0.5, Vec3(0, 0.6, 0));
+    }
+    animation.add_sphere_keyframe(0, 2, Vec3(0, 0, 0));
+    animation.add_sphere_keyframe(1, 0, Vec3(0, 0, 0));
+    animation.add_sphere_keyframe(1, 1, Vec3(0.3, 0, 0.5));
+    animation.add_sphere_keyframe(1, 2, Vec3(0, 0, 0));
+}
+
+/**
+ * @brief The final scene of Ray Tracing in One Weekend, about 500 spheres. The tree has no
+ * dielectric material, so the glass spheres are polished metal instead.
+ */
+inline void scene_rtow_final(HittableList &world, Camera &cam) {
+    Rng rng(42);
+
+    auto ground_material = world.make<Lambertian>(Color(0.5, 0.5, 0.5));
+    world.add(world.make<Sphere>(Point3(0, -1000, 0), 1000, ground_material));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double(rng);
+            Point3 center(a + 0.9 * random_double(rng), 0.2, b + 0.9 * random_double(rng));
+
+            if ((center - Point3(4, 0.2, 0)).length() <= 0.9)
+                continue;
+
+            shared_ptr<Material> sphere_material;
+            if (choose_mat < 0.8) {
+                auto albedo = Color::random(rng) * Color::random(rng);
+                sphere_material = world.make<Lambertian>(albedo);
+            } else if (choose_mat < 0.95) {
+                auto albedo = Color::random(rng, 0.5, 1);
+                auto fuzz = random_double(rng, 0, 0.5);
+                sphere_material = world.make<Metal>(albedo, fuzz);
+            } else {
+                sphere_material = world.make<Metal>(Color(0.95, 0.95, 0.95));
+            }
+            world.add(world.make<Sphere>(center, 0.2, sphere_material));
+        }
+    }
+
+    world.add(
+        world.make<Sphere>(Point3(0, 1, 0), 1.0, world.make<Metal>(Color(0.95, 0.95, 0.95))));
+    world.add(world.make<Sphere>(Point3(-4, 1, 0), 1.0,
+                                 world.make<Lambertian>(Color(0.4, 0.2, 0.1))));
+    world.add(world.make<Sphere>(Point3(4, 1, 0), 1.0,
+                                 world.make<Metal>(Color(0.7, 0.6, 0.5), 0.0)));
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.max_depth = 50;
+    cam.vfov = 20;
+    cam.lookfrom = Point3(13, 2, 3);
+    cam.lookat = Point3(0, 0, 0);
+    cam.vup = Vec3(0, 1, 0);
+}
+
+/**
+ * @brief Many small random spheres filling a box, to stress the acceleration structure.
+ */
+inline void scene_random_spheres(HittableList &world, Camera &cam, int count = 100000) {
+    Rng rng(7);
+
+    std::vector<shared_ptr<Material>> materials;
+    for (int i = 0; i < 16; i++) {
+        if (i % 2 == 0)
+            materials.push_back(world.make<Lambertian>(Color::random(rng, 0.2, 0.9)));
+        else
+            materials.push_back(
+                world.make<Metal>(Color::random(rng, 0.5, 1), random_double(rng, 0, 0.4)));
+    }
+
+    world.add(world.make<Sphere>(Point3(0, -1000, 0), 1000, materials[0]));
+    for (int i = 0; i < count; i++) {
+        Point3 center(random_double(rng, -20, 20), random_double(rng, 0.05, 10),
+                      random_double(rng, -40, 0));
+        auto radius = random_double(rng, 0.02, 0.12);
+        world.add(world.make<Sphere>(center, radius, materials[i % materials.size()]));
+    }
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.max_depth = 20;
+    cam.vfov = 50;
+    cam.lookfrom = Point3(0, 5, 12);
+    cam.lookat = Point3(0, 4, -10);
+}
+
+/**
+ * @brief A hall of mirrors: two facing metal walls with polished spheres between them, so most
+ * paths bounce until max_depth.
+ */
+inline void scene_metal_hall(HittableList &world, Camera &cam) {
+    auto wall = world.make<Metal>(Color(0.95, 0.95, 0.95), 0.0);
+    auto floor = world.make<Metal>(Color(0.9, 0.85, 0.8), 0.05);
+    auto ball = world.make<Metal>(Color(0.8, 0.9, 0.95), 0.02);
+
+    // Huge spheres stand in for planes.
+    world.add(world.make<Sphere>(Point3(-10003, 0, 0), 10000, wall));
+    world.add(world.make<Sphere>(Point3(10003, 0, 0), 10000, wall));
+    world.add(world.make<Sphere>(Point3(0, -10001, 0), 10000, floor));
+
+    for (int k = 0; k < 20; k++) {
+        world.add(
+            world.make<Sphere>(Point3(k % 2 == 0 ? -1.2 : 1.2, -0.4, -2.0 * k), 0.6, ball));
+    }
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.max_depth = 50;
+    cam.vfov = 60;
+    cam.lookfrom = Point3(0, 0.5, 4);
+    cam.lookat = Point3(0, 0, -10);
+}
+
+/**
+ * @brief Triangulated torus around the y axis, `rings` segments around the axis and `sides`
+ * around the tube, 2 * rings * sides triangles in total.
+ */
+inline shared_ptr<TriangleMesh> make_torus_mesh(const Point3 &center, Real major_radius,
+                                                Real minor_radius, int rings, int sides,
+                                                shared_ptr<Material> mat) {
+    std::vector<Point3> vertices;
+    vertices.reserve(size_t(rings) * sides);
+    for (int i = 0; i < rings; i++) {
+        Real u = 2 * pi * i / rings;
+        for (int j = 0; j < sides; j++) {
+            Real v = 2 * pi * j / sides;
+            Real r = major_radius + minor_radius * std::cos(v);
+            vertices.push_back(center + Vec3(r * std::cos(u), minor_radius * std::sin(v),
+                                             r * std::sin(u)));
+        }
+    }
+
+    std::vector<uint32_t> indices;
+    indices.reserve(size_t(rings) * sides * 6);
+    for (int i = 0; i < rings; i++) {
+        for (int j = 0; j < sides; j++) {
+            uint32_t a = i * sides + j;
+            uint32_t b = ((i + 1) % rings) * sides + j;
+            uint32_t c = ((i + 1) % rings) * sides + (j + 1) % sides;
+            uint32_t d = i * sides + (j + 1) % sides;
+            indices.insert(indices.end(), {a, b, c, a, c, d});
+        }
+    }
+    return make_shared<TriangleMesh>(std::move(vertices), std::move(indices), mat);
+}
+
+/**
+ * @brief A one million triangle torus on a diffuse floor.
+ */
+inline void scene_mesh_torus(HittableList &world, Camera &cam) {
+    world.add(world.make<Sphere>(Point3(0, -1000, 0), 1000,
+                                 world.make<Lambertian>(Color(0.5, 0.5, 0.5))));
+    world.add(make_torus_mesh(Point3(0, 0.6, 0), 1.5, 0.6, 1000, 500,
+                              world.make<Metal>(Color(0.8, 0.6, 0.3), 0.1)));
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.max_depth = 50;
+    cam.vfov = 40;
+    cam.lookfrom = Point3(0, 4, 6);
+    cam.lookat = Point3(0, 0.5, 0);
+}
+
+/**
+ * @brief A million randomly placed, rotated and scaled copies of one torus mesh. The mesh and
+ * its BVH are stored once, so memory is dominated by the instance table and the top level BVH.
+ */
+inline void scene_instanced_tori(FlatSceneBuilder &builder, Camera &cam, int count = 1000000) {
+    Rng rng(11);
+
+    std::vector<shared_ptr<Material>> materials;
+    materials.push_back(make_shared<Lambertian>(Color(0.5, 0.5, 0.5)));
+    for (int i = 0; i < 4; i++) {
+        materials.push_back(
+            make_shared<Metal>(Color::random(rng, 0.4, 0.95), random_double(rng, 0, 0.3)));
+        materials.push_back(make_shared<Lambertian>(Color::random(rng, 0.2, 0.9)));
+    }
+
+    HittableList ground;
+    ground.add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, materials[0]));
+    builder.add(ground);
+
+    shared_ptr<const Hittable> torus =
+        make_torus_mesh(Point3(0, 0, 0), 1, 0.35, 64, 32, materials[1]);
+    const double extent = 400;
+    for (int i = 0; i < count; i++) {
+        Vec3 position(random_double(rng, -extent, extent), 0.45,
+                      random_double(rng, -2 * extent, 0));
+        Transform to_world = Transform::translate(position) *
+                             Transform::rotate(Vec3::random(rng, -1, 1) + Vec3(0, 0.01, 0),
+                                               random_double(rng, 0, 360)) *
+                             Transform::scale(random_double(rng, 0.2, 0.4));
+        builder.add_instance(torus, to_world, materials[1 + i % 8]);
+    }
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.max_depth = 20;
+    cam.vfov = 40;
+    cam.lookfrom = Point3(0, 6, 10);
+    cam.lookat = Point3(0, 0, -25);
+}
+
+/**
+ * @brief A closed diffuse room lit only by a square ceiling lamp and a small bright bulb, with
+ * no sky. Bounces rarely hit the lights by chance, which is the case next-event estimation is
+ * for.
+ */
+inline void scene_lamp_room(HittableList &world, Camera &cam) {
+    auto white = world.make<Lambertian>(Color(0.73, 0.73, 0.73));
+    auto red = world.make<Lambertian>(Color(0.65, 0.05, 0.05));
+    auto green = world.make<Lambertian>(Color(0.12, 0.45, 0.15));
+
+    // Huge spheres stand in for the floor, ceiling and walls.
+    world.add(world.make<Sphere>(Point3(0, -10000, 0), 10000, white));
+    world.add(world.make<Sphere>(Point3(0, 10004, 0), 10000, white));
+    world.add(world.make<Sphere>(Point3(-10003, 0, 0), 10000, red));
+    world.add(world.make<Sphere>(Point3(10003, 0, 0), 10000, green));
+    world.add(world.make<Sphere>(Point3(0, 0, -10004), 10000, white));
+    world.add(world.make<Sphere>(Point3(0, 0, 10006), 10000, white));
+
+    world.add(world.make<Sphere>(Point3(-1.1, 0.7, -1.8), 0.7, white));
+    world.add(world.make<Sphere>(Point3(0.9, 0.5, -1.0), 0.5,
+                                 world.make<Lambertian>(Color(0.2, 0.3, 0.7))));
+    world.add(world.make<Sphere>(Point3(0.3, 0.35, 0.3), 0.35,
+                                 world.make<Lambertian>(Color(0.8, 0.6, 0.2))));
+
+    // Ceiling lamp, wound so it faces down, and a bulb hanging in a corner.
+    std::vector<Point3> lamp = {Point3(-0.5, 3.99, -2.0), Point3(0.5, 3.99, -2.0),
+                                Point3(0.5, 3.99, -1.0), Point3(-0.5, 3.99, -1.0)};
+    world.add(make_shared<TriangleMesh>(std::move(lamp),
+                                        std::vector<uint32_t>{0, 1, 2, 0, 2, 3},
+                                        world.make<DiffuseLight>(Color(10, 10, 10))));
+    world.add(world.make<Sphere>(Point3(2.2, 1.2, -3.2), 0.15,
+                                 world.make<DiffuseLight>(Color(40, 28, 16))));
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.max_depth = 8;
+    cam.sky = false;
+    cam.vfov = 70;
+    cam.lookfrom = Point3(0, 1.8, 5);
+    cam.lookat = Point3(0, 1.2, -2);
+}
+
+inline void scene_random_100k(HittableList &world, Camera &cam) {
+    scene_random_spheres(world, cam);
+}
+
+// Adapts a scene that fills a HittableList to a SceneEntry.
+template <void (*Build)(HittableList &, Camera &)>
+void build_from_list(FlatSceneBuilder &builder, Camera &cam) {
+    HittableList world;
+    Build(world, cam);
+    builder.add(world);
+}
+
+struct SceneEntry {
+    std::string name;
+    void (*build)(FlatSceneBuilder &builder, Camera &cam);
+    // The scene as a HittableList, for scenes built from one. Null otherwise.
+    void (*build_list)(HittableList &world, Camera &cam) = nullptr;
+};
+
+inline const std::vector<SceneEntry> &canonical_scenes() {
+    static const std::vector<SceneEntry> scenes = {
+        {"three_spheres", build_from_list<scene_three_spheres>, scene_three_spheres},
+        {"rtow_final", build_from_list<scene_rtow_final>, scene_rtow_final},
+        {"random_100k", build_from_list<scene_random_100k>, scene_random_100k},
+        {"metal_hall", build_from_list<scene_metal_hall>, scene_metal_hall},
+        {"lamp_room", build_from_list<scene_lamp_room>, scene_lamp_room},
+        {"mesh_torus_1m", build_from_list<scene_mesh_torus>, scene_mesh_torus},
+        {"instances_1m",
+         [](FlatSceneBuilder &builder, Camera &cam) { scene_instanced_tori(builder, cam); }},
+    };
+    return scenes;
+}
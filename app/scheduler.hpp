@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/**
+ * @brief A rectangular block of pixels, [x0, x1) x [y0, y1).
+ */
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+
+    int pixel_count() const { return (x1 - x0) * (y1 - y0); }
+};
+
+// Number of tiles of make_tiles.
+inline int tile_count(int width, int height, int tile_size) {
+    tile_size = std::max(tile_size, 1);
+    return ((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size);
+}
+
+// Tile `index` of make_tiles.
+inline Tile tile_at(int index, int width, int height, int tile_size) {
+    tile_size = std::max(tile_size, 1);
+    int columns = (width + tile_size - 1) / tile_size;
+    int x = index % columns * tile_size;
+    int y = index / columns * tile_size;
+    return Tile{x, y, std::min(x + tile_size, width), std::min(y + tile_size, height)};
+}
+
+/**
+ * @brief Splits a width x height image into square tiles of (at most) tile_size pixels,
+ * in scanline order.
+ */
+inline std::vector<Tile> make_tiles(int width, int height, int tile_size) {
+    std::vector<Tile> tiles(tile_count(width, height, tile_size));
+    for (int i = 0; i < (int)tiles.size(); i++) {
+        tiles[i] = tile_at(i, width, height, tile_size);
+    }
+    return tiles;
+}
+
+/**
+ * @brief Persistent pool of worker threads running batches of tasks with work stealing.
+ *
+ * Each batch is dealt round-robin onto per-worker queues. A worker pops tasks from the back of
+ * its own queue and, once that is empty, steals from the front of the others. Tasks are coarse
+ * (a tile each), so a mutex per queue is uncontended in practice.
+ */
+class ThreadPool {
+    public:
+    /**
+     * @brief Non-owning reference to the callable of a batch, task(task_index, worker_index).
+     * Unlike std::function it never allocates; the callable only has to outlive run().
+     */
+    class Task {
+        public:
+        template <typename F>
+            requires(!std::is_same_v<F, Task>)
+        Task(const F &f)
+            : context(&f), invoke([](const void *c, int task_index, int worker_index) {
+                  (*static_cast<const F *>(c))(task_index, worker_index);
+              }) {}
+
+        void operator()(int task_index, int worker_index) const {
+            invoke(context, task_index, worker_index);
+        }
+
+        private:
+        const void *context;
+        void (*invoke)(const void *context, int task_index, int worker_index);
+    };
+
+    /**
+     * @param thread_count Number of workers, 0 uses every hardware thread.
+     */
+    explicit ThreadPool(int thread_count = 0) {
+        if (thread_count <= 0)
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+        queues = std::vector<WorkerQueue>(thread_count);
+        workers.reserve(thread_count);
+        for (int i = 0; i < thread_count; i++) {
+            workers.emplace_back([this, i](std::stop_token stop) { worker_loop(stop, i); });
+        }
+    }
+
+    ~ThreadPool() {
+        // Destroying a std::jthread requests a stop and joins it. Do it before the rest of the
+        // members go away.
+        workers.clear();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int size() const { return (int)workers.size(); }
+
+    /**
+     * @brief Runs task(i, worker) for every i in [0, task_count) and blocks until all are done.
+     */
+    void run(int task_count, const Task &task) {
+        if (task_count <= 0)
+            return;
+
+        // The previous batch drained every queue. Refilling them keeps their capacity, so a
+        // batch no larger than the last one does not allocate.
+        for (auto &q : queues) {
+            std::lock_guard lock(q.m);
+            q.tasks.clear();
+            q.head = 0;
+        }
+        for (int i = 0; i < task_count; i++) {
+            auto &q = queues[i % queues.size()];
+            std::lock_guard lock(q.m);
+            q.tasks.push_back(i);
+        }
+
+        std::unique_lock lock(m);
+        current_task = &task;
+        tasks_remaining = task_count;
+        generation++;
+        wake.notify_all();
+
+        done.wait(lock, [this] { return tasks_remaining == 0 && active_workers == 0; });
+        current_task = nullptr;
+    }
+
+    private:
+    struct WorkerQueue {
+        std::mutex m;
+        std::vector<int> tasks; // Tasks [head, size) are left
+        size_t head = 0;
+    };
+
+    std::vector<WorkerQueue> queues;
+
+    std::mutex m;
+    std::condition_variable_any wake;
+    std::condition_variable_any done;
+    const Task *current_task = nullptr;
+    uint64_t generation = 0;
+    int tasks_remaining = 0;
+    int active_workers = 0;
+
+    std::vector<std::jthread> workers;
+
+    void worker_loop(std::stop_token stop, int index) {
+        uint64_t seen_generation = 0;
+
+        while (true) {
+            const Task *task;
+            {
+                std::unique_lock lock(m);
+                if (!wake.wait(lock, stop, [&] { return generation != seen_generation; }))
+                    return; // Stop requested.
+
+                seen_generation = generation;
+                if (current_task == nullptr)
+                    continue; // Woke up after the batch already finished.
+                task = current_task;
+                active_workers++;
+            }
+
+            int completed = 0;
+            int task_index;
+            while (next_task(index, task_index)) {
+                (*task)(task_index, index);
+                completed++;
+            }
+
+            std::lock_guard lock(m);
+            tasks_remaining -= completed;
+            active_workers--;
+            if (tasks_remaining == 0 && active_workers == 0)
+                done.notify_all();
+        }
+    }
+
+    bool next_task(int index, int &task_index) {
+        {
+            auto &own = queues[index];
+            std::lock_guard lock(own.m);
+            if (own.tasks.size() > own.head) {
+                task_index = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        // Own queue is drained, try to steal from the other workers.
+        for (int offset = 1; offset < (int)queues.size(); offset++) {
+            auto &victim = queues[(index + offset) % queues.size()];
+            std::lock_guard lock(victim.m);
+            if (victim.tasks.size() > victim.head) {
+                task_index = victim.tasks[victim.head++];
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/**
+ * @brief Prints the render progress from its own thread. Workers only bump an atomic counter,
+ * so they never block on the console.
+ */
+class ProgressReporter {
+    public:
+    ProgressReporter(int64_t total)
+        : total(total), reporter([this](std::stop_token stop) { report_loop(stop); }) {}
+
+    ~ProgressReporter() { finish(); }
+
+    void add(int64_t count) { completed.fetch_add(count, std::memory_order_relaxed); }
+
+    void finish() {
+        if (!reporter.joinable())
+            return;
+        reporter.request_stop();
+        reporter.join();
+        std::clog << "\rDone.                 \n";
+    }
+
+    private:
+    int64_t total;
+    std::atomic<int64_t> completed = 0;
+    std::jthread reporter;
+
+    void report_loop(std::stop_token stop) {
+        std::mutex m;
+        std::condition_variable_any cv;
+        std::unique_lock lock(m);
+        while (!stop.stop_requested()) {
+            int64_t remaining = total - completed.load(std::memory_order_relaxed);
+            std::clog << "\rRemaining: " << remaining << "        " << std::flush;
+            cv.wait_for(lock, stop, std::chrono::milliseconds(100), [] { return false; });
+        }
+    }
+};
@@ -0,0 +1,227 @@
+#pragma once
+
+#include "camera.hpp"
+#include "hittable.hpp"
+#include "image.hpp"
+#include "math.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Outcome of RenderSession::render_until.
+ */
+struct BudgetReport {
+    int samples = 0;     // Samples per pixel added, all pixels got the same number
+    int passes = 0;
+    double seconds = 0;  // Time spent tracing
+    int64_t rays = 0;
+    int64_t primary_rays = 0;   // Summed over the passes, as in RenderStats
+    int64_t secondary_rays = 0;
+
+    double rays_per_second() const { return seconds > 0 ? rays / seconds : 0; }
+    double average_path_length() const {
+        return primary_rays > 0 ? double(primary_rays + secondary_rays) / primary_rays : 0;
+    }
+};
+
+/**
+ * @brief Progressive render of a scene through a camera. Samples accumulate across calls to
+ * add_samples, so a preview can be refined without repeating earlier work, and the current
+ * image can be taken at any time. N calls of k samples render the same image as one render
+ * of N * k samples per pixel.
+ *
+ * Each call compares the camera settings that change the image with those the accumulated
+ * samples were taken with: a new image size reallocates the buffer, any other change clears it.
+ * Settings that only change the speed (threads, tiles, packet or wavefront tracing) keep it.
+ * Adaptive sampling is not used. Edits to a scene passed as a Hittable cannot be detected, call
+ * reset() after changing it; a session made by from_snapshots picks up each commit to the list.
+ */
+class RenderSession {
+    public:
+    RenderSession(Camera &camera, const Hittable &world) : camera(camera), world(&world) {}
+
+    /**
+     * @brief Session that renders the latest snapshot committed to `scene`, rather than the
+     * list itself. Every add_samples call checks for a newer snapshot and, if there is one,
+     * switches to it and discards the samples of the old one. The host can edit and commit the
+     * list while a pass renders.
+     */
+    static RenderSession from_snapshots(Camera &camera, const HittableList &scene) {
+        RenderSession session(camera, scene);
+        session.source = &scene;
+        return session;
+    }
+
+    /**
+     * @brief Traces `count` more samples per pixel and adds them to the accumulated image.
+     */
+    void add_samples(int count) {
+        sync();
+        camera.add_samples(*world, samples, count, sums);
+        samples += count;
+    }
+
+    /**
+     * @brief Adds passes over the whole image until the next pass would not finish by
+     * `deadline`, or until the session holds `max_samples` samples per pixel (0 for no limit).
+     *
+     * The first pass takes one sample per pixel, so there is always an image. After each pass
+     * the time per sample measured so far sizes the next one to fill the remaining time, up to
+     * double the samples taken so far so a slow start is corrected early. Passes are never cut
+     * short, so every pixel ends with the same number of samples.
+     */
+    BudgetReport render_until(std::chrono::steady_clock::time_point deadline,
+                              int max_samples = 0) {
+        // Margin against jitter in the measured throughput.
+        constexpr double safety = 0.9;
+
+        BudgetReport report;
+        int pass_samples = 1;
+        while (true) {
+            if (max_samples > 0)
+                pass_samples = std::min(pass_samples, max_samples - samples);
+            if (pass_samples < 1)
+                break;
+
+            add_samples(pass_samples);
+            report.samples += pass_samples;
+            report.passes++;
+            report.seconds += camera.stats().seconds;
+            report.rays += camera.stats().total_rays();
+            report.primary_rays += camera.stats().primary_rays;
+            report.secondary_rays += camera.stats().secondary_rays;
+
+            double seconds_per_sample = report.seconds / report.samples;
+            std::chrono::duration<double> remaining_time =
+                deadline - std::chrono::steady_clock::now();
+            double remaining = remaining_time.count();
+            double affordable = remaining * safety / seconds_per_sample;
+            pass_samples = (int)std::min(affordable, 2.0 * std::max(samples, 1));
+        }
+        return report;
+    }
+
+    // Switches to another scene, which discards the accumulated samples.
+    void set_world(const Hittable &new_world) {
+        world = &new_world;
+        source = nullptr;
+        current.reset();
+        reset();
+    }
+
+    // Discards the accumulated samples, keeping the buffer.
+    void reset() {
+        samples = 0;
+        std::fill(sums.begin(), sums.end(), Color(0, 0, 0));
+    }
+
+    int sample_count() const { return samples; }
+    int width() const { return settings.image_width; }
+    int height() const { return sums.empty() ? 0 : (int)(sums.size() / settings.image_width); }
+
+    // The mean of the samples so far, row by row. Empty before the first samples.
+    std::vector<Color> snapshot() const {
+        std::vector<Color> image;
+        snapshot(image);
+        return image;
+    }
+
+    // Like snapshot(), into an existing vector to reuse its memory.
+    void snapshot(std::vector<Color> &image) const {
+        image.resize(samples > 0 ? sums.size() : 0);
+        Real scale = 1.0 / samples;
+        for (size_t p = 0; p < image.size(); p++) {
+            image[p] = sums[p] * scale;
+        }
+    }
+
+    void write(const std::string &path) const {
+        write_image(path, snapshot(), width(), height());
+    }
+
+    // Measurements of the last add_samples call.
+    const RenderStats &stats() const { return camera.stats(); }
+
+    private:
+    // Camera settings the accumulated samples depend on.
+    struct Settings {
+        int image_width = 0;
+        double aspect_ratio = 0;
+        int max_depth = 0;
+        uint64_t seed = 0;
+        SamplerType sampler_type = SamplerType::Independent;
+        int pattern_samples = 0; // Samples per pixel of the stratified pattern, else 0
+        double vfov = 0;
+        std::array<Real, 9> frame{}; // lookfrom, lookat and vup
+        bool russian_roulette = false;
+        int roulette_min_depth = 0;
+        Real min_throughput = 0;
+        bool sky = true;
+        bool next_event_estimation = true;
+
+        bool operator==(const Settings &) const = default;
+    };
+
+    Camera &camera;
+    const Hittable *world;
+    const HittableList *source = nullptr;    // Scene whose snapshots are followed, if any
+    shared_ptr<const SceneSnapshot> current; // Snapshot being rendered, from `source`
+    std::vector<Color> sums; // Sum of the samples of each pixel
+    int samples = 0;
+    Settings settings;
+
+    static Settings settings_of(const Camera &c) {
+        Settings s;
+        s.image_width = c.image_width;
+        s.aspect_ratio = c.aspect_ratio;
+        s.max_depth = c.max_depth;
+        s.seed = c.seed;
+        s.sampler_type = c.sampler_type;
+        s.pattern_samples = c.sampler_type == SamplerType::Stratified ? c.samples_per_pixel : 0;
+        s.vfov = c.vfov;
+        for (int k = 0; k < 3; k++) {
+            s.frame[k] = c.lookfrom[k];
+            s.frame[3 + k] = c.lookat[k];
+            s.frame[6 + k] = c.vup[k];
+        }
+        s.russian_roulette = c.russian_roulette;
+        s.roulette_min_depth = c.roulette_min_depth;
+        s.min_throughput = c.min_throughput;
+        s.sky = c.sky;
+        s.next_event_estimation = c.next_event_estimation;
+        return s;
+    }
+
+    void sync() {
+        if (source) {
+            auto latest = source->snapshot();
+            if (!latest) {
+                throw std::runtime_error(
+                    "RenderSession: nothing was committed to the scene yet.");
+            }
+            if (latest != current) {
+                current = std::move(latest);
+                world = current.get();
+                reset();
+            }
+        }
+
+        Settings now = settings_of(camera);
+        if (now == settings)
+            return;
+
+        size_t pixel_count = size_t(camera.image_width) * camera.get_image_height();
+        if (sums.size() != pixel_count) {
+            sums.assign(pixel_count, Color(0, 0, 0));
+        }
+        settings = now;
+        reset();
+    }
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+// Hot-path instrumentation, compiled in with -DRT_ENABLE_STATS (CMake option RT_STATS).
+// RT_STAT(statement) disappears entirely otherwise.
+#ifdef RT_ENABLE_STATS
+#define RT_STAT(statement) statement
+#else
+#define RT_STAT(statement)
+#endif
+
+/**
+ * @brief Event counters of one thread. Every thread increments its own thread_local copy, so
+ * the hot loop has no shared atomics; Stats::collect() merges them once the render is done.
+ */
+struct StatCounters {
+    static constexpr int depth_slots = 64;
+    static constexpr int material_slots = 8;
+
+    std::array<int64_t, depth_slots> rays_per_depth{}; // Index 0 holds the camera rays
+    int64_t world_queries = 0;          // Closest hit queries issued by the camera
+    int64_t world_hits = 0;             // Queries that hit something
+    int64_t bvh_nodes_visited = 0;
+    int64_t primitive_tests = 0;        // Hittable::hit calls on individual objects
+    int64_t max_depth_terminations = 0; // Paths still bouncing when max_depth was reached
+
+    // Material::scatter calls, keyed by Material::type_name().
+    std::array<const char *, material_slots> material_names{};
+    std::array<int64_t, material_slots> scatter_calls{};
+
+    void count_ray(int depth) { rays_per_depth[std::min(depth, depth_slots - 1)]++; }
+
+    void count_scatter(const char *name, int64_t n = 1) {
+        for (int i = 0; i < material_slots; i++) {
+            if (material_names[i] == nullptr)
+                material_names[i] = name;
+            if (material_names[i] == name || std::strcmp(material_names[i], name) == 0) {
+                scatter_calls[i] += n;
+                return;
+            }
+        }
+    }
+
+    // Cost of the work done so far, used for the per-pixel cost image.
+    int64_t cost() const { return bvh_nodes_visited + primitive_tests; }
+
+    void merge(const StatCounters &other) {
+        for (int d = 0; d < depth_slots; d++) {
+            rays_per_depth[d] += other.rays_per_depth[d];
+        }
+        world_queries += other.world_queries;
+        world_hits += other.world_hits;
+        bvh_nodes_visited += other.bvh_nodes_visited;
+        primitive_tests += other.primitive_tests;
+        max_depth_terminations += other.max_depth_terminations;
+        for (int i = 0; i < material_slots && other.material_names[i]; i++) {
+            count_scatter(other.material_names[i], other.scatter_calls[i]);
+        }
+    }
+
+    void print(std::ostream &out) const {
+        int64_t rays = 0;
+        for (auto n : rays_per_depth) {
+            rays += n;
+        }
+        out << "Stats:\n";
+        out << "  Rays cast: " << rays << "\n";
+        for (int d = 0; d < depth_slots; d++) {
+            if (rays_per_depth[d] > 0)
+                out << "    depth " << d << ": " << rays_per_depth[d] << "\n";
+        }
+        out << "  World queries: " << world_queries << " (" << world_hits << " hits)\n";
+        out << "  BVH nodes visited: " << bvh_nodes_visited << "\n";
+        out << "  Primitive tests: " << primitive_tests << "\n";
+        out << "  Paths cut by max_depth: " << max_depth_terminations << "\n";
+        for (int i = 0; i < material_slots && material_names[i]; i++) {
+            out << "  " << material_names[i] << "::scatter calls: " << scatter_calls[i] << "\n";
+        }
+    }
+};
+
+/**
+ * @brief Owns the registry of per-thread counters.
+ */
+class Stats {
+    public:
+    // Counters of the calling thread.
+    static StatCounters &local() {
+        thread_local ThreadCounters counters;
+        return counters;
+    }
+
+    // Zeroes the counters of every thread. Only call while no render is running.
+    static void reset() {
+        std::lock_guard lock(registry().m);
+        for (auto *c : registry().live) {
+            *static_cast<StatCounters *>(c) = StatCounters();
+        }
+        registry().retired = StatCounters();
+    }
+
+    // Sums the counters of every thread. Only call while no render is running.
+    static StatCounters collect() {
+        std::lock_guard lock(registry().m);
+        StatCounters total = registry().retired;
+        for (auto *c : registry().live) {
+            total.merge(*c);
+        }
+        return total;
+    }
+
+    private:
+    struct ThreadCounters;
+
+    struct Registry {
+        std::mutex m;
+        std::vector<ThreadCounters *> live;
+        StatCounters retired; // Counts of threads that have exited
+    };
+
+    static Registry &registry() {
+        static Registry r;
+        return r;
+    }
+
+    struct ThreadCounters : StatCounters {
+        ThreadCounters() {
+            std::lock_guard lock(registry().m);
+            registry().live.push_back(this);
+        }
+
+        ~ThreadCounters() {
+            std::lock_guard lock(registry().m);
+            auto &live = registry().live;
+            live.erase(std::remove(live.begin(), live.end(), this), live.end());
+            registry().retired.merge(*this);
+        }
+    };
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RT_HAS_MMAP 1
+#else
+#define RT_HAS_MMAP 0
+#endif
+
+/**
+ * @brief Read-only view of a whole file, memory mapped where the platform supports it and read
+ * into a buffer otherwise.
+ */
+class MappedFile {
+    public:
+    explicit MappedFile(const std::string &path) {
+#if RT_HAS_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Could not stat " + path);
+        }
+        length = size_t(st.st_size);
+        if (length > 0) {
+            void *p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Could not map " + path);
+            }
+            ptr = static_cast<const char *>(p);
+            mapped = true;
+        }
+        ::close(fd); // The mapping stays valid after the descriptor is closed.
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Could not open " + path);
+        }
+        buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        ptr = buffer.data();
+        length = buffer.size();
+#endif
+    }
+
+    ~MappedFile() {
+#if RT_HAS_MMAP
+        if (mapped)
+            ::munmap(const_cast<char *>(ptr), length);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return ptr; }
+    size_t size() const { return length; }
+
+    private:
+    const char *ptr = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::vector<char> buffer;
+};
+
+/**
+ * @brief Splits a text file into lines and whitespace separated tokens without copying or
+ * allocating. '#' starts a comment that runs to the end of the line. Errors are reported as
+ * std::runtime_error naming the source and line.
+ */
+class LineReader {
+    public:
+    LineReader(std::string_view text, std::string source)
+        : text(text), source(std::move(source)) {}
+
+    // Advances to the next line, returns false at the end of the text.
+    bool next_line() {
+        if (text.empty())
+            return false;
+        size_t end = text.find('\n');
+        line = text.substr(0, end);
+        text = end == std::string_view::npos ? std::string_view() : text.substr(end + 1);
+        if (size_t comment = line.find('#'); comment != std::string_view::npos)
+            line = line.substr(0, comment);
+        line_number++;
+        return true;
+    }
+
+    // Next token of the current line, empty at the end of the line.
+    std::string_view token() {
+        size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string_view::npos) {
+            line = {};
+            return {};
+        }
+        size_t end = line.find_first_of(" \t\r", begin);
+        std::string_view tok =
+            line.substr(begin, end == std::string_view::npos ? end : end - begin);
+        line = end == std::string_view::npos ? std::string_view() : line.substr(end);
+        return tok;
+    }
+
+    bool at_line_end() const {
+        return line.find_first_not_of(" \t\r") == std::string_view::npos;
+    }
+
+    double number() {
+        std::string_view tok = token();
+        double value = 0;
+        auto [end, ec] = std::from_chars(tok.data(), tok.data() + tok.size(), value);
+        if (tok.empty() || ec != std::errc() || end != tok.data() + tok.size())
+            fail("expected a number, got '" + std::string(tok) + "'");
+        return value;
+    }
+
+    template <typename T> T integer() {
+        std::string_view tok = token();
+        T value = 0;
+        auto [end, ec] = std::from_chars(tok.data(), tok.data() + tok.size(), value);
+        if (tok.empty() || ec != std::errc() || end != tok.data() + tok.size())
+            fail("expected an integer, got '" + std::string(tok) + "'");
+        return value;
+    }
+
+    [[noreturn]] void fail(const std::string &message) const {
+        throw std::runtime_error(source + " line " + std::to_string(line_number) + ": " +
+                                 message);
+    }
+
+    private:
+    std::string_view text; // Not yet read
+    std::string_view line; // Rest of the current line
+    std::string source;
+    size_t line_number = 0;
+};
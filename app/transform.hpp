@@ -0,0 +1,141 @@
+#pragma once
+
+#include "aabb.hpp"
+#include "interval.hpp"
+#include "math.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+/**
+ * @brief Affine transform stored as a row-major 3x4 matrix: the 3x3 linear part followed by the
+ * translation column.
+ */
+class Transform {
+    public:
+    Real m[3][4];
+
+    // Identity.
+    Transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+    static Transform translate(const Vec3 &offset) {
+        Transform t;
+        for (int r = 0; r < 3; r++) {
+            t.m[r][3] = offset[r];
+        }
+        return t;
+    }
+
+    static Transform scale(const Vec3 &factors) {
+        Transform t;
+        for (int r = 0; r < 3; r++) {
+            t.m[r][r] = factors[r];
+        }
+        return t;
+    }
+
+    static Transform scale(Real factor) { return scale(Vec3(factor, factor, factor)); }
+
+    // Rotation by `degrees` around `axis` (right-handed, Rodrigues' formula).
+    static Transform rotate(const Vec3 &axis, Real degrees) {
+        Vec3 a = unit_vector(axis);
+        Real theta = degrees_to_radians(degrees);
+        Real c = std::cos(theta), s = std::sin(theta), k = 1 - c;
+        Transform t;
+        t.m[0][0] = a.x() * a.x() * k + c;
+        t.m[0][1] = a.x() * a.y() * k - a.z() * s;
+        t.m[0][2] = a.x() * a.z() * k + a.y() * s;
+        t.m[1][0] = a.y() * a.x() * k + a.z() * s;
+        t.m[1][1] = a.y() * a.y() * k + c;
+        t.m[1][2] = a.y() * a.z() * k - a.x() * s;
+        t.m[2][0] = a.z() * a.x() * k - a.y() * s;
+        t.m[2][1] = a.z() * a.y() * k + a.x() * s;
+        t.m[2][2] = a.z() * a.z() * k + c;
+        return t;
+    }
+
+    // Composition: applies `b` first, then this transform.
+    Transform operator*(const Transform &b) const {
+        Transform t;
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 4; c++) {
+                t.m[r][c] = m[r][0] * b.m[0][c] + m[r][1] * b.m[1][c] + m[r][2] * b.m[2][c];
+            }
+            t.m[r][3] += m[r][3];
+        }
+        return t;
+    }
+
+    Point3 point(const Point3 &p) const {
+        return Point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                      m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                      m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+    }
+
+    Vec3 vector(const Vec3 &v) const {
+        return Vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                    m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                    m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+    }
+
+    // Applies the transpose of the linear part. Normals are transformed to world space with the
+    // transpose of the world-to-object transform, so an instance only needs that one matrix.
+    Vec3 transpose_vector(const Vec3 &v) const {
+        return Vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                    m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                    m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+    }
+
+    Transform inverse() const {
+        // Inverse of the linear part from its cofactors, then the translation is undone.
+        Real det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                   m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                   m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        if (det == 0) {
+            throw std::runtime_error("Transform is not invertible.");
+        }
+        Real inv_det = 1 / det;
+
+        Transform t;
+        t.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+        t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+        t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+        t.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+        t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+        t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+        t.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+        t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+        t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+        Vec3 offset = t.vector(Vec3(m[0][3], m[1][3], m[2][3]));
+        for (int r = 0; r < 3; r++) {
+            t.m[r][3] = -offset[r];
+        }
+        return t;
+    }
+
+    // Largest factor by which the transform can stretch a vector (infinity norm of the linear
+    // part).
+    Real max_stretch() const {
+        Real stretch = 0;
+        for (int r = 0; r < 3; r++) {
+            stretch = std::max(stretch,
+                               std::fabs(m[r][0]) + std::fabs(m[r][1]) + std::fabs(m[r][2]));
+        }
+        return stretch;
+    }
+
+    // Bounding box of the transformed box, from its eight corners.
+    AABB box(const AABB &b) const {
+        if (b.is_empty())
+            return b;
+        AABB result;
+        for (int corner = 0; corner < 8; corner++) {
+            Point3 p((corner & 1) ? b.x.max : b.x.min, (corner & 2) ? b.y.max : b.y.min,
+                     (corner & 4) ? b.z.max : b.z.min);
+            Point3 q = point(p);
+            result = AABB(result, AABB(q, q));
+        }
+        return result;
+    }
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "denoise.hpp"
+#include "hittable.hpp"
+#include "material.hpp"
+#include "math.hpp"
+#include "ray.hpp"
+#include "sampler.hpp"
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Paths in flight in the wavefront integrator, stored as one array per field (SoA).
+ *
+ * Each stage of a bounce walks the whole queue and only touches the fields it needs, so the
+ * intersection stage streams through origins and directions without dragging throughputs and
+ * random generators through the cache.
+ */
+struct PathQueue {
+    std::vector<Real> ox, oy, oz;    // Ray origins
+    std::vector<Real> dx, dy, dz;    // Ray directions
+    std::vector<Real> tr, tg, tb;    // Throughput, the product of the attenuations so far
+    std::vector<Real> pdf;           // Density of the ray's direction (Camera::surface_light)
+    std::vector<uint32_t> slot;      // Where the path's final color goes in the wave's results
+    std::vector<Sampler> sampler;    // Sample source of the path's camera sample
+
+    // The arrays only grow, `count` paths are in the queue.
+    int size() const { return count; }
+    void clear() { count = 0; }
+
+    void reserve(int n) {
+        if ((int)slot.size() >= n)
+            return;
+        for (auto *v : {&ox, &oy, &oz, &dx, &dy, &dz, &tr, &tg, &tb, &pdf}) {
+            v->resize(n);
+        }
+        slot.resize(n);
+        sampler.resize(n);
+    }
+
+    // Appends a path. There must be room for it, see reserve.
+    void push(const Ray &r, const Color &throughput, Real ray_pdf, uint32_t s,
+              const Sampler &g) {
+        int i = count++;
+        ox[i] = r.origin().x();
+        oy[i] = r.origin().y();
+        oz[i] = r.origin().z();
+        dx[i] = r.direction().x();
+        dy[i] = r.direction().y();
+        dz[i] = r.direction().z();
+        tr[i] = throughput.x();
+        tg[i] = throughput.y();
+        tb[i] = throughput.z();
+        pdf[i] = ray_pdf;
+        slot[i] = s;
+        sampler[i] = g;
+    }
+
+    Ray ray(int i) const { return Ray(Point3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i])); }
+    Color throughput(int i) const { return Color(tr[i], tg[i], tb[i]); }
+
+    private:
+    int count = 0;
+};
+
+// Material bins of the scatter stage. Lambertian and Metal get dedicated kernels, lights and
+// anything else share the generic one.
+enum class MaterialBin : uint8_t {
+    Lambertian,
+    Metal,
+    Other,
+};
+
+constexpr int material_bin_count = 3;
+
+inline MaterialBin material_bin(const Material &mat) {
+    switch (mat.kind()) {
+    case MaterialKind::Lambertian:
+        return MaterialBin::Lambertian;
+    case MaterialKind::Metal:
+        return MaterialBin::Metal;
+    default:
+        return MaterialBin::Other;
+    }
+}
+
+// The bins of the closed set, known from the type alone.
+inline MaterialBin material_bin(const Lambertian &) { return MaterialBin::Lambertian; }
+inline MaterialBin material_bin(const Metal &) { return MaterialBin::Metal; }
+inline MaterialBin material_bin(const DiffuseLight &) { return MaterialBin::Other; }
+
+/**
+ * @brief Scratch buffers of one worker's wavefront, reused from tile to tile so a tile
+ * allocates nothing once the buffers have grown.
+ */
+struct WavefrontBuffers {
+    PathQueue current;               // Paths to extend this bounce
+    PathQueue next;                  // Paths that survived, compacted
+    std::vector<HitRecord> recs;     // Intersection of each path in `current`
+    std::vector<uint8_t> hit;
+    std::vector<uint8_t> bin;        // MaterialBin of each hit
+    std::vector<int> order;          // Path indices grouped by material bin
+    std::vector<Color> results;      // Color of every sample in the wave, summed as paths go
+    std::vector<AOVPath> aovs;       // AOVs of every sample in the wave, if recorded
+};